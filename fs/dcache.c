@@ -0,0 +1,176 @@
+#include "dcache.h"
+#include "ext2fs.h"
+#include <sync/spinlock.h>
+#include <uniks/defs.h>
+#include <uniks/kstdio.h>
+#include <uniks/kstring.h>
+#include <uniks/list.h>
+#include <uniks/param.h>
+
+
+/**
+ * @brief The cache of directory entries looked up by namex(), keyed by the
+ * directory's (dev, i_no) and the name. An entry with d_ino 0 records a name
+ * known to be absent. Entries hold no inode reference, so the directory and the
+ * file may leave the inode table while their entry stays; whoever changes a
+ * directory's content drops the entries it affects, under the directory's
+ * `i_mtx` like every lookup that fills one.
+ */
+struct dentry_t {
+	dev_t d_dev;
+	uint32_t d_parent;   // i_no of the directory
+	uint32_t d_ino;	     // 0 if no such name in the directory
+	char d_name[DNAME_LEN + 1];
+	struct list_node_t d_hash;
+	struct list_node_t d_lru;
+};
+
+// `lock` guards all of it
+struct dcache_t {
+	struct spinlock_t lock;
+	struct list_node_t hash_table[HASH_TABLE_PRIME];
+	struct list_node_t lru_list;   // unhashed ones first, then LRU first
+	struct dentry_t dentries[NDENTRY];
+	uint64_t hits, misses;
+} dcache;
+
+static uint32_t dhashfn(dev_t dev, uint32_t parent, char *name)
+{
+	uint32_t h = dev ^ parent;
+	while (*name)
+		h = h * 31 + *name++;
+	return h % HASH_TABLE_PRIME;
+}
+
+
+void dcache_init()
+{
+	initlock(&dcache.lock, "dcache");
+	INIT_LIST_HEAD(&dcache.lru_list);
+	for (int32_t i = 0; i < HASH_TABLE_PRIME; i++)
+		INIT_LIST_HEAD(&dcache.hash_table[i]);
+	for (int32_t i = 0; i < NDENTRY; i++) {
+		INIT_LIST_HEAD(&dcache.dentries[i].d_hash);
+		list_add_tail(&dcache.dentries[i].d_lru, &dcache.lru_list);
+	}
+	dcache.hits = dcache.misses = 0;
+}
+
+// Caller must hold `dcache.lock`.
+static struct dentry_t *find_dentry_inhash(struct m_inode_t *dp, char *name)
+{
+	struct list_node_t *chain =
+		&dcache.hash_table[dhashfn(dp->i_dev, dp->i_no, name)];
+	for (struct list_node_t *l = list_next(chain); l != chain;
+	     l = list_next(l)) {
+		struct dentry_t *de = element_entry(l, struct dentry_t, d_hash);
+		if (de->d_dev == dp->i_dev and de->d_parent == dp->i_no and
+		    strcmp(de->d_name, name) == 0)
+			return de;
+	}
+	return NULL;
+}
+
+// Caller must hold `dcache.lock`.
+static void dentry_drop(struct dentry_t *de)
+{
+	list_del_then_init(&de->d_hash);
+	list_del(&de->d_lru);
+	list_add_front(&de->d_lru, &dcache.lru_list);
+}
+
+/**
+ * @brief Look `name` up in the directory `dp` without reading it. Caller must
+ * hold `dp->i_mtx`.
+ * @param dp
+ * @param name
+ * @param i_no set to the inode number found, 0 if the name is known absent
+ * @return int32_t: 1 if the cache knows the answer, else 0
+ */
+int32_t dcache_lookup(struct m_inode_t *dp, char *name, uint32_t *i_no)
+{
+	struct dentry_t *de;
+
+	acquire(&dcache.lock);
+	if ((de = find_dentry_inhash(dp, name)) == NULL) {
+		dcache.misses++;
+		release(&dcache.lock);
+		return 0;
+	}
+	dcache.hits++;
+	*i_no = de->d_ino;
+	list_del(&de->d_lru);
+	list_add_tail(&de->d_lru, &dcache.lru_list);
+	release(&dcache.lock);
+	return 1;
+}
+
+/**
+ * @brief Remember what dirlookup() found for `name` in `dp`, 0 for nothing.
+ * Caller must hold `dp->i_mtx`.
+ * @param dp
+ * @param name
+ * @param i_no
+ */
+void dcache_add(struct m_inode_t *dp, char *name, uint32_t i_no)
+{
+	struct dentry_t *de;
+
+	if (strlen(name) > DNAME_LEN)
+		return;
+	acquire(&dcache.lock);
+	if ((de = find_dentry_inhash(dp, name)) == NULL) {
+		de = element_entry(list_next_then_del(&dcache.lru_list),
+				   struct dentry_t, d_lru);
+		list_del_then_init(&de->d_hash);
+		de->d_dev = dp->i_dev;
+		de->d_parent = dp->i_no;
+		strcpy(de->d_name, name);
+		list_add_front(&de->d_hash,
+			       &dcache.hash_table[dhashfn(dp->i_dev, dp->i_no,
+							  name)]);
+	} else
+		list_del(&de->d_lru);
+	de->d_ino = i_no;
+	list_add_tail(&de->d_lru, &dcache.lru_list);
+	release(&dcache.lock);
+}
+
+/**
+ * @brief Forget `name` in `dp`, whose entry of that name has been added,
+ * removed or renamed. Caller must hold `dp->i_mtx`.
+ * @param dp
+ * @param name
+ */
+void dcache_invalidate(struct m_inode_t *dp, char *name)
+{
+	struct dentry_t *de;
+
+	acquire(&dcache.lock);
+	if ((de = find_dentry_inhash(dp, name)) != NULL)
+		dentry_drop(de);
+	release(&dcache.lock);
+}
+
+/**
+ * @brief Forget every name in `dp`, when the directory is truncated or freed.
+ * Caller must hold `dp->i_mtx`.
+ * @param dp
+ */
+void dcache_purge(struct m_inode_t *dp)
+{
+	acquire(&dcache.lock);
+	for (int32_t i = 0; i < NDENTRY; i++) {
+		struct dentry_t *de = &dcache.dentries[i];
+		if (!list_empty(&de->d_hash) and de->d_dev == dp->i_dev and
+		    de->d_parent == dp->i_no)
+			dentry_drop(de);
+	}
+	release(&dcache.lock);
+}
+
+void dcache_stat()
+{
+	kprintf("%sdentry cache: %l hits, %l misses\n", UNIKS_MSG, dcache.hits,
+		dcache.misses);
+}
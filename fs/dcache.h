@@ -0,0 +1,20 @@
+#ifndef __FS_DCACHE_H__
+#define __FS_DCACHE_H__
+
+
+#include <uniks/defs.h>
+
+
+#define DNAME_LEN (27)	 // longer names are never cached
+
+struct m_inode_t;
+
+void dcache_init();
+int32_t dcache_lookup(struct m_inode_t *dp, char *name, uint32_t *i_no);
+void dcache_add(struct m_inode_t *dp, char *name, uint32_t i_no);
+void dcache_invalidate(struct m_inode_t *dp, char *name);
+void dcache_purge(struct m_inode_t *dp);
+void dcache_stat();
+
+
+#endif /* !__FS_DCACHE_H__ */
@@ -1,7 +1,10 @@
 #include "ext2fs.h"
+#include "dcache.h"
+#include "htree.h"
 #include <device/blkbuf.h>
 #include <device/device.h>
 #include <device/virtio_disk.h>
+#include <mm/filemap.h>
 #include <mm/vm.h>
 #include <process/proc.h>
 #include <uniks/defs.h>
@@ -14,10 +17,15 @@
 // === in-memory inode table module ===
 struct m_super_block_t m_sb;
 struct inode_table_t inode_table;
+// guards the free counts of m_sb and group_descs
+static struct spinlock_t sb_lock;
 char group_descs_table[EXT2_GRPDESC_BLKNUM * BLKSIZE];
 struct ext2_group_desc_t *group_descs =
 	(struct ext2_group_desc_t *)group_descs_table;
 
+#define _ihashfn(dev, i_no) (((uint32_t)((dev) ^ (i_no))) % HASH_TABLE_PRIME)
+#define ihash(dev, i_no)    (inode_table.hash_table[_ihashfn((dev), (i_no))])
+
 // Read the SUPER BLOCK.
 static void readsb(dev_t dev, struct ext2_super_block_t *sb)
 {
@@ -43,7 +51,7 @@ void sync_sb_and_gdt()
 	// === sync SUPER BLOCK ===
 	struct blkbuf_t *bb = blk_read(m_sb.sb_dev, EXT2_SB_BLKNO);
 	// the SUPER BLOCK starts at 1024B offset of disk
-	memcpy(bb->b_data + 1024, &m_sb.d_sb_ctnt, sizeof(&m_sb.d_sb_ctnt));
+	memcpy(bb->b_data + 1024, &m_sb.d_sb_ctnt, sizeof(m_sb.d_sb_ctnt));
 	blk_write_over(bb);
 
 	// === sync GDT ===
@@ -63,6 +71,7 @@ void ext2fs_init(dev_t dev)
 	assert(EXT2_GRP_NUM == (1 + (m_sb.d_sb_ctnt.s_blocks_count - 1) /
 					    m_sb.d_sb_ctnt.s_blocks_per_group));
 	m_sb.sb_dev = dev;
+	initlock(&sb_lock, "sb");
 
 	readgdt(dev, group_descs_table);
 }
@@ -72,89 +81,285 @@ void inode_table_init()
 {
 	initlock(&inode_table.lock, "inode_table");
 	INIT_LIST_HEAD(&inode_table.wait_list);
+	INIT_LIST_HEAD(&inode_table.free_list);
+	INIT_LIST_HEAD(&inode_table.lru_list);
+	for (int64_t i = 0; i < HASH_TABLE_PRIME; i++)
+		INIT_LIST_HEAD(&inode_table.hash_table[i]);
 	for (int64_t i = 0; i < NINODE; i++) {
-		mutex_init(&inode_table.m_inodes[i].i_mtx, "inode");
-		inode_table.m_inodes[i].i_count =
-			inode_table.m_inodes[i].i_dirty =
-				inode_table.m_inodes[i].i_dev = 0;
+		struct m_inode_t *ip = &inode_table.m_inodes[i];
+		mutex_init(&ip->i_mtx, "inode");
+		ip->i_count = ip->i_dirty = ip->i_dev = 0;
+		INIT_LIST_HEAD(&ip->i_hash);
+		INIT_LIST_HEAD(&ip->i_pages);
+		list_add_tail(&ip->i_lru, &inode_table.free_list);
 	}
 }
 
-int64_t search_free_bit(char *start, int64_t size)
+/**
+ * @brief Find the first clear bit in [from, nbits) of a bitmap, a 64-bit word
+ * at a time. `start` must be 8-byte aligned.
+ * @param start
+ * @param from
+ * @param nbits
+ * @return int64_t: the bit's index, -1 if all are set
+ */
+int64_t search_free_bit(char *start, int64_t from, int64_t nbits)
 {
-	static char mask[] = {
-		0b00000001, 0b00000010, 0b00000100, 0b00001000,
-		0b00010000, 0b00100000, 0b01000000, 0b10000000,
-	};
-	int64_t idx = 0;
-	for (int64_t i = 0; i < size; i++, idx += 8) {
-		for (int64_t j = 0; j < sizeof(mask); j++) {
-			if (get_var_bit(~start[i], mask[j]))
-				return idx + j;
-		}
+	uint64_t *words = (uint64_t *)start, free;
+
+	for (int64_t i = from / 64, bit; i * 64 < nbits; i++) {
+		free = ~words[i];
+		if (i == from / 64)
+			free &= ~0ull << (from % 64);
+		if (free == 0)
+			continue;
+		bit = i * 64 + ctz64(free);
+		return bit < nbits ? bit : -1;
 	}
 	return -1;
 }
 
+static int32_t test_allocated_bit(char *start, int64_t location)
+{
+	return get_var_bit(start[location / (sizeof(char) * 8)],
+			   1 << (location % (sizeof(char) * 8))) != 0;
+}
+
 void set_allocated_bit(char *start, int64_t location)
 {
 	set_var_bit(start[location / (sizeof(char) * 8)],
 		    1 << (location % (sizeof(char) * 8)));
 }
 
+// Clear a bit of a bitmap, returns whether it was set.
+static int32_t clear_allocated_bit(char *start, int64_t location)
+{
+	if (!test_allocated_bit(start, location))
+		return 0;
+	clear_var_bit(start[location / (sizeof(char) * 8)],
+		      1 << (location % (sizeof(char) * 8)));
+	return 1;
+}
+
+// Add `n`, which may be negative, to the free block count of group g_idx.
+static void count_free_blocks(uint32_t g_idx, int32_t n)
+{
+	acquire(&sb_lock);
+	group_descs[g_idx].bg_free_blocks_count += n;
+	m_sb.d_sb_ctnt.s_free_blocks_count += n;
+	release(&sb_lock);
+}
+
+// Add `n`, which may be negative, to the free inode count of group g_idx.
+static void count_free_inodes(uint32_t g_idx, int32_t n)
+{
+	acquire(&sb_lock);
+	group_descs[g_idx].bg_free_inodes_count += n;
+	m_sb.d_sb_ctnt.s_free_inodes_count += n;
+	release(&sb_lock);
+}
+
 
 // Blocks
 
-// allocate in block bitmap in disk but don't read it to in-memory
-static int64_t balloc(dev_t dev, uint32_t grp_no)
+// How many blocks group g_idx has, the last one may be short.
+static uint32_t grp_nblocks(uint32_t g_idx)
+{
+	struct ext2_super_block_t *sb = &m_sb.d_sb_ctnt;
+	uint64_t first = sb->s_first_data_block +
+			 (uint64_t)g_idx * sb->s_blocks_per_group;
+
+	return MIN((uint64_t)sb->s_blocks_per_group, sb->s_blocks_count - first);
+}
+
+/**
+ * @brief Allocate a run of up to `*n` free blocks in block bitmap in disk but
+ * don't read them to in-memory. The run starts at the first free block at or
+ * after `goal` in goal's group, else wherever in goal's group or the ones
+ * after it there is one. A group whose descriptor counts no free block is
+ * passed over without reading its bitmap, and a run never leaves its group.
+ * @param dev
+ * @param goal
+ * @param n in: how many blocks are wanted, out: how many were allocated
+ * @return int64_t: the first block of the run, -1 if the disk is full
+ */
+static int64_t balloc(dev_t dev, uint64_t goal, uint32_t *n)
 {
-	int64_t bnum = 0, freeno;
+	struct ext2_super_block_t *sb = &m_sb.d_sb_ctnt;
+	int64_t freeno, from;
+	uint32_t g_idx, nbits, run;
 	struct blkbuf_t *bb;
 
-	// Allocate free-blocks in grp_no's group preferentially
-	{
-		bb = blk_read(dev, group_descs[grp_no].bg_block_bitmap);
-		freeno = search_free_bit(bb->b_data, BLKSIZE);
-		if (freeno != -1) {
-			set_allocated_bit(bb->b_data, freeno);
-			blk_write_over(bb);
-			return freeno +
-			       m_sb.d_sb_ctnt.s_blocks_per_group * grp_no;
-		}
-		blk_release(bb);
-	}
+	if (goal < sb->s_first_data_block or goal >= sb->s_blocks_count)
+		goal = sb->s_first_data_block;
+	goal -= sb->s_first_data_block;
+	from = goal % sb->s_blocks_per_group;
 
-	for (int64_t g_idx = 0; g_idx < EXT2_GRP_NUM; g_idx++) {
-		if (g_idx == grp_no)
+	for (int64_t i = 0; i < EXT2_GRP_NUM; i++, from = 0) {
+		g_idx = (goal / sb->s_blocks_per_group + i) % EXT2_GRP_NUM;
+		if (group_descs[g_idx].bg_free_blocks_count == 0)
 			continue;
 		bb = blk_read(dev, group_descs[g_idx].bg_block_bitmap);
-		freeno = search_free_bit(bb->b_data, BLKSIZE);
-		if (freeno != -1) {
-			set_allocated_bit(bb->b_data, freeno);
-			blk_write_over(bb);
-			return freeno + bnum;
+		nbits = grp_nblocks(g_idx);
+		freeno = search_free_bit(bb->b_data, from, nbits);
+		if (freeno == -1 and from > 0)
+			freeno = search_free_bit(bb->b_data, 0, from);
+		if (freeno == -1) {
+			blk_release(bb);
+			continue;
 		}
-		blk_release(bb);
-
-		bnum += m_sb.d_sb_ctnt.s_blocks_per_group;
+		for (run = 0; run < *n and freeno + run < nbits and
+			      !test_allocated_bit(bb->b_data, freeno + run);
+		     run++)
+			set_allocated_bit(bb->b_data, freeno + run);
+		blk_write_over(bb);
+		count_free_blocks(g_idx, -(int32_t)run);
+		*n = run;
+		return sb->s_first_data_block +
+		       (int64_t)g_idx * sb->s_blocks_per_group + freeno;
 	}
 	return -1;
 }
 
-// Free a disk block.
-static void bfree(dev_t dev, uint32_t blk_no)
+// Free `n` disk blocks from blk_no on, all in one group.
+static void bfree_run(dev_t dev, uint32_t blk_no, uint32_t n)
 {
+	blk_no -= m_sb.d_sb_ctnt.s_first_data_block;
 	uint32_t g_idx = blk_no / m_sb.d_sb_ctnt.s_blocks_per_group;
 	uint32_t blk_offset = blk_no % m_sb.d_sb_ctnt.s_blocks_per_group;
 	struct blkbuf_t *bb = blk_read(dev, group_descs[g_idx].bg_block_bitmap);
-	clear_var_bit(bb->b_data[blk_offset / (sizeof(char) * 8)],
-		      1 << (blk_offset % (sizeof(char) * 8)));
+	int32_t freed = 0;
+	for (uint32_t i = 0; i < n; i++)
+		freed += clear_allocated_bit(bb->b_data, blk_offset + i);
 	blk_write_over(bb);
+	if (freed > 0)
+		count_free_blocks(g_idx, freed);
+}
+
+// Free a disk block.
+static void bfree(dev_t dev, uint32_t blk_no)
+{
+	bfree_run(dev, blk_no, 1);
+}
+
+// How many blocks to reserve ahead for an appending writer of `ip`.
+static uint32_t prealloc_window(struct m_inode_t *ip)
+{
+	struct ext2_super_block_t *sb = &m_sb.d_sb_ctnt;
+
+	if (S_ISDIR(ip->d_inode_ctnt.i_mode))
+		return get_var_bit(sb->s_feature_compat,
+				   EXT2_FEATURE_COMPAT_DIR_PREALLOC)
+			       ? sb->s_prealloc_dir_blocks
+			       : 0;
+	if (!S_ISREG(ip->d_inode_ctnt.i_mode))
+		return 0;
+	// the window doubles while the writer keeps appending
+	if (ip->i_prealloc_window == 0)
+		ip->i_prealloc_window = sb->s_prealloc_blocks
+						? sb->s_prealloc_blocks
+						: EXT2_DEFAULT_PREALLOC_BLOCKS;
+	else
+		ip->i_prealloc_window = MIN(ip->i_prealloc_window * 2,
+					    EXT2_MAX_PREALLOC_BLOCKS);
+	return ip->i_prealloc_window;
+}
+
+/**
+ * @brief Allocate a block for `ip`. An appending writer (`append`) gets the
+ * block after the one it got last, out of the window reserved for it if that
+ * is where the window starts, and reserves a new window along with it when
+ * not; any other allocation goes near the start of the inode's group and
+ * reserves nothing. Caller must hold `ip->i_mtx`.
+ * @param ip
+ * @param append
+ * @return uint64_t: the block number, 0 if the disk is full
+ */
+static uint64_t inode_balloc(struct m_inode_t *ip, int32_t append)
+{
+	struct ext2_super_block_t *sb = &m_sb.d_sb_ctnt;
+	uint64_t goal = sb->s_first_data_block +
+			(uint64_t)ip->i_block_group * sb->s_blocks_per_group;
+	uint32_t n = 1;
+	int64_t blk;
+
+	if (append and ip->i_next_alloc_goal != 0)
+		goal = ip->i_next_alloc_goal;
+	if (ip->i_prealloc_count > 0) {
+		if (append and goal == ip->i_prealloc_block) {
+			ip->i_prealloc_count--;
+			ip->i_next_alloc_goal = ip->i_prealloc_block + 1;
+			return ip->i_prealloc_block++;
+		}
+		discard_prealloc(ip);
+	}
+
+	if (append)
+		n += prealloc_window(ip);
+	else
+		ip->i_prealloc_window = 0;
+	if ((blk = balloc(ip->i_dev, goal, &n)) < 0)
+		return 0;
+	ip->i_prealloc_block = blk + 1;
+	ip->i_prealloc_count = n - 1;
+	ip->i_next_alloc_goal = blk + 1;
+	return blk;
+}
+
+/**
+ * @brief Give the blocks reserved for `ip` but not yet in the file back to
+ * block bitmap. Caller must hold `ip->i_mtx`.
+ * @param ip
+ */
+void discard_prealloc(struct m_inode_t *ip)
+{
+	if (ip->i_prealloc_count > 0)
+		bfree_run(ip->i_dev, ip->i_prealloc_block, ip->i_prealloc_count);
+	ip->i_prealloc_count = 0;
 }
 
 
 // Inodes
 
+// Caller must hold `inode_table.lock`.
+static struct m_inode_t *find_inode_inhash(struct list_node_t *chain,
+					   uint32_t dev, uint32_t i_no)
+{
+	for (struct list_node_t *l = list_next(chain); l != chain;
+	     l = list_next(l)) {
+		struct m_inode_t *ip = element_entry(l, struct m_inode_t, i_hash);
+		if (ip->i_dev == dev and ip->i_no == i_no)
+			return ip;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Take an unreferenced slot off the table, an empty one if there is
+ * any, else the least recently used inode, which is unhashed. Caller must hold
+ * `inode_table.lock`.
+ * @return struct m_inode_t*: a slot with i_count 1, NULL if every one is in use
+ */
+static struct m_inode_t *inode_slot()
+{
+	struct m_inode_t *ip;
+
+	if (!list_empty(&inode_table.free_list))
+		ip = element_entry(list_next_then_del(&inode_table.free_list),
+				   struct m_inode_t, i_lru);
+	else if (!list_empty(&inode_table.lru_list)) {
+		ip = element_entry(list_next_then_del(&inode_table.lru_list),
+				   struct m_inode_t, i_lru);
+		list_del_then_init(&ip->i_hash);
+		filemap_drop(ip);
+	} else
+		return NULL;
+
+	assert(ip->i_count == 0);
+	ip->i_count = 1;
+	return ip;
+}
+
 /**
  * @brief Find the inode with number `i_no` on device `dev` and return the
  * in-memory copy. Does not lock the inode and does not read it from disk.
@@ -165,37 +370,53 @@ static void bfree(dev_t dev, uint32_t blk_no)
  */
 static struct m_inode_t *iget(uint32_t dev, uint32_t i_no, int32_t clean)
 {
-	struct m_inode_t *ip, *empty = NULL;
+	struct list_node_t *chain = &ihash(dev, i_no);
+	struct m_inode_t *ip;
 
 	acquire(&inode_table.lock);
-
-	// wait for another process iput() one.
-	while (empty == NULL) {
+	while (1) {
 		// Is the inode already in the table?
-		for (ip = inode_table.m_inodes;
-		     ip < &inode_table.m_inodes[NINODE]; ip++) {
-			if (ip->i_dev == dev and ip->i_no == i_no) {
-				ip->i_count++;
-				release(&inode_table.lock);
-				return ip;
-			}
-			if (empty == NULL and ip->i_count == 0)
-				// Remember the 1st empty slot.
-				empty = ip;
+		if ((ip = find_inode_inhash(chain, dev, i_no)) != NULL) {
+			if (ip->i_count++ == 0)
+				list_del(&ip->i_lru);
+			release(&inode_table.lock);
+			return ip;
 		}
-		if (empty == NULL)
-			proc_block(&inode_table.wait_list, &inode_table.lock);
+		if ((ip = inode_slot()) != NULL)
+			break;
+		// wait for another process iput() one.
+		proc_block(&inode_table.wait_list, &inode_table.lock);
 	}
-	assert(empty != NULL);
-	assert(empty->i_count == 0);
 
-	empty->i_dev = dev, empty->i_no = i_no;
-	empty->i_block_group = (i_no - 1) / m_sb.d_sb_ctnt.s_inodes_per_group;
-	empty->i_count++;
-	empty->i_valid = clean;
+	ip->i_dev = dev, ip->i_no = i_no;
+	ip->i_block_group = (i_no - 1) / m_sb.d_sb_ctnt.s_inodes_per_group;
+	ip->i_valid = clean;
+	ip->i_next_alloc_block = ip->i_next_alloc_goal = 0;
+	ip->i_prealloc_count = ip->i_prealloc_window = 0;
+	list_add_front(&ip->i_hash, chain);
 	release(&inode_table.lock);
 
-	return empty;
+	return ip;
+}
+
+/**
+ * @brief Return a referenced inode that belongs to no file on any device, for
+ * pipes. It is never found by iget() and goes back to free_list on its last
+ * iput().
+ * @return struct m_inode_t*
+ */
+struct m_inode_t *new_inode()
+{
+	struct m_inode_t *ip;
+
+	acquire(&inode_table.lock);
+	while ((ip = inode_slot()) == NULL)
+		proc_block(&inode_table.wait_list, &inode_table.lock);
+	ip->i_dev = 0;
+	ip->i_valid = 0;
+	release(&inode_table.lock);
+
+	return ip;
 }
 
 /**
@@ -207,20 +428,25 @@ static struct m_inode_t *iget(uint32_t dev, uint32_t i_no, int32_t clean)
  */
 struct m_inode_t *ialloc(dev_t dev)
 {
-	int64_t inum = 0;
+	int64_t freeno;
 	struct blkbuf_t *bb;
 
 	for (int64_t g_idx = 0; g_idx < EXT2_GRP_NUM; g_idx++) {
+		// its descriptor says the group is full, skip the bitmap
+		if (group_descs[g_idx].bg_free_inodes_count == 0)
+			continue;
 		bb = blk_read(dev, group_descs[g_idx].bg_inode_bitmap);
-		int64_t freeno = search_free_bit(bb->b_data, BLKSIZE);
-		if (freeno != -1) {
-			set_allocated_bit(bb->b_data, freeno);
-			blk_write_over(bb);
-			return iget(dev, inum + freeno + 1, 1);
+		freeno = search_free_bit(bb->b_data, 0,
+					 m_sb.d_sb_ctnt.s_inodes_per_group);
+		if (freeno == -1) {
+			blk_release(bb);
+			continue;
 		}
-		blk_release(bb);
-
-		inum += m_sb.d_sb_ctnt.s_inodes_per_group;
+		set_allocated_bit(bb->b_data, freeno);
+		blk_write_over(bb);
+		count_free_inodes(g_idx, -1);
+		freeno += g_idx * m_sb.d_sb_ctnt.s_inodes_per_group;
+		return iget(dev, freeno + 1, 1);
 	}
 	return NULL;
 }
@@ -228,12 +454,13 @@ struct m_inode_t *ialloc(dev_t dev)
 // Free an inode in inode table
 static void ifree(dev_t dev, uint32_t i_no)
 {
-	uint32_t g_idx = i_no / m_sb.d_sb_ctnt.s_inodes_per_group;
+	uint32_t g_idx = (i_no - 1) / m_sb.d_sb_ctnt.s_inodes_per_group;
 	uint32_t i_offset = EXT2_IOFFSET_OFGRP(i_no, m_sb.d_sb_ctnt);
 	struct blkbuf_t *bb = blk_read(dev, group_descs[g_idx].bg_inode_bitmap);
-	clear_var_bit(bb->b_data[i_offset / (sizeof(char) * 8)],
-		      1 << (i_offset % (sizeof(char) * 8)));
+	int32_t was_set = clear_allocated_bit(bb->b_data, i_offset);
 	blk_write_over(bb);
+	if (was_set)
+		count_free_inodes(g_idx, 1);
 }
 
 /**
@@ -319,10 +546,23 @@ void iput(struct m_inode_t *ip)
 		mutex_release(&ip->i_mtx);
 
 		acquire(&inode_table.lock);
-		proc_unblock_all(&inode_table.wait_list);
+		list_del_then_init(&ip->i_hash);   // nothing left worth caching
+	} else if (ip->i_count == 1 and ip->i_prealloc_count > 0) {
+		// the last closer hands back what was reserved for its writes
+		mutex_acquire(&ip->i_mtx);
+		release(&inode_table.lock);
+		discard_prealloc(ip);
+		mutex_release(&ip->i_mtx);
+		acquire(&inode_table.lock);
 	}
 
-	ip->i_count--;
+	if (--ip->i_count == 0) {
+		if (list_empty(&ip->i_hash))
+			list_add_front(&ip->i_lru, &inode_table.free_list);
+		else
+			list_add_tail(&ip->i_lru, &inode_table.lru_list);
+		proc_unblock_all(&inode_table.wait_list);
+	}
 	release(&inode_table.lock);
 }
 
@@ -370,18 +610,22 @@ uint64_t bmap(struct m_inode_t *ip, uint32_t blk_no)
 {
 	uint64_t baddr;
 	struct blkbuf_t *bb;
+	// mapping the block after the last one it mapped, the writer appends
+	int32_t append = (blk_no == ip->i_next_alloc_block);
 
 	assert(blk_no < EXT2_TIND_LIMIT);
 
 	if (blk_no < EXT2_NDIR_BLOCKS) {
 		if ((baddr = ip->d_inode_ctnt.i_block[blk_no]) == 0) {
-			baddr = balloc(ip->i_dev, ip->i_block_group);
+			baddr = inode_balloc(ip, append);
 			if (baddr == 0)
 				return 0;
 			ip->d_inode_ctnt.i_block[blk_no] = baddr;
+			ip->i_next_alloc_block = blk_no + 1;
 		}
 		return baddr;
 	}
+	uint32_t next_alloc_block = blk_no + 1;
 
 	// Multi-level indirect index, allocating if necessary.
 	uint32_t divisor, primary_layer;
@@ -399,7 +643,7 @@ uint64_t bmap(struct m_inode_t *ip, uint32_t blk_no)
 		primary_layer = EXT2_TIND_BLOCK;
 	}
 	if ((baddr = ip->d_inode_ctnt.i_block[primary_layer]) == 0) {
-		baddr = balloc(ip->i_dev, ip->i_block_group);
+		baddr = inode_balloc(ip, append);
 		if (baddr == 0)
 			return 0;
 		ip->d_inode_ctnt.i_block[primary_layer] = baddr;
@@ -408,13 +652,15 @@ uint64_t bmap(struct m_inode_t *ip, uint32_t blk_no)
 		bb = blk_read(ip->i_dev, baddr);
 		uint32_t *index = (uint32_t *)bb->b_data;
 		if ((baddr = index[blk_no / divisor]) == 0) {
-			baddr = balloc(ip->i_dev, ip->i_block_group);
+			baddr = inode_balloc(ip, append);
 			if (baddr == 0) {
 				blk_release(bb);
 				return 0;
 			}
 			index[blk_no / divisor] = baddr;
 			blk_write_over(bb);
+			if (divisor == 1)
+				ip->i_next_alloc_block = next_alloc_block;
 		} else
 			blk_release(bb);
 		blk_no %= divisor;
@@ -504,6 +750,11 @@ void bunmap(struct m_inode_t *ip, uint32_t blk_no)
 int64_t itruncate(struct m_inode_t *ip, size_t length)
 {
 	assert(mutex_holding(&ip->i_mtx));
+	filemap_drop(ip);
+	discard_prealloc(ip);
+	ip->i_next_alloc_block = ip->i_next_alloc_goal = 0;
+	if (S_ISDIR(ip->d_inode_ctnt.i_mode))
+		dcache_purge(ip);
 	if (length > ip->d_inode_ctnt.i_size) {
 		// Fill with '\0', and call `writei()` for simplicity
 		uint64_t res, off = ip->d_inode_ctnt.i_size;
@@ -595,6 +846,20 @@ int64_t readi(struct m_inode_t *ip, int32_t user_dst, char *dst, uint64_t off,
 	return tot;
 }
 
+/**
+ * @brief Like readi() into a kernel buffer, but wait a sync() out instead of
+ * failing with -EBUSY, for a page fault that has nobody to retry it. Caller
+ * must hold `ip->i_mtx`.
+ */
+int64_t readi_wait(struct m_inode_t *ip, char *dst, uint64_t off, size_t n)
+{
+	int64_t res;
+
+	while ((res = readi(ip, 0, dst, off, n)) == -EBUSY)
+		yield();
+	return res;
+}
+
 /**
  * @brief Write data to inode. Caller must hold `ip->i_mtx`. If `user_src==1`,
  * then `src` is a user virtual address; otherwise, `src` is a kernel address.
@@ -615,6 +880,7 @@ int64_t writei(struct m_inode_t *ip, int32_t user_src, char *src, uint64_t off,
 		return -1;
 	if (off + n > EXT2_MAX_FBLKS * BLKSIZE)
 		return -1;
+	filemap_drop(ip);   // mapped pages keep the old content
 
 	for (tot = 0; tot < n; tot += m, off += m, src += m) {
 		uint64_t addr = bmap(ip, off / BLKSIZE);
@@ -647,6 +913,80 @@ int64_t writei(struct m_inode_t *ip, int32_t user_src, char *src, uint64_t off,
 
 // Directories
 
+/**
+ * @brief Start a walk over the entries of directory `dp` at byte offset `off`,
+ * which must be where an entry begins. Caller must hold `dp->i_mtx` until
+ * dir_iter_end().
+ * @param it
+ * @param dp
+ * @param off
+ */
+void dir_iter_init(struct dir_iter_t *it, struct m_inode_t *dp, uint64_t off)
+{
+	it->dp = dp;
+	it->bb = NULL;
+	it->off = off;
+	it->de = NULL;
+	// a sync waits for the walk as it does for readi()
+	atomic_fetch_add(&rw_operating, 1);
+}
+
+/**
+ * @brief Step to the next entry of the walk, the one at the starting offset
+ * on the first call. Entries with inode 0 are returned too. The rest of a
+ * block whose entries do not chain up is skipped.
+ * @param it
+ * @return struct ext2_dir_entry_t*: NULL at the end of the directory
+ */
+struct ext2_dir_entry_t *dir_iter_next(struct dir_iter_t *it)
+{
+	struct m_inode_t *dp = it->dp;
+	struct ext2_dir_entry_t *de;
+	uint64_t addr, boff;
+
+	if (it->de != NULL)
+		it->off += it->de->rec_len;
+	it->de = NULL;
+
+	while (it->off < dp->d_inode_ctnt.i_size) {
+		if (it->bb != NULL and it->blk_no != it->off / BLKSIZE) {
+			blk_release(it->bb);
+			it->bb = NULL;
+		}
+		if (it->bb == NULL) {
+			it->blk_no = it->off / BLKSIZE;
+			if ((addr = bmap(dp, it->blk_no)) == 0 or
+			    (it->bb = blk_read(dp->i_dev, addr)) == NULL)
+				return NULL;
+		}
+
+		boff = it->off % BLKSIZE;
+		de = (struct ext2_dir_entry_t *)(it->bb->b_data + boff);
+		if (boff + sizeof(*de) > BLKSIZE or de->rec_len % 4 != 0 or
+		    de->rec_len < EXT2_DIRENTRY_LEN(de->name_len) or
+		    boff + de->rec_len > BLKSIZE) {
+			it->off = (uint64_t)(it->blk_no + 1) * BLKSIZE;
+			continue;
+		}
+		return it->de = de;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Finish a walk and unpin its block.
+ * @param it
+ */
+void dir_iter_end(struct dir_iter_t *it)
+{
+	if (it->bb != NULL)
+		blk_release(it->bb);
+	it->bb = NULL;
+	it->de = NULL;
+	atomic_fetch_sub(&rw_operating, 1);
+}
+
 /**
  * @brief Look for a directory entry in a directory. If found, set `*poff` to
  * byte offset of entry.
@@ -657,26 +997,36 @@ int64_t writei(struct m_inode_t *ip, int32_t user_src, char *src, uint64_t off,
  */
 struct m_inode_t *dirlookup(struct m_inode_t *ip, char *name, uint64_t *poff)
 {
-	uint64_t off, namelen = strlen(name);
+	uint64_t namelen = strlen(name);
+	uint32_t i_no = 0;
 	assert(namelen <= EXT2_NAME_LEN);
-	char tmp_de[EXT2_DIRENTRY_MAXSIZE];
-	struct ext2_dir_entry_t *de = (struct ext2_dir_entry_t *)tmp_de;
+	struct ext2_dir_entry_t *de;
+	struct dir_iter_t it;
 
 	assert(S_ISDIR(ip->d_inode_ctnt.i_mode));
 
-	for (off = 0; off < ip->d_inode_ctnt.i_size; off += de->rec_len) {
-		readi(ip, 0, tmp_de, off, EXT2_DIRENTRY_MAXSIZE);
-		if (de->inode == 0)
+	if (get_var_bit(ip->d_inode_ctnt.i_flags, EXT2_INDEX_FL)) {
+		// an index too broken to use leaves a linear scan to do
+		int64_t res = htree_find(ip, name, poff);
+		if (res >= 0)
+			return res != 0 ? iget(ip->i_dev, res, 0) : NULL;
+	}
+
+	dir_iter_init(&it, ip, 0);
+	while ((de = dir_iter_next(&it)) != NULL) {
+		if (de->inode == 0 or de->name_len != namelen)
 			continue;
-		if (strncmp(name, de->name, MAX(namelen, de->name_len)) == 0) {
+		if (strncmp(name, de->name, namelen) == 0) {
 			// entry matches path element
+			i_no = de->inode;
 			if (poff)
-				*poff = off;
-			return iget(ip->i_dev, de->inode, 0);
+				*poff = it.off;
+			break;
 		}
 	}
+	dir_iter_end(&it);
 
-	return NULL;
+	return i_no != 0 ? iget(ip->i_dev, i_no, 0) : NULL;
 }
 
 /**
@@ -689,11 +1039,11 @@ struct m_inode_t *dirlookup(struct m_inode_t *ip, char *name, uint64_t *poff)
  */
 int32_t dirlink(struct m_inode_t *dp, char *name, uint64_t i_no)
 {
-	uint64_t off, namelen = strlen(name), de1_len, de2_len;
+	uint64_t namelen = strlen(name), used = 0;
+	int64_t res;
 	assert(namelen <= EXT2_NAME_LEN);
-	char tmp_de[EXT2_DIRENTRY_MAXSIZE], new_de[EXT2_DIRENTRY_MAXSIZE];
-	struct ext2_dir_entry_t *de1 = (struct ext2_dir_entry_t *)tmp_de,
-				*de2 = (struct ext2_dir_entry_t *)new_de;
+	struct ext2_dir_entry_t *de, *new;
+	struct dir_iter_t it;
 	struct m_inode_t *ip;
 
 	// Check that name is not present.
@@ -701,39 +1051,57 @@ int32_t dirlink(struct m_inode_t *dp, char *name, uint64_t i_no)
 		iput(ip);
 		return -1;
 	}
+	dcache_invalidate(dp, name);
+
+	if (get_var_bit(dp->d_inode_ctnt.i_flags, EXT2_INDEX_FL)) {
+		if ((res = htree_add(dp, name, i_no)) != -2)
+			return res;
+		// carry on without the index, e2fsck may rebuild it
+		clear_var_bit(dp->d_inode_ctnt.i_flags, EXT2_INDEX_FL);
+		iupdate(dp, 0);
+	}
 
-	// Look for an empty directory entry.
-	for (off = 0; off < dp->d_inode_ctnt.i_size; off += de1->rec_len) {
-		readi(dp, 0, tmp_de, off, EXT2_DIRENTRY_MAXSIZE);
-		if (de1->inode == 0)
-			continue;
-		// The distance between two entries is enough to insert new one
-		if (de1->rec_len - (sizeof(*de1) + de1->name_len) >=
-		    sizeof(*de1) + namelen)
+	// Look for an entry with room after its name, or a free one.
+	dir_iter_init(&it, dp, 0);
+	while ((de = dir_iter_next(&it)) != NULL) {
+		used = de->inode != 0 ? EXT2_DIRENTRY_LEN(de->name_len) : 0;
+		if (de->rec_len - used >= EXT2_DIRENTRY_LEN(namelen))
 			break;
 	}
 
-	de2->inode = i_no;
-	de2->name_len = namelen;
-	strncpy(de2->name, name, namelen);
-	if (dp->d_inode_ctnt.i_size == 0) {
-		de2->rec_len = BLKSIZE;
-		if (writei(dp, 0, new_de, off, de2->rec_len) != de2->rec_len)
-			return -1;
-	} else {
-		de1_len = alignaddr_up(sizeof(*de1) + de1->name_len, 4);
-		de2_len = alignaddr_up(sizeof(*de2) + de2->name_len, 4);
-		// 4-byte alignment is required according to the ext2fs' manual.
-		de2->rec_len = de1->rec_len - de1_len;
-		if (writei(dp, 0, new_de, off + de1_len, de2_len) != de2_len)
-			return -1;
-
-		de1->rec_len = de1_len;
-		if (writei(dp, 0, tmp_de, off, de1_len) != de1_len)
-			return -1;
+	if (de != NULL) {
+		// split it in place, the pinned block is the one to write
+		new = de;
+		if (used != 0) {
+			new = (struct ext2_dir_entry_t *)((char *)de + used);
+			new->rec_len = de->rec_len - used;
+			de->rec_len = used;
+		}
+		new->inode = i_no;
+		new->name_len = namelen;
+		memcpy(new->name, name, namelen);
+		blk_mark_dirty(it.bb);
+		dir_iter_end(&it);
+		return 0;
 	}
-
-	return 0;
+	dir_iter_end(&it);
+
+	// no block has room, a full single block grows an index
+	if (dp->d_inode_ctnt.i_size == BLKSIZE and htree_enabled() and
+	    htree_make_indexed(dp) == 0)
+		return htree_add(dp, name, i_no) == 0 ? 0 : -1;
+	char *blk = kzalloc(BLKSIZE);
+	if (blk == NULL)
+		return -1;
+	new = (struct ext2_dir_entry_t *)blk;
+	new->inode = i_no;
+	new->rec_len = BLKSIZE;
+	new->name_len = namelen;
+	memcpy(new->name, name, namelen);
+	res = writei(dp, 0, blk, dp->d_inode_ctnt.i_size, BLKSIZE);
+	kfree(blk);
+
+	return res == BLKSIZE ? 0 : -1;
 }
 
 
@@ -776,6 +1144,19 @@ static char *skipelem(char *path, char *name)
 	return path;
 }
 
+// dirlookup() through the dentry cache. Caller must hold `dp->i_mtx`.
+static struct m_inode_t *dirlookup_cached(struct m_inode_t *dp, char *name)
+{
+	struct m_inode_t *ip;
+	uint32_t i_no;
+
+	if (dcache_lookup(dp, name, &i_no))
+		return i_no != 0 ? iget(dp->i_dev, i_no, 0) : NULL;
+	ip = dirlookup(dp, name, 0);
+	dcache_add(dp, name, ip != NULL ? ip->i_no : 0);
+	return ip;
+}
+
 /**
  * @brief Look up and return the inode for a path name. If `nameiparent != 0`,
  * return the inode for the parent and copy the final path element into `name`,
@@ -802,7 +1183,7 @@ static struct m_inode_t *namex(char *path, int32_t nameiparent, char *name)
 			iunlock(ip);
 			return ip;
 		}
-		if ((next = dirlookup(ip, name, 0)) == NULL) {
+		if ((next = dirlookup_cached(ip, name)) == NULL) {
 			iunlockput(ip);
 			return NULL;
 		}
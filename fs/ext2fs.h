@@ -25,6 +25,11 @@
 #define IPB (BLKSIZE / sizeof(struct ext2_inode_t))
 
 
+/* Blocks reserved ahead for an appending writer when s_prealloc_blocks gives
+ * no hint, and the most its window grows to. */
+#define EXT2_DEFAULT_PREALLOC_BLOCKS (8)
+#define EXT2_MAX_PREALLOC_BLOCKS     (64)
+
 // Special inode numbers
 #define EXT2_BAD_INO	     1 /* Bad blocks inode */
 #define EXT2_ROOT_INO	     2 /* Root inode */
@@ -121,10 +126,24 @@ struct ext2_super_block_t {
 	uint8_t s_reserved_pad[3];
 	/* -- Other options -- */
 	uint32_t s_default_mount_opts;
-	uint32_t s_first_meta_bg; /* First metablock block group */
-	uint8_t s_reserved[760];  /* Padding to the end of the block */
+	uint32_t s_first_meta_bg;     /* First metablock block group */
+	uint32_t s_mkfs_time;	      /* When the filesystem was created */
+	uint32_t s_jnl_blocks[17];    /* Backup of the journal inode */
+	uint32_t s_blocks_count_hi;   /* Blocks count, high 32 bits */
+	uint32_t s_r_blocks_count_hi; /* Reserved blocks count, high 32 bits */
+	uint32_t s_free_blocks_hi;    /* Free blocks count, high 32 bits */
+	uint16_t s_min_extra_isize;   /* All inodes have at least # bytes */
+	uint16_t s_want_extra_isize;  /* New inodes should reserve # bytes */
+	uint32_t s_flags;	      /* Miscellaneous flags */
+	uint8_t s_reserved[668];      /* Padding to the end of the block */
 } __packed;
 
+// Feature and flag bits of the super block
+#define EXT2_FEATURE_COMPAT_DIR_PREALLOC 0x0001 /* s_prealloc_dir_blocks */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020 /* Hashed directory index */
+#define EXT2_FLAGS_SIGNED_HASH	      0x0001 /* Signed dirhash in use */
+#define EXT2_FLAGS_UNSIGNED_HASH      0x0002 /* Unsigned dirhash in use */
+
 // Structure of a blocks group descriptor
 struct ext2_group_desc_t {
 	uint32_t bg_block_bitmap;      /* Blocks bitmap block */
@@ -206,6 +225,7 @@ struct ext2_group_desc_t {
 #define EXT2_APPEND_FL	  0x00000020 /* writes to file may only append */
 #define EXT2_NODUMP_FL	  0x00000040 /* do not dump file */
 #define EXT2_NOATIME_FL	  0x00000080 /* do not update atime */
+#define EXT2_INDEX_FL	  0x00001000 /* hash-indexed directory */
 
 /**
  * @brief each bit of `i_mode` field:
@@ -271,6 +291,57 @@ struct ext2_dir_entry_2_t {
 	char name[]; /* File name, up to EXT2_NAME_LEN */
 } __packed;
 #define EXT2_DIRENTRY_MAXSIZE (sizeof(struct ext2_dir_entry_t) + EXT2_NAME_LEN)
+#define EXT2_DIRENTRY_LEN(name_len) \
+	alignaddr_up(sizeof(struct ext2_dir_entry_t) + (name_len), 4)
+
+/*
+ * Hashed directory index (htree). Block 0 of an indexed directory is a dx_root,
+ * whose "." and ".." entries make it look like an ordinary directory block
+ * with ".." covering the rest; the other index blocks are dx_nodes, an unused
+ * entry covering the whole block. Leaf blocks are ordinary directory blocks.
+ * The first dx_entry of an index block holds its count and limit in place of
+ * the hash, it covers all hashes below the second one.
+ */
+#define DX_HASH_LEGACY	 0
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA	 2
+#define DX_MAX_LEVELS	 2   // the root and one level of dx_nodes
+
+struct dx_fake_dirent_t {
+	uint32_t inode;
+	uint16_t rec_len;
+	uint16_t name_len;
+};
+
+struct dx_countlimit_t {
+	uint16_t limit; /* Max number of entries in this block */
+	uint16_t count; /* Number of entries in use */
+};
+
+struct dx_entry_t {
+	uint32_t hash;	/* Lowest hash in the block, low bit for a continued run */
+	uint32_t block; /* Logical block number in the directory */
+};
+
+struct dx_root_t {
+	struct dx_fake_dirent_t dot;
+	char dot_name[4];
+	struct dx_fake_dirent_t dotdot;
+	char dotdot_name[4];
+	struct dx_root_info_t {
+		uint32_t reserved_zero;
+		uint8_t hash_version;
+		uint8_t info_length; /* 8 */
+		uint8_t indirect_levels;
+		uint8_t unused_flags;
+	} info;
+	struct dx_entry_t entries[];
+};
+
+struct dx_node_t {
+	struct dx_fake_dirent_t fake;
+	struct dx_entry_t entries[];
+};
 
 
 // === in-memory data structure module ===
@@ -304,17 +375,54 @@ struct m_inode_t {
 	 * near to their parent directory's inode.
 	 */
 	uint32_t i_block_group;
+	/**
+	 * @brief Where the writer appending to this file goes next: the
+	 * logical block it maps next and the disk block that should hold it.
+	 * [i_prealloc_block, +i_prealloc_count) are free blocks set aside for
+	 * it in the bitmap, i_prealloc_window how many it set aside last time.
+	 */
+	uint32_t i_next_alloc_block;
+	uint32_t i_next_alloc_goal;
+	uint32_t i_prealloc_block;
+	uint16_t i_prealloc_count;
+	uint16_t i_prealloc_window;
 	int8_t i_dirty;
 	int8_t i_valid;	  // inode has been read from disk?
 	uint16_t i_count;
+
+	struct list_node_t i_hash;   // hash chain, empty if it is no file's
+	struct list_node_t i_lru;    // free_list or lru_list while unreferenced
+	struct list_node_t i_pages;  // cached pages, see mm/filemap.c
 };
 
+/**
+ * @brief Every field is guarded by `lock`, as are i_count, i_hash and i_lru of
+ * each inode. An unreferenced inode stays hashed on lru_list, so that looking
+ * it up again does not read it from disk; slots that hold no file wait on
+ * free_list and are handed out first.
+ */
 struct inode_table_t {
 	struct spinlock_t lock;
 	struct list_node_t wait_list;
+	struct list_node_t hash_table[HASH_TABLE_PRIME];
+	struct list_node_t free_list;	// unhashed and unreferenced
+	struct list_node_t lru_list;	// hashed and unreferenced, LRU first
 	struct m_inode_t m_inodes[NINODE];
 };
 
+/**
+ * @brief A walk over the entries of a directory that keeps the block under
+ * `de` pinned, so that stepping inside one block reads nothing. `de` points
+ * into the buffer and is only valid until the next dir_iter_next().
+ */
+struct dir_iter_t {
+	struct m_inode_t *dp;
+	struct blkbuf_t *bb;	// the pinned block, NULL if none
+	uint32_t blk_no;	// which block of dp `bb` is
+	uint64_t off;		// offset of `de` in dp
+	struct ext2_dir_entry_t *de;
+};
+
 extern struct m_super_block_t m_sb;
 extern struct inode_table_t inode_table;
 extern struct ext2_group_desc_t *group_descs;
@@ -326,6 +434,7 @@ void sync_sb_and_gdt();
 
 // Inodes
 struct m_inode_t *ialloc(dev_t dev);
+struct m_inode_t *new_inode();
 struct m_inode_t *idup(struct m_inode_t *ip);
 void ilock(struct m_inode_t *ip);
 void iunlock(struct m_inode_t *ip);
@@ -335,15 +444,20 @@ void iupdate(struct m_inode_t *ip, int64_t wthrough);
 
 // Inode content
 int64_t itruncate(struct m_inode_t *ip, size_t length);
+void discard_prealloc(struct m_inode_t *ip);
 void stati(struct m_inode_t *ip, struct stat_t *st);
 int64_t readi(struct m_inode_t *ip, int32_t user_dst, char *dst, uint64_t off,
 	      size_t n);
+int64_t readi_wait(struct m_inode_t *ip, char *dst, uint64_t off, size_t n);
 int64_t writei(struct m_inode_t *ip, int32_t user_src, char *src, uint64_t off,
 	       size_t n);
 
 // Directories
 struct m_inode_t *dirlookup(struct m_inode_t *ip, char *name, uint64_t *poff);
 int32_t dirlink(struct m_inode_t *dp, char *name, uint64_t i_no);
+void dir_iter_init(struct dir_iter_t *it, struct m_inode_t *dp, uint64_t off);
+struct ext2_dir_entry_t *dir_iter_next(struct dir_iter_t *it);
+void dir_iter_end(struct dir_iter_t *it);
 
 // Paths
 struct m_inode_t *namei(char *path, int32_t copy);
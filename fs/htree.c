@@ -0,0 +1,709 @@
+#include "htree.h"
+#include "ext2fs.h"
+#include <device/blkbuf.h>
+#include <mm/phys.h>
+#include <uniks/defs.h>
+#include <uniks/kassert.h>
+#include <uniks/kstdlib.h>
+#include <uniks/kstring.h>
+
+
+/* The hashed directory index of ext2, in the on-disk format of
+ * linux:fs/ext3/namei.c, so that images from mkfs.ext2 -O dir_index and e2fsck
+ * agree with us. An index is at most DX_MAX_LEVELS deep, as in ext3. */
+
+#define dx_countlimit(entries) ((struct dx_countlimit_t *)(entries))
+#define dx_block(entry)	       ((entry)->block & 0x00ffffff)
+#define DX_ROOT_LIMIT \
+	((BLKSIZE - sizeof(struct dx_root_t)) / sizeof(struct dx_entry_t))
+#define DX_NODE_LIMIT \
+	((BLKSIZE - sizeof(struct dx_node_t)) / sizeof(struct dx_entry_t))
+#define DX_HASH_EOF (0x7fffffffu)
+
+
+// === name hashing, after linux:fs/ext3/hash.c ===
+
+#define DELTA	    (0x9E3779B9)
+#define rol32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+
+static void tea_transform(uint32_t buf[4], uint32_t const in[4])
+{
+	uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+	for (int32_t n = 0; n < 16; n++) {
+		sum += DELTA;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) ({ (a) += f((b), (c), (d)) + (x); \
+				      (a) = rol32((a), (s)); })
+#define K1 (0)
+#define K2 (013240474631u)
+#define K3 (015666365641u)
+
+// the first 3 rounds of MD4, every 2nd step
+static void half_md4_transform(uint32_t buf[4], uint32_t const in[8])
+{
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	ROUND(F, a, b, c, d, in[0] + K1, 3);
+	ROUND(F, d, a, b, c, in[1] + K1, 7);
+	ROUND(F, c, d, a, b, in[2] + K1, 11);
+	ROUND(F, b, c, d, a, in[3] + K1, 19);
+	ROUND(F, a, b, c, d, in[4] + K1, 3);
+	ROUND(F, d, a, b, c, in[5] + K1, 7);
+	ROUND(F, c, d, a, b, in[6] + K1, 11);
+	ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+	ROUND(G, a, b, c, d, in[1] + K2, 3);
+	ROUND(G, d, a, b, c, in[3] + K2, 5);
+	ROUND(G, c, d, a, b, in[5] + K2, 9);
+	ROUND(G, b, c, d, a, in[7] + K2, 13);
+	ROUND(G, a, b, c, d, in[0] + K2, 3);
+	ROUND(G, d, a, b, c, in[2] + K2, 5);
+	ROUND(G, c, d, a, b, in[4] + K2, 9);
+	ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+	ROUND(H, a, b, c, d, in[3] + K3, 3);
+	ROUND(H, d, a, b, c, in[7] + K3, 9);
+	ROUND(H, c, d, a, b, in[2] + K3, 11);
+	ROUND(H, b, c, d, a, in[6] + K3, 15);
+	ROUND(H, a, b, c, d, in[1] + K3, 3);
+	ROUND(H, d, a, b, c, in[5] + K3, 9);
+	ROUND(H, c, d, a, b, in[0] + K3, 11);
+	ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+/**
+ * @brief Names are hashed with chars signed, as x86 has them, unless the super
+ * block says the image was made where they are unsigned.
+ */
+__always_inline static int32_t hash_char(const char *p, int32_t unsign)
+{
+	return unsign ? (int32_t)(uint8_t)*p : (int32_t)(int8_t)*p;
+}
+
+static uint32_t dx_hack_hash(const char *name, int32_t len, int32_t unsign)
+{
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+	for (; len > 0; len--, name++) {
+		hash = hash1 + (hash0 ^ (uint32_t)(hash_char(name, unsign) *
+						   7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+static void str2hashbuf(const char *msg, int32_t len, uint32_t *buf,
+			int32_t num, int32_t unsign)
+{
+	uint32_t pad, val;
+
+	pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (int32_t i = 0; i < len; i++) {
+		val = hash_char(msg + i, unsign) + (val << 8);
+		if (i % 4 == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+static uint32_t dx_hash(const char *name, int32_t len, int32_t version)
+{
+	struct ext2_super_block_t *sb = &m_sb.d_sb_ctnt;
+	int32_t unsign = get_var_bit(sb->s_flags, EXT2_FLAGS_UNSIGNED_HASH) != 0;
+	uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	uint32_t in[8], hash = 0;
+
+	for (int32_t i = 0; i < 4; i++) {
+		if (sb->s_hash_seed[i] != 0) {
+			memcpy(buf, sb->s_hash_seed, sizeof(buf));
+			break;
+		}
+	}
+
+	switch (version) {
+	case DX_HASH_LEGACY:
+		hash = dx_hack_hash(name, len, unsign);
+		break;
+	case DX_HASH_HALF_MD4:
+		for (; len > 0; len -= 32, name += 32) {
+			str2hashbuf(name, len, in, 8, unsign);
+			half_md4_transform(buf, in);
+		}
+		hash = buf[1];
+		break;
+	case DX_HASH_TEA:
+		for (; len > 0; len -= 16, name += 16) {
+			str2hashbuf(name, len, in, 4, unsign);
+			tea_transform(buf, in);
+		}
+		hash = buf[0];
+		break;
+	default:
+		BUG();
+	}
+
+	// the low bit marks continued runs in dx_entry_t
+	hash = get_var_bit(hash, ~1u);
+	if (hash == (DX_HASH_EOF << 1))
+		hash = (DX_HASH_EOF - 1) << 1;
+	return hash;
+}
+
+
+// === directory blocks ===
+
+// Read block blk_no of directory dp, NULL if it lies beyond the end.
+static struct blkbuf_t *dir_block(struct m_inode_t *dp, uint32_t blk_no)
+{
+	uint64_t addr;
+
+	if ((uint64_t)blk_no * BLKSIZE >= dp->d_inode_ctnt.i_size)
+		return NULL;
+	if ((addr = bmap(dp, blk_no)) == 0)
+		return NULL;
+	return blk_read(dp->i_dev, addr);
+}
+
+// Append the block `data` to directory dp, return its block number or -1.
+static int64_t dir_append(struct m_inode_t *dp, char *data)
+{
+	uint64_t size = dp->d_inode_ctnt.i_size;
+
+	if (writei(dp, 0, data, size, BLKSIZE) != BLKSIZE)
+		return -1;
+	return size / BLKSIZE;
+}
+
+// Look name up in a leaf block, return the offset of its entry or -1.
+static int32_t leaf_find(char *blk, char *name, int32_t namelen)
+{
+	struct ext2_dir_entry_t *de;
+
+	for (int32_t off = 0; off + sizeof(*de) <= BLKSIZE; off += de->rec_len) {
+		de = (struct ext2_dir_entry_t *)(blk + off);
+		if (de->rec_len < sizeof(*de))
+			break;	 // a broken block
+		if (de->inode != 0 and de->name_len == namelen and
+		    strncmp(de->name, name, namelen) == 0)
+			return off;
+	}
+	return -1;
+}
+
+// Put an entry into a leaf block, -1 if it has no room for it.
+static int32_t leaf_add(char *blk, char *name, int32_t namelen, uint32_t i_no)
+{
+	struct ext2_dir_entry_t *de, *new;
+	int32_t used, need = EXT2_DIRENTRY_LEN(namelen);
+
+	for (int32_t off = 0; off + sizeof(*de) <= BLKSIZE; off += de->rec_len) {
+		de = (struct ext2_dir_entry_t *)(blk + off);
+		if (de->rec_len < sizeof(*de))
+			break;
+		used = de->inode != 0 ? EXT2_DIRENTRY_LEN(de->name_len) : 0;
+		if (de->rec_len - used < need)
+			continue;
+		new = de;
+		if (used != 0) {
+			new = (struct ext2_dir_entry_t *)(blk + off + used);
+			new->rec_len = de->rec_len - used;
+			de->rec_len = used;
+		}
+		new->inode = i_no;
+		new->name_len = namelen;
+		memcpy(new->name, name, namelen);
+		return 0;
+	}
+	return -1;
+}
+
+struct dx_map_t {
+	uint32_t hash;
+	uint16_t off, size;
+};
+
+// Write the entries of src listed in map into blk back to back.
+static void leaf_pack(char *blk, char *src, struct dx_map_t *map,
+		      int32_t count)
+{
+	struct ext2_dir_entry_t *de = NULL;
+	int32_t off = 0;
+
+	memset(blk, 0, BLKSIZE);
+	for (int32_t i = 0; i < count; i++) {
+		de = (struct ext2_dir_entry_t *)(blk + off);
+		memcpy(de, src + map[i].off, map[i].size);
+		de->rec_len = map[i].size;
+		off += map[i].size;
+	}
+	de->rec_len += BLKSIZE - off;
+}
+
+/**
+ * @brief Split the full leaf block src by hash into lo and hi, the upper half
+ * of its entries going to hi.
+ * @param src
+ * @param lo
+ * @param hi
+ * @param version hash version of the index
+ * @param split set to the lowest hash in hi, with the low bit set if that hash
+ * also stays in lo
+ * @return int32_t: -1 if src has too few entries to split
+ */
+static int32_t leaf_split(char *src, char *lo, char *hi, int32_t version,
+			  uint32_t *split)
+{
+	struct dx_map_t *map, m;
+	struct ext2_dir_entry_t *de;
+	int32_t count = 0, half, j;
+
+	map = kmalloc(sizeof(*map) * (BLKSIZE / EXT2_DIRENTRY_LEN(1)));
+	if (map == NULL)
+		return -1;
+	for (int32_t off = 0; off + sizeof(*de) <= BLKSIZE; off += de->rec_len) {
+		de = (struct ext2_dir_entry_t *)(src + off);
+		if (de->rec_len < sizeof(*de))
+			break;
+		if (de->inode == 0)
+			continue;
+		m.hash = dx_hash(de->name, de->name_len, version);
+		m.off = off;
+		m.size = EXT2_DIRENTRY_LEN(de->name_len);
+		// a leaf holds a few hundred entries at most
+		for (j = count++; j > 0 and map[j - 1].hash > m.hash; j--)
+			map[j] = map[j - 1];
+		map[j] = m;
+	}
+	if (count < 2) {
+		kfree(map);
+		return -1;
+	}
+
+	half = count / 2;
+	*split = map[half].hash;
+	if (map[half - 1].hash == *split)
+		set_var_bit(*split, 1);
+	leaf_pack(lo, src, map, half);
+	leaf_pack(hi, src, map + half, count - half);
+	kfree(map);
+	return 0;
+}
+
+
+// === index blocks ===
+
+struct dx_frame_t {
+	struct blkbuf_t *bb;
+	struct dx_entry_t *entries, *at;
+};
+
+static void dx_release(struct dx_frame_t *frames, int32_t n)
+{
+	while (n-- > 0)
+		blk_release(frames[n].bb);
+}
+
+// Is block blk_no one that frames hold already? Reading it would deadlock.
+static int32_t dx_held(struct dx_frame_t *frames, int32_t n, uint32_t blk_no)
+{
+	if (blk_no == 0)
+		return 1;
+	for (int32_t i = 1; i < n; i++)
+		if (blk_no == dx_block(frames[i - 1].at))
+			return 1;
+	return 0;
+}
+
+/**
+ * @brief Whether the count and limit of an index block read from disk are off,
+ * which would take us past the end of the block.
+ */
+static int32_t dx_bad_countlimit(struct dx_entry_t *entries, uint32_t limit)
+{
+	struct dx_countlimit_t *cl = dx_countlimit(entries);
+	return cl->limit != limit or cl->count == 0 or cl->count > limit;
+}
+
+/**
+ * @brief Walk the index of dp down to the leaf that may hold name, leaving the
+ * index blocks on the way held in frames. Caller must hold `dp->i_mtx`.
+ * @param dp
+ * @param name
+ * @param hash set to the hash of name
+ * @param frames
+ * @return int32_t: the number of frames, -1 if the index is unusable
+ */
+static int32_t dx_probe(struct m_inode_t *dp, char *name, uint32_t *hash,
+			struct dx_frame_t *frames)
+{
+	struct blkbuf_t *bb;
+	struct dx_root_t *root;
+	struct dx_entry_t *entries, *p, *q, *m;
+	struct dx_countlimit_t *cl;
+	int32_t levels, n = 0;
+
+	if ((bb = dir_block(dp, 0)) == NULL)
+		return -1;
+	root = (struct dx_root_t *)bb->b_data;
+	levels = root->info.indirect_levels;
+	if (root->info.reserved_zero != 0 or root->info.info_length != 8 or
+	    levels >= DX_MAX_LEVELS or root->info.hash_version > DX_HASH_TEA)
+		goto bad;
+	*hash = dx_hash(name, strlen(name), root->info.hash_version);
+
+	entries = root->entries;
+	while (1) {
+		if (dx_bad_countlimit(entries,
+				      n == 0 ? DX_ROOT_LIMIT : DX_NODE_LIMIT))
+			goto bad;
+		cl = dx_countlimit(entries);
+		// the last entry whose hash is not above *hash
+		p = entries + 1, q = entries + cl->count - 1;
+		while (p <= q) {
+			m = p + (q - p) / 2;
+			if (m->hash > *hash)
+				q = m - 1;
+			else
+				p = m + 1;
+		}
+		frames[n].bb = bb;
+		frames[n].entries = entries;
+		frames[n].at = p - 1;
+		if (n++ == levels)
+			return n;
+		if (dx_held(frames, n, dx_block(frames[n - 1].at)) or
+		    (bb = dir_block(dp, dx_block(frames[n - 1].at))) == NULL) {
+			dx_release(frames, n);
+			return -1;
+		}
+		entries = ((struct dx_node_t *)bb->b_data)->entries;
+	}
+
+bad:
+	blk_release(bb);
+	dx_release(frames, n);
+	return -1;
+}
+
+/**
+ * @brief Step frames on to the next leaf if it carries on the run of hash,
+ * which a leaf split may have cut in two.
+ * @return int32_t: 1 if frames moved on, else 0
+ */
+static int32_t dx_next_block(struct m_inode_t *dp, struct dx_frame_t *frames,
+			     int32_t n, uint32_t hash)
+{
+	struct blkbuf_t *bb;
+	int32_t i = n - 1;
+
+	while (frames[i].at + 1 ==
+	       frames[i].entries + dx_countlimit(frames[i].entries)->count) {
+		if (i-- == 0)
+			return 0;
+	}
+	if (get_var_bit(frames[i].at[1].hash, ~1u) != hash)
+		return 0;
+	frames[i].at++;
+	while (++i < n) {
+		if ((bb = dir_block(dp, dx_block(frames[i - 1].at))) == NULL)
+			return 0;
+		if (dx_bad_countlimit(((struct dx_node_t *)bb->b_data)->entries,
+				      DX_NODE_LIMIT)) {
+			blk_release(bb);
+			return 0;
+		}
+		blk_release(frames[i].bb);
+		frames[i].bb = bb;
+		frames[i].entries = frames[i].at =
+			((struct dx_node_t *)bb->b_data)->entries;
+	}
+	return 1;
+}
+
+// Add an entry right after frame->at.
+static void dx_insert_entry(struct dx_frame_t *frame, uint32_t hash,
+			    uint32_t blk_no)
+{
+	struct dx_countlimit_t *cl = dx_countlimit(frame->entries);
+	struct dx_entry_t *new = frame->at + 1;
+
+	for (struct dx_entry_t *e = frame->entries + cl->count; e > new; e--)
+		*e = e[-1];
+	new->hash = hash;
+	new->block = blk_no;
+	cl->count++;
+	blk_mark_dirty(frame->bb);
+}
+
+/**
+ * @brief Make sure the lowest index block of frames has room for one more
+ * entry: a full root moves its entries down into a new dx_node, a full dx_node
+ * gives half of them to a new one.
+ * @param dp
+ * @param frames
+ * @param n updated if the tree grows a level
+ * @return int32_t: 0 on success, -1 if the index is full or out of blocks
+ */
+static int32_t dx_make_room(struct m_inode_t *dp, struct dx_frame_t *frames,
+			    int32_t *n)
+{
+	struct dx_frame_t *frame = &frames[*n - 1];
+	struct dx_countlimit_t *cl = dx_countlimit(frame->entries), *root_cl;
+	struct dx_node_t *node;
+	struct blkbuf_t *bb;
+	uint32_t split;
+	int32_t half, at;
+	int64_t blk_no;
+	char *buf;
+
+	if (cl->count < cl->limit)
+		return 0;
+	root_cl = dx_countlimit(frames[0].entries);
+	if (*n > 1 and root_cl->count == root_cl->limit)
+		return -1;
+	if ((buf = kzalloc(BLKSIZE)) == NULL)
+		return -1;
+	node = (struct dx_node_t *)buf;
+	node->fake.rec_len = BLKSIZE;
+
+	// the root moves everything, a dx_node its upper half
+	half = *n == 1 ? 0 : cl->count / 2;
+	split = frame->entries[half].hash;
+	memcpy(node->entries, frame->entries + half,
+	       (cl->count - half) * sizeof(struct dx_entry_t));
+	dx_countlimit(node->entries)->limit = DX_NODE_LIMIT;
+	dx_countlimit(node->entries)->count = cl->count - half;
+	blk_no = dir_append(dp, buf);
+	kfree(buf);
+	if (blk_no < 0 or (bb = dir_block(dp, blk_no)) == NULL)
+		return -1;
+
+	at = frame->at - frame->entries;
+	if (*n == 1) {
+		cl->count = 1;
+		frame->entries[0].block = blk_no;
+		((struct dx_root_t *)frame->bb->b_data)->info.indirect_levels =
+			1;
+		blk_mark_dirty(frame->bb);
+		frame->at = frame->entries;
+		frame = &frames[(*n)++];
+	} else {
+		cl->count = half;
+		blk_mark_dirty(frame->bb);
+		dx_insert_entry(&frames[0], split, blk_no);
+		if (at < half) {
+			blk_release(bb);
+			return 0;
+		}
+		frames[0].at++;
+		blk_release(frame->bb);
+	}
+	frame->bb = bb;
+	frame->entries = ((struct dx_node_t *)bb->b_data)->entries;
+	frame->at = frame->entries + at - half;
+	return 0;
+}
+
+
+// === interface ===
+
+int32_t htree_enabled()
+{
+	struct ext2_super_block_t *sb = &m_sb.d_sb_ctnt;
+	return sb->s_rev_level >= EXT2_DYNAMIC_REV and
+	       get_var_bit(sb->s_feature_compat, EXT2_FEATURE_COMPAT_DIR_INDEX);
+}
+
+/**
+ * @brief Look name up through the index of directory dp. If found, set `*poff`
+ * to byte offset of entry. Caller must hold `dp->i_mtx`.
+ * @param dp
+ * @param name
+ * @param poff
+ * @return int64_t: the inode number, 0 if there is no such name, -1 if the
+ * index is unusable and the directory has to be scanned
+ */
+int64_t htree_find(struct m_inode_t *dp, char *name, uint64_t *poff)
+{
+	struct dx_frame_t frames[DX_MAX_LEVELS];
+	struct blkbuf_t *bb;
+	uint32_t hash, blk_no;
+	int32_t n, off, namelen = strlen(name);
+	int64_t i_no = 0;
+
+	if ((n = dx_probe(dp, name, &hash, frames)) < 0)
+		return -1;
+	do {
+		blk_no = dx_block(frames[n - 1].at);
+		if (dx_held(frames, n, blk_no) or
+		    (bb = dir_block(dp, blk_no)) == NULL) {
+			i_no = -1;
+			break;
+		}
+		if ((off = leaf_find(bb->b_data, name, namelen)) >= 0) {
+			i_no = ((struct ext2_dir_entry_t *)(bb->b_data + off))
+				       ->inode;
+			if (poff)
+				*poff = (uint64_t)blk_no * BLKSIZE + off;
+		}
+		blk_release(bb);
+	} while (i_no == 0 and dx_next_block(dp, frames, n, hash));
+	dx_release(frames, n);
+
+	return i_no;
+}
+
+/**
+ * @brief Add a name, known to be absent, to the indexed directory dp, splitting
+ * its leaf if that is full. Caller must hold `dp->i_mtx`.
+ * @param dp
+ * @param name
+ * @param i_no
+ * @return int32_t: 0 on success, -1 on failure, -2 if the index is unusable
+ */
+int32_t htree_add(struct m_inode_t *dp, char *name, uint32_t i_no)
+{
+	struct dx_frame_t frames[DX_MAX_LEVELS];
+	struct blkbuf_t *bb;
+	uint32_t hash, split, blk_no;
+	int32_t n, res = -1, namelen = strlen(name), version;
+	int64_t new_blk;
+	char *lo = NULL, *hi = NULL;
+
+	if ((n = dx_probe(dp, name, &hash, frames)) < 0)
+		return -2;
+	version = ((struct dx_root_t *)frames[0].bb->b_data)->info.hash_version;
+	blk_no = dx_block(frames[n - 1].at);
+	if (dx_held(frames, n, blk_no) or (bb = dir_block(dp, blk_no)) == NULL)
+		goto ret;
+	if (leaf_add(bb->b_data, name, namelen, i_no) == 0) {
+		blk_write_over(bb);
+		res = 0;
+		goto ret;
+	}
+
+	// the leaf is full, split it in two by hash
+	if ((lo = kmalloc(BLKSIZE)) == NULL or (hi = kmalloc(BLKSIZE)) == NULL or
+	    dx_make_room(dp, frames, &n) < 0 or
+	    leaf_split(bb->b_data, lo, hi, version, &split) < 0) {
+		blk_release(bb);
+		goto ret;
+	}
+	// long names may leave too little room in the half the name goes to
+	if (leaf_add(hash >= get_var_bit(split, ~1u) ? hi : lo, name, namelen,
+		     i_no) < 0 or
+	    (new_blk = dir_append(dp, hi)) < 0) {
+		blk_release(bb);
+		goto ret;
+	}
+	memcpy(bb->b_data, lo, BLKSIZE);
+	blk_write_over(bb);
+	dx_insert_entry(&frames[n - 1], split, new_blk);
+	res = 0;
+
+ret:
+	kfree(lo), kfree(hi);
+	dx_release(frames, n);
+	return res;
+}
+
+/**
+ * @brief Turn the full single-block directory dp into an indexed one: its
+ * entries but "." and ".." move to a new leaf and block 0 becomes the root.
+ * Caller must hold `dp->i_mtx`.
+ * @param dp
+ * @return int32_t: 0 on success, -1 on failure
+ */
+int32_t htree_make_indexed(struct m_inode_t *dp)
+{
+	struct blkbuf_t *bb;
+	struct ext2_dir_entry_t *dot, *dotdot, *de = NULL;
+	struct dx_root_t *root;
+	uint32_t parent;
+	int32_t start, off;
+	int64_t blk_no;
+	char *buf;
+
+	if ((bb = dir_block(dp, 0)) == NULL)
+		return -1;
+	dot = (struct ext2_dir_entry_t *)bb->b_data;
+	dotdot = (struct ext2_dir_entry_t *)(bb->b_data + dot->rec_len);
+	start = dot->rec_len + dotdot->rec_len;
+	if (dot->rec_len < sizeof(*dot) or dot->name_len != 1 or
+	    start > BLKSIZE or dotdot->name_len != 2 or
+	    (buf = kzalloc(BLKSIZE)) == NULL) {
+		blk_release(bb);
+		return -1;
+	}
+	parent = dotdot->inode;
+
+	// the leaf gets all past "..", the last entry stretched to the end
+	memcpy(buf, bb->b_data + start, BLKSIZE - start);
+	for (off = 0; off < BLKSIZE - start; off += de->rec_len) {
+		de = (struct ext2_dir_entry_t *)(buf + off);
+		if (de->rec_len < sizeof(*de))
+			break;
+	}
+	if (de != NULL)
+		de->rec_len += start;
+	else
+		((struct ext2_dir_entry_t *)buf)->rec_len = BLKSIZE;
+	blk_no = dir_append(dp, buf);
+	kfree(buf);
+	if (blk_no < 0) {
+		blk_release(bb);
+		return -1;
+	}
+
+	memset(bb->b_data, 0, BLKSIZE);
+	root = (struct dx_root_t *)bb->b_data;
+	root->dot.inode = dp->i_no;
+	root->dot.rec_len = sizeof(root->dot) + sizeof(root->dot_name);
+	root->dot.name_len = 1;
+	strcpy(root->dot_name, ".");
+	root->dotdot.inode = parent;
+	root->dotdot.rec_len = BLKSIZE - root->dot.rec_len;
+	root->dotdot.name_len = 2;
+	strcpy(root->dotdot_name, "..");
+	root->info.hash_version = m_sb.d_sb_ctnt.s_def_hash_version;
+	if (root->info.hash_version > DX_HASH_TEA)
+		root->info.hash_version = DX_HASH_HALF_MD4;
+	root->info.info_length = sizeof(root->info);
+	dx_countlimit(root->entries)->limit = DX_ROOT_LIMIT;
+	dx_countlimit(root->entries)->count = 1;
+	root->entries[0].block = blk_no;
+	blk_write_over(bb);
+
+	set_var_bit(dp->d_inode_ctnt.i_flags, EXT2_INDEX_FL);
+	iupdate(dp, 0);
+	return 0;
+}
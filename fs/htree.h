@@ -0,0 +1,16 @@
+#ifndef __FS_HTREE_H__
+#define __FS_HTREE_H__
+
+
+#include <uniks/defs.h>
+
+
+struct m_inode_t;
+
+int32_t htree_enabled();
+int64_t htree_find(struct m_inode_t *dp, char *name, uint64_t *poff);
+int32_t htree_add(struct m_inode_t *dp, char *name, uint32_t i_no);
+int32_t htree_make_indexed(struct m_inode_t *dp);
+
+
+#endif /* !__FS_HTREE_H__ */
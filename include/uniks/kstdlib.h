@@ -26,6 +26,7 @@
 int64_t div_round_up(int64_t fisrt, int64_t second);
 uintptr_t alignaddr_up(uintptr_t addr, size_t alignment);
 uintptr_t alignaddr_down(uintptr_t addr, size_t alignment);
+int32_t ctz64(uint64_t x);
 
 
 #endif /* !__KSTDLIB_H__ */
\ No newline at end of file
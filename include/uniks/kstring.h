@@ -18,6 +18,16 @@ void *memset(void *s, char c, size_t n);
 void *memcpy(void *dst, const void *src, size_t n);
 int32_t memcmp(const void *v1, const void *v2, size_t n);
 
+// the kernels memset()/memcpy()/memcmp() pick from, see libs/kstring.c
+extern int32_t kstring_rvv;
+void kstring_init(int32_t rvv);
+void *memset_word(void *s, char c, size_t n);
+void *memcpy_word(void *dst, const void *src, size_t n);
+int32_t memcmp_word(const void *v1, const void *v2, size_t n);
+void *memset_rvv(void *s, char c, size_t n);
+void *memcpy_rvv(void *dst, const void *src, size_t n);
+int32_t memcmp_rvv(const void *v1, const void *v2, size_t n);
+
 int32_t is_separator(char c, const char *tok);
 char *strsep(const char *str, const char *tok);
 char *strrsep(const char *str, const char *tok);
@@ -19,6 +19,16 @@
 #define MAXARGLEN   (64)
 #define MAXSTACK    (32)   // max number of processes' stack size(pages)
 
+// memory management configurable parameters
+#define PCP_HIGH  (64)	 // max free pages in a hart's page cache
+#define PCP_BATCH (16)	 // pages moved between it and the buddy system at once
+#define ZERO_POOL_HIGH (64)  // pre-zeroed pages idle harts keep at hand
+#define FAULT_AROUND_PAGES (16)	// file pages mapped per fault, a power of 2
+#define TLB_FLUSH_CEILING (32)	// pages above which a whole ASID is flushed
+#define KMEM_NCACHE   (32)   // max number of kmem caches
+#define KMEM_MAG_SIZE (16)   // objects in a hart's magazine of a kmem cache
+#define KMEM_EMPTY_KEEP (2)  // empty slabs a kmem cache keeps from the buddy
+
 // file system configurable parameters
 #define KiB		 (1024)
 #define MiB		 (1024 * KiB)
@@ -26,13 +36,25 @@
 #define NBBUF		 (8192)	  // size of disk block buffer cache
 #define NFD		 (64)	  // number of fds of each process
 #define NINODE		 (512)	  // max number of active inodes
+#define NDENTRY		 (512)	  // max number of cached directory entries
 #define NFILE		 (256)	  // max number of opening files in system
+#define PIPE_GIFT	 (0)	  // let page-aligned pipe writes donate pages
+#define PIPE_NGIFT	 (16)	  // max gifted pages queued in one pipe
+#define PIPE_STAGE	 (1024)	  // bytes a pipe moves per user copy
+#define RA_MIN_BLKS	 (4)	  // initial sequential readahead window
+#define RA_MAX_BLKS	 (32)	  // max sequential readahead window
+#define DIRTY_BG_RATIO	 (10)	  // % of NBBUF dirty to start writeback
+#define DIRTY_RATIO	 (20)	  // % of NBBUF dirty to throttle writers
+#define MAPPED_RATIO	 (25)	  // % of NBBUF shared mappings may pin
+#define DIRTY_EXPIRE	 (3000)	  // ms a buffer may stay dirty
+#define WRITEBACK_INTERVAL (500) // ms between periodic writeback
 #define PATH_MAX	 (1024)
 #define ROOTPATH	 "/"
 // device module configurable parameters
 #define NDEVICE		 (64)	// max major device number, according to platform's PLIC
 #define DEV_NAME_LEN	 (8)	 // max length of dev name
 #define HASH_TABLE_PRIME (307)	 // this number comes from Linux-0.11
+#define BLK_POLICY	 "2q"	 // block cache replacement, "2q" or "lru"
 
 // UART configurable parameters
 #define UART_TX_BUF_SIZE (1024)
@@ -34,5 +34,15 @@ void queue_push_chartype(struct queue_meta_t *q, char push_data);
 void queue_front_pop(struct queue_meta_t *q);
 void queue_back_pop(struct queue_meta_t *q);
 
+/**
+ * @brief Bulk access to a chartype queue: the contiguous run of free slots
+ * after the tail (or of queued bytes from the head) stops at the end of the
+ * array, so a ring that wraps is handled in two runs.
+ */
+char *queue_back_run_chartype(struct queue_meta_t *q, int32_t *len);
+void queue_push_n(struct queue_meta_t *q, int32_t n);
+char *queue_front_run_chartype(struct queue_meta_t *q, int32_t *len);
+void queue_front_pop_n(struct queue_meta_t *q, int32_t n);
+
 
 #endif /* !__QUEUE_H__ */
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef __RBTREE_H__
+#define __RBTREE_H__
+
+
+#include <uniks/defs.h>
+
+/* this red-black tree follows linux:include/linux/rbtree.h of v2.6, with url:
+ * [https://github.com/torvalds/linux/blob/master/include/linux/rbtree.h]
+ * The tree is intrusive and knows nothing of keys: the user walks down from
+ * the root to find where a node goes, links it with rb_link_node() and then
+ * calls rb_insert_color() to rebalance. */
+
+
+#define RB_RED	 (0)
+#define RB_BLACK (1)
+
+struct rb_node_t {
+	struct rb_node_t *parent, *left, *right;
+	int32_t color;
+};
+
+struct rb_root_t {
+	struct rb_node_t *node;
+};
+
+#define RB_ROOT_GEN \
+	{ \
+		NULL \
+	}
+
+__always_inline void rb_link_node(struct rb_node_t *node,
+				  struct rb_node_t *parent,
+				  struct rb_node_t **link)
+{
+	node->parent = parent;
+	node->left = node->right = NULL;
+	node->color = RB_RED;
+	*link = node;
+}
+
+void rb_insert_color(struct rb_node_t *node, struct rb_root_t *root);
+
+void rb_erase(struct rb_node_t *node, struct rb_root_t *root);
+
+
+#endif /* !__RBTREE_H__ */
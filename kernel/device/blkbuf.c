@@ -1,10 +1,13 @@
 #include "blkbuf.h"
 #include "virtio_disk.h"
+#include <device/clock.h>
 #include <device/device.h>
 #include <mm/mmu.h>
 #include <mm/phys.h>
 #include <platform/platform.h>
 #include <process/proc.h>
+#include <uniks/kstdio.h>
+#include <uniks/kstring.h>
 #include <uniks/param.h>
 
 
@@ -16,39 +19,171 @@ char zero_blk[BLKSIZE] = {0};
 #define _hashfn(dev, block) (((uint32_t)((dev) ^ (block))) % HASH_TABLE_PRIME)
 #define hash(dev, block)    (blk_cache.hash_bucket_table[_hashfn((dev), (block))])
 
+
+/* === replacement policies === */
+
+static void lru_on_miss(struct blkbuf_t *bb, dev_t dev, uint32_t blkno)
+{
+	bb->b_queue = BQ_AM;
+}
+
+static int32_t lru_victim_queue(struct blk_lru_t *lru)
+{
+	return BQ_AM;
+}
+
+static int32_t lru_second_chance(struct blkbuf_t *bb)
+{
+	return bb->b_ref;
+}
+
+static void lru_on_evict(struct blkbuf_t *bb) {}
+
+/**
+ * @brief 2Q (Johnson & Shasha, VLDB'94). A block read in for the first time
+ * joins A1in, a FIFO whose hits don't count, so a long sequential scan only
+ * ever cycles through A1in. Blocks pushed out of A1in are remembered in the
+ * ghost list A1out, and one that is asked for again while still remembered
+ * has proved to be reused and joins Am, where bitmaps, inode tables and
+ * directory blocks end up staying.
+ */
+#define Q2_KIN	(NBBUF / 4 / MAXNUM_HARTID)   // A1in share of each hart
+#define Q2_KOUT (NBBUF / 2)		      // entries of A1out
+// A1out is kept per hash bucket, a FIFO of its own under the bucket's lock
+#define Q2_KOUT_BUCKET ((Q2_KOUT + HASH_TABLE_PRIME - 1) / HASH_TABLE_PRIME)
+
+static struct q2_ghost_t {
+	struct q2_ghost_ent_t {
+		dev_t dev;
+		uint32_t blkno;
+		int32_t used;
+	} ents[Q2_KOUT_BUCKET];
+	uint32_t head;	 // the oldest entry, overwritten next
+} q2_ghost[HASH_TABLE_PRIME];
+
+static void q2_init()
+{
+	for (int64_t i = 0; i < HASH_TABLE_PRIME; i++) {
+		for (int64_t j = 0; j < Q2_KOUT_BUCKET; j++)
+			q2_ghost[i].ents[j].used = 0;
+		q2_ghost[i].head = 0;
+	}
+}
+
+static void q2_on_miss(struct blkbuf_t *bb, dev_t dev, uint32_t blkno)
+{
+	struct q2_ghost_t *g = &q2_ghost[_hashfn(dev, blkno)];
+
+	bb->b_queue = BQ_A1IN;
+	for (int64_t i = 0; i < Q2_KOUT_BUCKET; i++) {
+		struct q2_ghost_ent_t *e = &g->ents[i];
+		if (e->used and e->dev == dev and e->blkno == blkno) {
+			e->used = 0;
+			bb->b_queue = BQ_AM;
+			break;
+		}
+	}
+}
+
+static int32_t q2_victim_queue(struct blk_lru_t *lru)
+{
+	if (lru->nr[BQ_A1IN] > Q2_KIN or lru->nr[BQ_AM] == 0)
+		return BQ_A1IN;
+	return BQ_AM;
+}
+
+static int32_t q2_second_chance(struct blkbuf_t *bb)
+{
+	return bb->b_queue == BQ_AM and bb->b_ref;
+}
+
+static void q2_on_evict(struct blkbuf_t *bb)
+{
+	if (bb->b_queue != BQ_A1IN)
+		return;
+
+	struct q2_ghost_t *g = &q2_ghost[_hashfn(bb->b_dev, bb->b_blkno)];
+	struct q2_ghost_ent_t *e = &g->ents[g->head];
+	e->dev = bb->b_dev;
+	e->blkno = bb->b_blkno;
+	e->used = 1;
+	g->head = (g->head + 1) % Q2_KOUT_BUCKET;
+}
+
+static struct blk_policy_t blk_policies[] = {
+	{"2q", q2_on_miss, q2_victim_queue, q2_second_chance, q2_on_evict},
+	{"lru", lru_on_miss, lru_victim_queue, lru_second_chance,
+	 lru_on_evict},
+};
+
+
 void blk_init()
 {
 	initlock(&blk_cache.lock, "blk_cache");
 
 	for (int64_t i = 0; i < HASH_TABLE_PRIME; i++) {
-		INIT_LIST_HEAD(&blk_cache.hash_bucket_table[i]);
+		initlock(&blk_cache.hash_bucket_table[i].lock, "blkbucket");
+		INIT_LIST_HEAD(&blk_cache.hash_bucket_table[i].chain);
 	}
-	INIT_LIST_HEAD(&blk_cache.free_list);
+	for (int64_t i = 0; i < MAXNUM_HARTID; i++) {
+		struct blk_lru_t *lru = &blk_cache.lru[i];
+		initlock(&lru->lock, "blklru");
+		for (int32_t q = 0; q < BQ_NR; q++) {
+			INIT_LIST_HEAD(&lru->list[q]);
+			lru->nr[q] = 0;
+		}
+		atomic_init(&lru->hits, 0);
+		atomic_init(&lru->misses, 0);
+	}
+	blk_cache.policy = &blk_policies[0];
+	for (int64_t i = 0;
+	     i < sizeof(blk_policies) / sizeof(blk_policies[0]); i++) {
+		if (strcmp(blk_policies[i].name, BLK_POLICY) == 0)
+			blk_cache.policy = &blk_policies[i];
+	}
+	q2_init();
+	atomic_init(&blk_cache.lru_gen, 0);
+	atomic_init(&blk_cache.nr_waiting, 0);
 	INIT_LIST_HEAD(&blk_cache.wait_list);
+	INIT_LIST_HEAD(&blk_cache.dirty_list);
+	INIT_LIST_HEAD(&blk_cache.dirty_wait_list);
+	INIT_LIST_HEAD(&blk_cache.wb_wait_list);
+	blk_cache.nr_dirty = blk_cache.wb_kicked = 0;
+	blk_cache.wb_proc = NULL;
+	atomic_init(&blk_cache.nr_mapped, 0);
 
 	for (struct blkbuf_t *bb = blk_cache.blkbuf;
 	     bb < &blk_cache.blkbuf[NBBUF]; bb++) {
-		bb->b_count = bb->b_dirty = bb->b_hashed = 0;
+		bb->b_count = bb->b_dirty = bb->b_hashed = bb->b_ref = 0;
 		bb->b_data = NULL;
+		bb->b_end_io = NULL;
 		INIT_LIST_HEAD(&bb->disk_wait_list);
 		mutex_init(&bb->b_mtx, "blkbufmtx");
-		list_add_front(&bb->free_node, &blk_cache.free_list);
+		// deal the buffers out evenly among the harts
+		bb->b_list = (bb - blk_cache.blkbuf) % MAXNUM_HARTID;
+		bb->b_queue = BQ_A1IN;
+		list_add_front(&bb->free_node,
+			       &blk_cache.lru[bb->b_list].list[BQ_A1IN]);
+		blk_cache.lru[bb->b_list].nr[BQ_A1IN]++;
 	}
 }
 
 /**
  * @brief Find a cached block for a given device number and block number in the
  * cache. If found, returns a corresponding pointer. Otherwise return NULL.
+ * Caller must hold the lock of `bucket`.
+ * @param bucket
  * @param dev
  * @param blkno
  * @return struct blkbuf_t*
  */
-static struct blkbuf_t *find_buffer_inhash(dev_t dev, uint32_t blkno)
+static struct blkbuf_t *find_buffer_inhash(struct blk_bucket_t *bucket,
+					   dev_t dev, uint32_t blkno)
 {
 	struct list_node_t *l;
-	struct list_node_t *bucket = &hash(dev, blkno);
 
-	for (l = list_next(bucket); l != bucket; l = list_next(l)) {
+	for (l = list_next(&bucket->chain); l != &bucket->chain;
+	     l = list_next(l)) {
 		struct blkbuf_t *bb =
 			element_entry(l, struct blkbuf_t, hash_node);
 		if (bb->b_dev == dev and bb->b_blkno == blkno) {
@@ -58,72 +193,366 @@ static struct blkbuf_t *find_buffer_inhash(dev_t dev, uint32_t blkno)
 	return NULL;
 }
 
-static struct blkbuf_t *get_LRU_blk()
+// Wake the writeback thread up. Caller must hold blk_cache.lock.
+static void wb_kick()
 {
-	struct list_node_t *l;
-	try:
-		if (!list_empty(&blk_cache.free_list)) {
-			l = list_prev_then_del(&blk_cache.free_list);
-		} else {
-			proc_block(&blk_cache.wait_list, &blk_cache.lock);
-			goto try;
+	blk_cache.wb_kicked = 1;
+	proc_unblock_all(&blk_cache.wb_wait_list);
+}
+
+// Link a clean unreferenced buffer on its queue of the LRU lists of hart `idx`.
+static void lru_add(struct blkbuf_t *bb, int32_t idx, int32_t lru_end)
+{
+	struct blk_lru_t *lru = &blk_cache.lru[idx];
+
+	acquire(&lru->lock);
+	if (lru_end)
+		list_add_tail(&bb->free_node, &lru->list[bb->b_queue]);
+	else
+		list_add_front(&bb->free_node, &lru->list[bb->b_queue]);
+	lru->nr[bb->b_queue]++;
+	bb->b_list = idx;
+	release(&lru->lock);
+}
+
+/**
+ * @brief Unlink `bb` from LRU list `idx`, where it was seen last. Fails if an
+ * evictor took it off first, since then the evictor decides where it goes.
+ * @param bb
+ * @param idx
+ * @return int32_t 1 if unlinked, otherwise 0
+ */
+static int32_t lru_del(struct blkbuf_t *bb, int32_t idx)
+{
+	int32_t res = 0;
+
+	acquire(&blk_cache.lru[idx].lock);
+	if (bb->b_list == idx) {
+		list_del(&bb->free_node);
+		blk_cache.lru[idx].nr[bb->b_queue]--;
+		bb->b_list = BL_NONE;
+		res = 1;
+	}
+	release(&blk_cache.lru[idx].lock);
+	return res;
+}
+
+/**
+ * @brief Take the least recently used buffer off the queue of hart `idx` the
+ * replacement policy picks, or off the other one if that is empty.
+ * @param idx
+ * @return struct blkbuf_t*
+ */
+static struct blkbuf_t *lru_pop(int32_t idx)
+{
+	struct blk_lru_t *lru = &blk_cache.lru[idx];
+	struct blkbuf_t *bb = NULL;
+
+	acquire(&lru->lock);
+	int32_t q = blk_cache.policy->victim_queue(lru);
+	if (list_empty(&lru->list[q]))
+		q = (q + 1) % BQ_NR;
+	if (!list_empty(&lru->list[q])) {
+		bb = element_entry(list_prev_then_del(&lru->list[q]),
+				   struct blkbuf_t, free_node);
+		lru->nr[q]--;
+		bb->b_list = BL_LIMBO;
+	}
+	release(&lru->lock);
+	return bb;
+}
+
+// Hand a clean unreferenced buffer to the LRU, and to whoever waits for one.
+static void blk_free(struct blkbuf_t *bb, int32_t lru_end)
+{
+	lru_add(bb, mycpu()->hartid, lru_end);
+	atomic_fetch_add(&blk_cache.lru_gen, 1);
+	if (atomic_load(&blk_cache.nr_waiting) > 0) {
+		acquire(&blk_cache.lock);
+		proc_unblock_all(&blk_cache.wait_list);
+		release(&blk_cache.lock);
+	}
+}
+
+/**
+ * @brief Put an unreferenced buffer, or a dirty one from blk_queue_dirty(), on
+ * the list it belongs to: a clean one on an LRU list, while a dirty one queues
+ * up on dirty_list for the writeback thread, oldest first. A clean buffer still
+ * sitting on an LRU list since before it was last hit stays where it is, its
+ * b_ref gives it a second chance. Caller must hold the lock of the bucket of
+ * `bb`.
+ * @param bb
+ */
+static void blk_relink(struct blkbuf_t *bb)
+{
+	/**
+	 * @brief Evictors and the writeback move a listed buffer to BL_LIMBO
+	 * under their own locks, not ours: decide on one snapshot of b_list
+	 * and leave the last word to the re-checks under those locks.
+	 */
+	int32_t list = bb->b_list;
+
+	if (list == BL_LIMBO)	// whoever holds it will see b_count == 0
+		return;
+	if (bb->b_dirty) {
+		if (list == BL_DIRTY)
+			return;
+		if (list >= 0 and !lru_del(bb, list))
+			return;
+		acquire(&blk_cache.lock);
+		list_add_tail(&bb->free_node, &blk_cache.dirty_list);
+		bb->b_list = BL_DIRTY;
+		release(&blk_cache.lock);
+	} else {
+		if (list >= 0)
+			return;
+		if (list == BL_DIRTY) {	  // cleaned behind our back
+			acquire(&blk_cache.lock);
+			if (bb->b_list != BL_DIRTY) {	// the writeback has it
+				release(&blk_cache.lock);
+				return;
+			}
+			list_del(&bb->free_node);
+			bb->b_list = BL_NONE;
+			release(&blk_cache.lock);
 		}
-	return element_entry(l, struct blkbuf_t, free_node);
+		blk_free(bb, 0);
+	}
 }
 
-static void rmold_then_insert_newhash(struct blkbuf_t *bb, dev_t dev,
-				      uint32_t blkno)
+/**
+ * @brief Decide on a buffer an evictor just took off an LRU list. If it can be
+ * reused, unhash it and return it with a reference held; otherwise put it back
+ * where it belongs and return NULL.
+ * @param bb
+ * @return struct blkbuf_t*
+ */
+static struct blkbuf_t *blk_reclaim(struct blkbuf_t *bb)
 {
-	if (bb->b_hashed)
+	if (!bb->b_hashed) {   // nobody can find it
+		bb->b_list = BL_NONE;
+		bb->b_count = 1;
+		return bb;
+	}
+
+	struct blk_bucket_t *bucket = &hash(bb->b_dev, bb->b_blkno);
+	acquire(&bucket->lock);
+	bb->b_list = BL_NONE;
+	if (bb->b_count > 0) {
+		// in use, the last blk_put() links it again
+		bb = NULL;
+	} else if (bb->b_dirty or blk_cache.policy->second_chance(bb)) {
+		bb->b_ref = 0;
+		blk_relink(bb);
+		bb = NULL;
+	} else {
+		blk_cache.policy->on_evict(bb);
 		list_del(&bb->hash_node);
+		bb->b_hashed = 0;
+		bb->b_count = 1;
+	}
+	release(&bucket->lock);
+	return bb;
+}
+
+// Evict from this hart's LRU list, or steal from the others when it runs dry.
+static struct blkbuf_t *blk_evict()
+{
+	int32_t self = mycpu()->hartid;
+	struct blkbuf_t *bb;
 
-	struct list_node_t *bucket = &hash(dev, blkno);
-	list_add_front(&bb->hash_node, bucket);
-	bb->b_hashed = 1;
+	for (int32_t i = 0; i < MAXNUM_HARTID; i++) {
+		while ((bb = lru_pop((self + i) % MAXNUM_HARTID)) != NULL) {
+			if ((bb = blk_reclaim(bb)) != NULL)
+				return bb;
+		}
+	}
+	return NULL;
 }
 
 /**
- * @brief Look through buffer for block on device `dev`. Make sure that return a
- * buffered block with mutex-lock holding, and also the buffer of a disk's block
- * is unique in global.
- * @param dev
- * @param blkno
+ * @brief Get an unhashed buffer with a data page to reuse. Only clean buffers
+ * sit on the LRU lists, so eviction never has to write anything back. If none
+ * is free, let the writeback thread clean some and wait for them, unless
+ * `nowait` is set.
+ * @param nowait
  * @return struct blkbuf_t*
  */
-struct blkbuf_t *getblk(dev_t dev, uint32_t blkno)
+static struct blkbuf_t *blk_alloc(int32_t nowait)
 {
 	struct blkbuf_t *bb;
-	acquire(&blk_cache.lock);
+	uint32_t gen;
 
-	// Is the block already cached?
-	if ((bb = find_buffer_inhash(dev, blkno)) != NULL) {
-		if (bb->b_count++ == 0)
-			list_del(&bb->free_node);
-		goto ret;
+	while (1) {
+		gen = atomic_load(&blk_cache.lru_gen);
+		if ((bb = blk_evict()) != NULL)
+			break;
+		if (nowait)
+			return NULL;
+
+		acquire(&blk_cache.lock);
+		wb_kick();
+		atomic_fetch_add(&blk_cache.nr_waiting, 1);
+		// a buffer freed since our attempt would have bumped lru_gen
+		if (atomic_load(&blk_cache.lru_gen) == gen)
+			proc_block(&blk_cache.wait_list, &blk_cache.lock);
+		atomic_fetch_sub(&blk_cache.nr_waiting, 1);
+		release(&blk_cache.lock);
 	}
 
-	/**
-	 * @brief Don't find in hash table (namely not cached and need to
-	 * get a new block and read from disk).
-	 */
-	bb = get_LRU_blk();
-	rmold_then_insert_newhash(bb, dev, blkno);
-	bb->b_dev = dev;
-	bb->b_blkno = blkno;
-	bb->b_count++;
 	if (bb->b_data == NULL) {
 		if ((bb->b_data = pages_alloc(1)) == NULL) {
-			release(&blk_cache.lock);
+			bb->b_count = 0;
+			blk_free(bb, 1);
 			return NULL;
 		}
+		// lets blk_of_page() find it from a user mapping
+		page_set_private(bb->b_data, bb - blk_cache.blkbuf + 1);
 	}
+	return bb;
+}
 
-ret:
-	release(&blk_cache.lock);
-	mutex_acquire(&bb->b_mtx);
+/**
+ * @brief Take a reference to the buffer of block `blkno` on device `dev`,
+ * setting up a new one if it is not cached. `*fresh` tells whether it is new,
+ * in which case its b_valid is 0.
+ * @param dev
+ * @param blkno
+ * @param nowait don't sleep for a free buffer, just return NULL
+ * @param fresh
+ * @return struct blkbuf_t*
+ */
+static struct blkbuf_t *blk_get(dev_t dev, uint32_t blkno, int32_t nowait,
+				int32_t *fresh)
+{
+	struct blk_bucket_t *bucket = &hash(dev, blkno);
+	struct blkbuf_t *bb, *victim = NULL;
+
+	acquire(&bucket->lock);
+	while ((bb = find_buffer_inhash(bucket, dev, blkno)) == NULL) {
+		if (victim != NULL) {
+			bb = victim;
+			victim = NULL;
+			bb->b_dev = dev;
+			bb->b_blkno = blkno;
+			bb->b_valid = bb->b_ref = 0;
+			blk_cache.policy->on_miss(bb, dev, blkno);
+			list_add_front(&bb->hash_node, &bucket->chain);
+			bb->b_hashed = 1;
+			release(&bucket->lock);
+			if (!nowait)
+				atomic_fetch_add(
+					&blk_cache.lru[mycpu()->hartid].misses,
+					1);
+			*fresh = 1;
+			return bb;
+		}
+
+		/**
+		 * @brief Don't find in hash table (namely not cached and need
+		 * to get a new block and read from disk). Look again after
+		 * eviction, someone else may have set it up meanwhile.
+		 */
+		release(&bucket->lock);
+		if ((victim = blk_alloc(nowait)) == NULL)
+			return NULL;
+		acquire(&bucket->lock);
+	}
+
+	bb->b_count++;
+	if (!nowait)
+		bb->b_ref = 1;
+	release(&bucket->lock);
+	if (!nowait)
+		atomic_fetch_add(&blk_cache.lru[mycpu()->hartid].hits, 1);
+	if (victim != NULL) {	// lost the race, give it back
+		victim->b_count = 0;
+		blk_free(victim, 1);
+	}
+	*fresh = 0;
+	return bb;
+}
+
+/**
+ * @brief Look through buffer for block on device `dev`. Make sure that return a
+ * buffered block with mutex-lock holding, and also the buffer of a disk's block
+ * is unique in global.
+ * @param dev
+ * @param blkno
+ * @return struct blkbuf_t*
+ */
+struct blkbuf_t *getblk(dev_t dev, uint32_t blkno)
+{
+	int32_t fresh;
+	struct blkbuf_t *bb = blk_get(dev, blkno, 0, &fresh);
+
+	if (bb != NULL)
+		mutex_acquire(&bb->b_mtx);
 	return bb;   // return with mutex-lock holding
 }
 
+// drop a reference to the buffer, which is relinked once nobody refers to it
+void blk_put(struct blkbuf_t *bb)
+{
+	struct blk_bucket_t *bucket = &hash(bb->b_dev, bb->b_blkno);
+
+	acquire(&bucket->lock);
+	if (--bb->b_count == 0)	  // no one is referring it
+		blk_relink(bb);
+	release(&bucket->lock);
+}
+
+// take another reference to a buffer the caller already holds one to
+void blk_hold(struct blkbuf_t *bb)
+{
+	struct blk_bucket_t *bucket = &hash(bb->b_dev, bb->b_blkno);
+
+	acquire(&bucket->lock);
+	assert(bb->b_count > 0);
+	bb->b_count++;
+	release(&bucket->lock);
+}
+
+/**
+ * @brief Count one more user page mapping a block, whose reference keeps the
+ * buffer from being evicted for as long as it is mapped. Fails once
+ * MAPPED_RATIO percent of the cache is mapped so, lest shared mappings leave
+ * blk_alloc() nothing to evict, unless `force` is set for a mapping that only
+ * duplicates one counted already.
+ * @param force
+ * @return int32_t 0 if counted, -1 if too many buffers are mapped
+ */
+int32_t blk_map_pin(int32_t force)
+{
+	if (atomic_fetch_add(&blk_cache.nr_mapped, 1) >= MAPPED_THRESH and
+	    !force) {
+		atomic_fetch_sub(&blk_cache.nr_mapped, 1);
+		return -1;
+	}
+	return 0;
+}
+
+// uncount a user page mapping a block, see blk_map_pin()
+void blk_map_unpin()
+{
+	atomic_fetch_sub(&blk_cache.nr_mapped, 1);
+}
+
+/**
+ * @brief Return the buffer whose b_data is `page`, or NULL if the page does
+ * not belong to the block cache.
+ * @param page
+ * @return struct blkbuf_t*
+ */
+struct blkbuf_t *blk_of_page(void *page)
+{
+	uint32_t idx = page_private(page);
+	if (idx == 0 or idx > NBBUF)
+		return NULL;
+	assert(blk_cache.blkbuf[idx - 1].b_data == page);
+	return &blk_cache.blkbuf[idx - 1];
+}
+
 /**
  * @brief Release a locked buffer. And do LRU algorithm.
  * @param bb
@@ -131,13 +560,7 @@ ret:
 void blk_release(struct blkbuf_t *bb)
 {
 	mutex_release(&bb->b_mtx);
-	acquire(&blk_cache.lock);
-	if (--bb->b_count == 0) {   // no one is referring it
-		// LRU strategy
-		list_add_front(&bb->free_node, &blk_cache.free_list);
-		proc_unblock_all(&blk_cache.wait_list);
-	}
-	release(&blk_cache.lock);
+	blk_put(bb);
 }
 
 // return a locked buffered block with the contents of the indicated block
@@ -147,12 +570,9 @@ struct blkbuf_t *blk_read(dev_t dev, uint32_t blockno)
 	if (bb == NULL)
 		goto ret;
 
-	if (bb->b_dirty and (bb->b_dev != dev and bb->b_blkno != blockno)) {
-		// write-back strategy
-		assert(bb->b_data != NULL);
-		device_write(dev, 0, bb, PGSIZE);
-		bb->b_dirty = 0;
-	}
+	// someone else's asynchronous request may still be filling it
+	if (bb->b_disk)
+		virtio_disk_wait(bb);
 	if (bb->b_valid == 0)
 		device_read(dev, 0, bb, PGSIZE);
 	/**
@@ -169,31 +589,315 @@ ret:
 	return NULL;
 }
 
-// Write-back strategy, so just mark it dirty.
+/**
+ * @brief Start reading a batch of locked buffers and give the locks up right
+ * away. Each buffer keeps the reference taken by blk_readahead() until the
+ * disk interrupt drops it through blk_put(), so it cannot be evicted while the
+ * device is still filling it, and a reader that finds it in the meantime waits
+ * in blk_read() for b_disk to clear.
+ * @param bbs
+ * @param n
+ */
+static void blk_read_async(struct blkbuf_t *bbs[], int32_t n)
+{
+	for (int32_t i = 0; i < n; i++)
+		bbs[i]->b_end_io = blk_put;
+	virtio_disk_submit(bbs, n, 0);
+	for (int32_t i = 0; i < n; i++)
+		mutex_release(&bbs[i]->b_mtx);
+}
+
+/**
+ * @brief Prefetch blocks of device `dev` into the cache without waiting for
+ * them. Blocks already cached (or already on their way) are skipped. It is
+ * only a hint, so it gives up instead of sleeping for a free buffer or
+ * evicting a dirty one.
+ * @param dev
+ * @param blknos
+ * @param n
+ */
+void blk_readahead(dev_t dev, uint32_t blknos[], int32_t n)
+{
+	struct blkbuf_t *bb, *batch[VIRTIO_MAX_INFLIGHT];
+	int32_t m = 0, fresh;
+
+	if (atomic_load(&syncing) > 0)
+		return;
+
+	for (int32_t i = 0; i < n; i++) {
+		if ((bb = blk_get(dev, blknos[i], 1, &fresh)) == NULL)
+			break;
+		if (!fresh) {
+			blk_put(bb);
+			continue;
+		}
+		mutex_acquire(&bb->b_mtx);
+		// a reader that found it first has already read it in
+		if (bb->b_valid or bb->b_disk) {
+			blk_release(bb);
+			continue;
+		}
+		batch[m++] = bb;
+		if (m == VIRTIO_MAX_INFLIGHT) {
+			blk_read_async(batch, m);
+			m = 0;
+		}
+	}
+	if (m > 0)
+		blk_read_async(batch, m);
+}
+
+/**
+ * @brief Write-back strategy, so just mark it dirty. The writeback thread is
+ * woken up once the dirty buffers exceed DIRTY_BG_RATIO percent of the cache.
+ * @param bb
+ */
 void blk_write_over(struct blkbuf_t *bb)
 {
 	assert(mutex_holding(&bb->b_mtx));
-	bb->b_dirty = 1;
+	blk_mark_dirty(bb);
 	blk_release(bb);
 }
 
+/**
+ * @brief Mark a referenced buffer dirty. Callers normally hold its lock; the
+ * one exception is tearing down a shared user mapping, where nobody may sleep
+ * and where the stores have all landed before.
+ * @param bb
+ */
+void blk_mark_dirty(struct blkbuf_t *bb)
+{
+	acquire(&blk_cache.lock);
+	if (!bb->b_dirty) {
+		bb->b_dirty = 1;
+		bb->b_dirty_time = atomic_load(&ticks);
+		if (++blk_cache.nr_dirty > DIRTY_BG_THRESH)
+			wb_kick();
+	}
+	release(&blk_cache.lock);
+}
+
+/**
+ * @brief Queue a dirty buffer on dirty_list while it is still referenced, for
+ * a block mapped into user space: that reference lasts until the page is
+ * unmapped, so the last blk_put() would leave the writeback out until then.
+ * @param bb
+ */
+void blk_queue_dirty(struct blkbuf_t *bb)
+{
+	struct blk_bucket_t *bucket = &hash(bb->b_dev, bb->b_blkno);
+
+	acquire(&bucket->lock);
+	if (bb->b_dirty)
+		blk_relink(bb);
+	release(&bucket->lock);
+}
+
+/**
+ * @brief Throttle a writer while the dirty buffers exceed DIRTY_RATIO percent
+ * of the cache, so that a heavy writer waits for the writeback thread instead
+ * of filling the whole cache with dirty blocks. Must not be called with any
+ * buffer or inode locked.
+ */
+void blk_balance_dirty()
+{
+	acquire(&blk_cache.lock);
+	while (blk_cache.nr_dirty > DIRTY_THRESH) {
+		wb_kick();
+		proc_block(&blk_cache.dirty_wait_list, &blk_cache.lock);
+	}
+	release(&blk_cache.lock);
+}
+
+/**
+ * @brief Write back a batch of locked dirty buffers with a single doorbell and
+ * then wait for all of them, so the device works on the whole batch at once
+ * instead of one block per interrupt round trip. A cleaned buffer nobody is
+ * referring to moves from dirty_list to an LRU list, and throttled writers are
+ * let go once the dirty ratio drops back to DIRTY_RATIO.
+ * @param bbs
+ * @param n
+ */
+void blk_write_batch(struct blkbuf_t *bbs[], int32_t n)
+{
+	virtio_disk_submit(bbs, n, 1);
+	for (int32_t i = 0; i < n; i++) {
+		struct blk_bucket_t *bucket =
+			&hash(bbs[i]->b_dev, bbs[i]->b_blkno);
+
+		virtio_disk_wait(bbs[i]);
+		acquire(&bucket->lock);
+		acquire(&blk_cache.lock);
+		bbs[i]->b_dirty = 0;
+		blk_cache.nr_dirty--;
+		if (blk_cache.nr_dirty <= DIRTY_THRESH)
+			proc_unblock_all(&blk_cache.dirty_wait_list);
+		release(&blk_cache.lock);
+		if (bbs[i]->b_count == 0)
+			blk_relink(bbs[i]);
+		release(&bucket->lock);
+		mutex_release(&bbs[i]->b_mtx);
+	}
+}
+
+/**
+ * @brief Take the next batch of buffers worth writing back off dirty_list:
+ * those dirty for longer than DIRTY_EXPIRE, or the oldest ones while the dirty
+ * buffers still exceed DIRTY_BG_RATIO percent of the cache. The batch is
+ * returned in block order with a reference held on each buffer.
+ * @param bbs
+ * @return int32_t number of buffers taken
+ */
+static int32_t wb_collect(struct blkbuf_t *bbs[])
+{
+	uint64_t now = atomic_load(&ticks);
+	struct blkbuf_t *bb;
+	int32_t n = 0, i;
+
+	acquire(&blk_cache.lock);
+	while (n < VIRTIO_MAX_INFLIGHT and !list_empty(&blk_cache.dirty_list)) {
+		bb = element_entry(list_next(&blk_cache.dirty_list),
+				   struct blkbuf_t, free_node);
+		if (blk_cache.nr_dirty <= DIRTY_BG_THRESH and
+		    now - bb->b_dirty_time < DIRTY_EXPIRE / jiffy)
+			break;
+		list_del(&bb->free_node);
+		bb->b_list = BL_LIMBO;
+		bbs[n++] = bb;
+	}
+	release(&blk_cache.lock);
+
+	for (int32_t k = 0; k < n; k++) {
+		bb = bbs[k];
+		struct blk_bucket_t *bucket = &hash(bb->b_dev, bb->b_blkno);
+		acquire(&bucket->lock);
+		bb->b_list = BL_NONE;
+		bb->b_count++;
+		release(&bucket->lock);
+
+		// insertion sort by (dev, blkno) for a sequential sweep
+		for (i = k; i > 0 and (bbs[i - 1]->b_dev > bb->b_dev or
+				       (bbs[i - 1]->b_dev == bb->b_dev and
+					bbs[i - 1]->b_blkno > bb->b_blkno));
+		     i--)
+			bbs[i] = bbs[i - 1];
+		bbs[i] = bb;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Body of the writeback kernel thread. It wakes up every
+ * WRITEBACK_INTERVAL by the timer, and earlier when the cache runs short of
+ * clean buffers, and flushes until nothing is left to do.
+ */
+static void blk_writeback()
+{
+	struct blkbuf_t *batch[VIRTIO_MAX_INFLIGHT];
+	int32_t n, m;
+
+	while (1) {
+		acquire(&blk_cache.lock);
+		while (!blk_cache.wb_kicked)
+			proc_block(&blk_cache.wb_wait_list, &blk_cache.lock);
+		blk_cache.wb_kicked = 0;
+		release(&blk_cache.lock);
+
+		while ((n = wb_collect(batch)) > 0) {
+			m = 0;
+			/**
+			 * @brief Never sleep on a buffer lock while holding
+			 * others: whoever holds it may be waiting for one of
+			 * ours. A busy buffer is referenced, so it comes back
+			 * to dirty_list later anyway.
+			 */
+			for (int32_t i = 0; i < n; i++) {
+				if (!mutex_tryacquire(&batch[i]->b_mtx))
+					blk_put(batch[i]);
+				// blk_sync_all() may have got there first
+				else if (batch[i]->b_dirty)
+					batch[m++] = batch[i];
+				else
+					blk_release(batch[i]);
+			}
+			if (m == 0)   // all busy, retry on the next kick
+				break;
+			blk_write_batch(batch, m);
+			for (int32_t i = 0; i < m; i++)
+				blk_put(batch[i]);
+		}
+	}
+}
+
+void blk_writeback_init()
+{
+	assert((blk_cache.wb_proc = kthread_create(blk_writeback,
+						   "bwriteback")) != NULL);
+}
+
+// Periodic writeback, called from the timer interrupt.
+void blk_writeback_tick()
+{
+	if (atomic_load(&ticks) % (WRITEBACK_INTERVAL / jiffy) != 0)
+		return;
+	acquire(&blk_cache.lock);
+	if (!list_empty(&blk_cache.dirty_list))
+		wb_kick();
+	release(&blk_cache.lock);
+}
+
 void blk_sync_all(int32_t still_block)
 {
+	struct blkbuf_t *batch[VIRTIO_MAX_INFLIGHT];
+	int32_t n = 0;
+
 	atomic_fetch_add(&syncing, 1);
 	while (atomic_load(&rw_operating) > 0)
 		;
 
 	for (struct blkbuf_t *bb = blk_cache.blkbuf;
 	     bb < &blk_cache.blkbuf[NBBUF]; bb++) {
-		mutex_acquire(&bb->b_mtx);
-		if (bb->b_dirty) {
-			assert(bb->b_data != NULL);
-			device_write(bb->b_dev, 0, bb, PGSIZE);
-			bb->b_dirty = 0;
+		// never sleep on a buffer lock while holding others
+		if (!mutex_tryacquire(&bb->b_mtx)) {
+			if (n > 0)
+				blk_write_batch(batch, n);
+			n = 0;
+			mutex_acquire(&bb->b_mtx);
+		}
+		if (!bb->b_dirty) {
+			mutex_release(&bb->b_mtx);
+			continue;
+		}
+		assert(bb->b_data != NULL);
+		batch[n++] = bb;
+		if (n == VIRTIO_MAX_INFLIGHT) {
+			blk_write_batch(batch, n);
+			n = 0;
 		}
-		mutex_release(&bb->b_mtx);
 	}
+	if (n > 0)
+		blk_write_batch(batch, n);
 
 	if (!still_block)
 		atomic_fetch_sub(&syncing, 1);
+}
+
+// Print the hit rate of demand lookups and how full each queue is.
+void blk_stat()
+{
+	uint64_t hits = 0, misses = 0;
+	uint32_t nr[BQ_NR] = {0};
+
+	for (int32_t i = 0; i < MAXNUM_HARTID; i++) {
+		hits += atomic_load(&blk_cache.lru[i].hits);
+		misses += atomic_load(&blk_cache.lru[i].misses);
+		for (int32_t q = 0; q < BQ_NR; q++)
+			nr[q] += blk_cache.lru[i].nr[q];
+	}
+	kprintf("%sblk cache(%s): %l hits, %l misses, hit rate %l%%, free "
+		"a1in %d, am %d, dirty %d\n",
+		UNIKS_MSG, blk_cache.policy->name, hits, misses,
+		hits + misses ? hits * 100 / (hits + misses) : 0, nr[BQ_A1IN],
+		nr[BQ_AM], blk_cache.nr_dirty);
 }
\ No newline at end of file
@@ -16,26 +16,95 @@ struct blkbuf_t {
 	int8_t b_disk;	    // does this block wait for a disk request done?
 	int8_t b_dirty;	    // is this block had been modified?
 	int8_t b_hashed;    // is this in correct hash location?
+	int8_t b_ref;	    // hit since it was last considered for eviction
+	int16_t b_list;	    // which list free_node is on, see BL_*
+	int8_t b_queue;	    // replacement queue it belongs to, see BQ_*
 	uint32_t b_count;   // record that if a process occupy it
+	uint64_t b_dirty_time;	 // ticks when it turned dirty
 
 	struct mutex_t b_mtx;
 
 	struct list_node_t hash_node;	// hash bucket list
-	struct list_node_t free_node;	// LRU cache list
+	struct list_node_t free_node;	// LRU cache list or dirty list
 	// waiting for disk rw(corresponding to b_disk)
 	struct list_node_t disk_wait_list;
+	// one-shot completion callback run by the disk interrupt, or NULL
+	void (*b_end_io)(struct blkbuf_t *bb);
 
 	char *b_data;	// dynamically allocate
 };
 
-struct blk_cache_t {
+// values of b_list other than a hart id, whose LRU list the buffer is on
+#define BL_NONE	 (-1)	// referenced, on no list
+#define BL_DIRTY (-2)	// on dirty_list
+#define BL_LIMBO (-3)	// taken off a list by an evictor or the writeback
+
+struct blk_bucket_t {
+	struct spinlock_t lock;	  // chain, b_count of the buffers on the chain
+	struct list_node_t chain;
+};
+
+// replacement queues, a plain LRU only uses BQ_AM
+#define BQ_A1IN (0)   // 2Q: blocks seen once, FIFO
+#define BQ_AM	(1)   // 2Q: blocks seen again after leaving A1in, LRU
+#define BQ_NR	(2)
+
+struct blk_lru_t {
 	struct spinlock_t lock;
+	// clean unreferenced buffers of each queue, MRU first
+	struct list_node_t list[BQ_NR];
+	uint32_t nr[BQ_NR];
+	// demand lookups of processes running on this hart
+	volatile atomic_uint_least64_t hits, misses;
+};
+
+/**
+ * @brief A replacement policy decides which queue a newly read block joins,
+ * which queue evictions come from, and whether a hit buffer deserves another
+ * round instead of being evicted. The hooks run under the lock of the bucket
+ * of the buffer, `victim_queue` under the lock of `lru`.
+ */
+struct blk_policy_t {
+	char *name;
+	void (*on_miss)(struct blkbuf_t *bb, dev_t dev, uint32_t blkno);
+	int32_t (*victim_queue)(struct blk_lru_t *lru);
+	int32_t (*second_chance)(struct blkbuf_t *bb);
+	void (*on_evict)(struct blkbuf_t *bb);
+};
+
+/**
+ * @brief Lock order: a hash bucket's lock, then a hart's LRU lock, then
+ * blk_cache.lock. A cache hit only takes its bucket's lock: it bumps b_count
+ * and sets b_ref, and leaves the buffer on whatever LRU list it is on, so that
+ * evictors skip it later. Eviction works on the LRU list of the hart it runs
+ * on first and steals from the others when that one is empty.
+ */
+struct blk_cache_t {
+	struct spinlock_t lock;	  // the lists and counters below
+	struct blk_policy_t *policy;
 	struct blkbuf_t blkbuf[NBBUF];
-	struct list_node_t free_list;	// free_list
-	struct list_node_t wait_list;	// wait for free_list
-	struct list_node_t hash_bucket_table[HASH_TABLE_PRIME];
+	struct blk_bucket_t hash_bucket_table[HASH_TABLE_PRIME];
+	struct blk_lru_t lru[MAXNUM_HARTID];
+	// bumped whenever a clean buffer becomes free
+	volatile atomic_uint_least32_t lru_gen;
+	volatile atomic_uint_least32_t nr_waiting;   // on wait_list
+	struct list_node_t wait_list;	// wait for a clean free buffer
+
+	// unreferenced dirty buffers, in the order they were released
+	struct list_node_t dirty_list;
+	uint32_t nr_dirty;			// number of dirty buffers
+	struct list_node_t dirty_wait_list;	// writers throttled by nr_dirty
+	int32_t wb_kicked;		// writeback has been asked for
+	struct list_node_t wb_wait_list;	// writeback thread idles here
+	struct proc_t *wb_proc;
+	// user pages mapping a block, each one holding a reference
+	volatile atomic_uint_least32_t nr_mapped;
 };
 
+#define DIRTY_BG_THRESH (NBBUF * DIRTY_BG_RATIO / 100)
+#define DIRTY_THRESH	(NBBUF * DIRTY_RATIO / 100)
+#define MAPPED_THRESH	(NBBUF * MAPPED_RATIO / 100)
+
 
 extern volatile atomic_uint_least32_t syncing, rw_operating;
 extern struct blk_cache_t blk_cache;
@@ -45,9 +114,22 @@ extern char zero_blk[];
 void blk_init();
 struct blkbuf_t *getblk(dev_t dev, uint32_t blkno);
 void blk_release(struct blkbuf_t *bb);
+void blk_put(struct blkbuf_t *bb);
+void blk_hold(struct blkbuf_t *bb);
+int32_t blk_map_pin(int32_t force);
+void blk_map_unpin();
+struct blkbuf_t *blk_of_page(void *page);
 struct blkbuf_t *blk_read(dev_t dev, uint32_t blockno);
+void blk_readahead(dev_t dev, uint32_t blknos[], int32_t n);
 void blk_write_over(struct blkbuf_t *bb);
+void blk_mark_dirty(struct blkbuf_t *bb);
+void blk_queue_dirty(struct blkbuf_t *bb);
+void blk_write_batch(struct blkbuf_t *bbs[], int32_t n);
+void blk_balance_dirty();
 void blk_sync_all(int32_t still_block);
+void blk_writeback_init();
+void blk_writeback_tick();
+void blk_stat();
 
 
 #endif /* !__KERNEL_DEVICE_BLKBUF_H__ */
\ No newline at end of file
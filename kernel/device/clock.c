@@ -10,6 +10,7 @@
  */
 
 #include "clock.h"
+#include "blkbuf.h"
 #include <uniks/defs.h>
 #include <platform/sbi.h>
 #include <process/proc.h>
@@ -48,6 +49,7 @@ __always_inline void clock_interrupt_handler()
 {
 	if (cpuid() == boothartid) {
 		atomic_fetch_add(&ticks, 1);
+		blk_writeback_tick();
 	}
 	time_wakeup();
 
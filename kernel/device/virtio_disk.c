@@ -216,29 +216,16 @@ static int32_t alloc3_desc(int32_t *index)
 	return 0;
 }
 
-static void virtio_disk_rw(struct blkbuf_t *bb, int32_t write)
+// format the three descriptors of a request. And qemu's virtio-blk.c reads them.
+static void fill_desc(struct blkbuf_t *bb, int32_t write, int32_t *index)
 {
 	uint64_t sector = bb->b_blkno * (BLKSIZE / SECTORSIZE);
 
-	acquire(&disk.virtio_disk_lock);
-
 	/**
 	 * @brief the spec's Section 5.2 says that legacy block operations use
 	 * three descriptors: one for type/reserved/sector, one for the data,
 	 * one for a 1-byte status result.
 	 */
-
-	// allocate the three descriptors.
-	int32_t index[3];
-	while (1) {
-		if (alloc3_desc(index) == 0) {
-			break;
-		}
-		proc_block(&disk.wait_list, &disk.virtio_disk_lock);
-	}
-
-	// format the three descriptors. And qemu's virtio-blk.c reads them.
-
 	struct virtio_blk_req_t *buf0 = &disk.ops[index[0]];
 
 	if (write)
@@ -282,22 +269,64 @@ static void virtio_disk_rw(struct blkbuf_t *bb, int32_t write)
 
 	// tell the device another avail ring entry is available.
 	disk.avail->index += 1;	  // not % NUM ...
+}
 
+// ring the doorbell for every request published in the avail ring so far
+static void virtio_disk_notify()
+{
 	__sync_synchronize();
 
 	*VIRTIO_DISK_R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;	// value is queue number
+}
+
+/**
+ * @brief Queue `n` requests without waiting for any of them and ring the
+ * doorbell once for the whole batch. Every buffer must stay put (referenced)
+ * until its completion, which clears `b_disk`, wakes `disk_wait_list` and calls
+ * the one-shot `b_end_io` from do_virtio_disk_interrupt(). Blocks only when the
+ * ring runs out of descriptors, after handing the device what is queued.
+ * @param bbs
+ * @param n
+ * @param write
+ */
+void virtio_disk_submit(struct blkbuf_t *bbs[], int32_t n, int32_t write)
+{
+	int32_t index[3], pending = 0;
+
+	acquire(&disk.virtio_disk_lock);
+	for (int32_t i = 0; i < n; i++) {
+		assert(bbs[i]->b_disk == 0);
+		while (alloc3_desc(index) != 0) {
+			if (pending) {
+				virtio_disk_notify();
+				pending = 0;
+			}
+			proc_block(&disk.wait_list, &disk.virtio_disk_lock);
+		}
+		fill_desc(bbs[i], write, index);
+		pending++;
+	}
+	if (pending)
+		virtio_disk_notify();
+	release(&disk.virtio_disk_lock);
+}
 
-	// Wait for do_virtio_disk_interrupt() to say request has finished.
+// Wait for do_virtio_disk_interrupt() to say request of `bb` has finished.
+void virtio_disk_wait(struct blkbuf_t *bb)
+{
+	acquire(&disk.virtio_disk_lock);
 	while (bb->b_disk == 1) {
 		proc_block(&bb->disk_wait_list, &disk.virtio_disk_lock);
 	}
-
-	disk.info[index[0]].buf = NULL;
-	free_descriptor_list(index[0]);
-
 	release(&disk.virtio_disk_lock);
 }
 
+static void virtio_disk_rw(struct blkbuf_t *bb, int32_t write)
+{
+	virtio_disk_submit(&bb, 1, write);
+	virtio_disk_wait(bb);
+}
+
 void do_virtio_disk_interrupt(void *ptr)
 {
 	acquire(&disk.virtio_disk_lock);
@@ -326,9 +355,17 @@ void do_virtio_disk_interrupt(void *ptr)
 		assert(disk.info[id].status == 0);
 
 		struct blkbuf_t *bb = disk.info[id].buf;
+		void (*end_io)(struct blkbuf_t *) = bb->b_end_io;
+		disk.info[id].buf = NULL;
+		free_descriptor_list(id);
+
+		bb->b_end_io = NULL;
 		bb->b_disk = 0;	  // disk is done with buf
 		bb->b_valid = 1;
 		proc_unblock_all(&bb->disk_wait_list);
+		// the submitter may give up `bb` in here, so touch it no more
+		if (end_io != NULL)
+			end_io(bb);
 		disk.used_index += 1;
 	}
 
@@ -73,7 +73,9 @@
 #define VIRTIO_DISK_R(r) ((volatile uint32_t *)(VIRTIO0 + (r)))
 
 // the number of virtio descriptors must be a power of 2
-#define VIRTIO_DESC_NUM (64)
+#define VIRTIO_DESC_NUM	    (64)
+// each request takes three descriptors, so this many can be in flight at once
+#define VIRTIO_MAX_INFLIGHT (VIRTIO_DESC_NUM / 3)
 
 // a single descriptor, from the spec.
 struct virtq_desc_t {
@@ -132,6 +134,8 @@ void virtio_disk_init();
 int64_t virtio_disk_read(void *virtio_ptr, int32_t user_dst, struct blkbuf_t *bb, size_t cnt);
 int64_t virtio_disk_write(void *virtio_ptr, int32_t user_src, struct blkbuf_t *bb, size_t cnt);
 void do_virtio_disk_interrupt(void *ptr);
+void virtio_disk_submit(struct blkbuf_t *bbs[], int32_t n, int32_t write);
+void virtio_disk_wait(struct blkbuf_t *bb);
 
 
 #endif /* !__KERNEL_DEVICE_VIRTIO_DISK_H__ */
\ No newline at end of file
@@ -2,11 +2,13 @@
 #include "kfcntl.h"
 #include "pipe.h"
 #include <device/blk_dev.h>
+#include <device/blkbuf.h>
 #include <device/device.h>
 #include <fs/ext2fs.h>
 #include <process/proc.h>
 #include <sync/spinlock.h>
 #include <uniks/errno.h>
+#include <uniks/kstdlib.h>
 
 
 // hint: DO NOT support file hole now
@@ -93,6 +95,88 @@ void file_close(int32_t fcb_no)
 	fcbno_free(fcb_no);
 }
 
+/**
+ * @brief Work out which blocks are worth having in the cache for a read of
+ * `cnt` bytes at `f->f_pos`, and store them in [*start, *end). The window
+ * starts at RA_MIN_BLKS once reads look sequential and doubles on every
+ * sequential read up to RA_MAX_BLKS; a new window is only asked for when less
+ * than half of the last one is left ahead of the reader. A random read just
+ * batches its own blocks. `limit` is the number of blocks in the file.
+ * @param ra
+ * @param pos
+ * @param cnt
+ * @param limit
+ * @param start
+ * @param end
+ * @return int32_t 1 if there is something to prefetch, otherwise 0
+ */
+static int32_t ra_window(struct file_ra_t *ra, uint64_t pos, size_t cnt,
+			 uint64_t limit, uint64_t *start, uint64_t *end)
+{
+	uint64_t first = pos / BLKSIZE, last = (pos + cnt - 1) / BLKSIZE;
+
+	// a reader consuming a block in several pieces asks for it again
+	if (first == ra->ra_next or first + 1 == ra->ra_next) {
+		ra->ra_win = ra->ra_win ? MIN(ra->ra_win * 2, RA_MAX_BLKS)
+					: RA_MIN_BLKS;
+	} else
+		ra->ra_win = ra->ra_end = 0;
+	ra->ra_next = last + 1;
+
+	if (ra->ra_win == 0)
+		*start = first, *end = last + 1;
+	else if (ra->ra_end > last + 1 + ra->ra_win / 2)
+		return 0;
+	else
+		*start = MAX(first, ra->ra_end),
+		*end = last + 1 + ra->ra_win;
+	*end = MIN(*end, *start + RA_MAX_BLKS);
+	*end = MIN(*end, limit);
+	if (*start >= *end)
+		return 0;
+	ra->ra_end = *end;
+	return 1;
+}
+
+/**
+ * @brief Kick off asynchronous reads for the blocks readi() or blkdev_read()
+ * is about to touch and the ones a sequential reader will want next, so that
+ * the device works on them while the caller copies out the current ones.
+ * Caller must hold `f->f_inode->i_mtx`.
+ * @param f
+ * @param cnt
+ */
+static void file_readahead(struct file_t *f, size_t cnt)
+{
+	struct m_inode_t *inode = f->f_inode;
+	uint32_t blknos[RA_MAX_BLKS];
+	uint64_t start, end, limit;
+	int32_t n = 0;
+	dev_t dev;
+
+	if (cnt == 0)
+		return;
+	if (S_ISBLK(inode->d_inode_ctnt.i_mode)) {
+		dev = inode->d_inode_ctnt.i_block[0];
+		limit = (uint64_t)DISKSIZE * MiB / BLKSIZE;
+	} else {
+		dev = inode->i_dev;
+		limit = div_round_up(inode->d_inode_ctnt.i_size, BLKSIZE);
+	}
+	if (!ra_window(&f->f_ra, f->f_pos, cnt, limit, &start, &end))
+		return;
+
+	for (uint64_t b = start; b < end; b++) {
+		if (S_ISBLK(inode->d_inode_ctnt.i_mode))
+			blknos[n++] = b;
+		else if ((blknos[n] = bmap(inode, b)) != 0)
+			n++;
+		else
+			break;
+	}
+	blk_readahead(dev, blknos, n);
+}
+
 // Read from file f. Addr is a user virtual address.
 int64_t file_read(struct file_t *f, void *addr, size_t cnt)
 {
@@ -120,6 +204,7 @@ int64_t file_read(struct file_t *f, void *addr, size_t cnt)
 	}
 	// else if block DEVICE
 	else if (S_ISBLK(inode->d_inode_ctnt.i_mode)) {
+		file_readahead(f, cnt);
 		if ((res = blkdev_read(inode->d_inode_ctnt.i_block[0], addr,
 				       f->f_pos, cnt)) > 0)
 			f->f_pos += res;
@@ -127,6 +212,7 @@ int64_t file_read(struct file_t *f, void *addr, size_t cnt)
 	// else if ordinary file or directory
 	else if (S_ISREG(inode->d_inode_ctnt.i_mode) or
 		 S_ISDIR(inode->d_inode_ctnt.i_mode)) {
+		file_readahead(f, cnt);
 		if ((res = readi(inode, 1, addr, f->f_pos, cnt)) > 0)
 			f->f_pos += res;
 	}
@@ -157,6 +243,8 @@ int64_t file_write(struct file_t *f, void *addr, size_t cnt)
 		goto ret;
 	}
 
+	if (!S_ISCHR(inode->d_inode_ctnt.i_mode))
+		blk_balance_dirty();
 	ilock(inode);
 	// else if character DEVICE
 	if (S_ISCHR(inode->d_inode_ctnt.i_mode)) {
@@ -11,11 +11,19 @@
 #include <uniks/queue.h>
 
 
+// sequential readahead state of an open file, counted in blocks
+struct file_ra_t {
+	uint64_t ra_next;   // block a sequential reader is expected to ask next
+	uint64_t ra_end;    // blocks before it have already been prefetched
+	uint32_t ra_win;    // current window size, 0 while access looks random
+};
+
 struct file_t {
 	uint32_t f_count;
 	uint32_t f_flags;   // access mode(R/W bit)
 
 	uint64_t f_pos;	  // offset for an FD_INODE file
+	struct file_ra_t f_ra;
 	struct m_inode_t *f_inode;
 };
 
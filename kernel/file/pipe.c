@@ -3,6 +3,9 @@
 #include <mm/mmu.h>
 #include <mm/phys.h>
 #include <process/proc.h>
+#include <uniks/errno.h>
+#include <uniks/kstdlib.h>
+#include <uniks/kstring.h>
 
 
 struct m_inode_t *pipealloc()
@@ -12,20 +15,7 @@ struct m_inode_t *pipealloc()
 	if (pipe_pg == NULL)
 		return NULL;
 
-	acquire(&inode_table.lock);
-	while (1) {
-		for (ip = inode_table.m_inodes;
-		     ip < &inode_table.m_inodes[NINODE]; ip++) {
-			if (ip->i_count == 0) {
-				ip->i_count++;
-				ip->i_dev = 0;
-				release(&inode_table.lock);
-				goto found;
-			}
-		}
-		proc_block(&inode_table.wait_list, &inode_table.lock);
-	}
-found:
+	ip = new_inode();
 	ip->d_inode_ctnt.i_mode = EXT2_S_IFIFO;
 
 	struct pipe_t *pi = &ip->pipe_node;
@@ -34,6 +24,8 @@ found:
 	initlock(&pi->lk, "pipelk");
 	INIT_LIST_HEAD(&pi->read_wait);
 	INIT_LIST_HEAD(&pi->write_wait);
+	pi->gifts = NULL;
+	pi->gift_head = pi->nr_gift = pi->gift_off = 0;
 
 	queue_init(&pi->pipe, PGSIZE, pipe_pg);
 
@@ -53,62 +45,184 @@ void pipeclose(struct pipe_t *pi, int32_t W)
 
 	if (pi->readopen == 0 and pi->writeopen == 0) {
 		pages_free(pi->pipe.queue_array_chartype);
+		for (; pi->nr_gift; pi->nr_gift--) {
+			pages_free(pi->gifts[pi->gift_head]);
+			pi->gift_head = (pi->gift_head + 1) % PIPE_NGIFT;
+		}
+		if (pi->gifts)
+			kfree(pi->gifts);
 	}
 	release(&pi->lk);
 }
 
+/**
+ * @brief Whether the write at user address va with n bytes left may hand its
+ * next page over to the pipe instead of copying it. Off unless PIPE_GIFT is
+ * set: the page turns copy-on-write for the writer, so a writer that refills
+ * the same buffer in a loop pays a fault and a page copy per write.
+ */
+static int32_t pipe_giftable(struct pipe_t *pi, uintptr_t va, size_t n)
+{
+	if (!PIPE_GIFT or n < PGSIZE or OFFSETPAGE(va) != 0 or
+	    !queue_empty(&pi->pipe))
+		return 0;
+	if (pi->gifts == NULL)
+		pi->gifts = kmalloc(PIPE_NGIFT * sizeof(void *));
+	return pi->gifts != NULL;
+}
+
+/**
+ * @brief Consume the front gifted page for user address addr. If the reader
+ * wants the whole page at a page-aligned address, the page is mapped there
+ * instead of being copied; otherwise up to `n` bytes of it go into `stage`.
+ * @param mapped set if the page was mapped
+ * @return int64_t: number of bytes consumed
+ */
+static int64_t pipe_take_gift(struct pipe_t *pi, struct mm_struct *mm,
+			      void *addr, size_t n, char *stage,
+			      int32_t *mapped)
+{
+	char *page = pi->gifts[pi->gift_head];
+	int64_t len = PGSIZE - pi->gift_off;
+
+	*mapped = 0;
+	if (pi->gift_off == 0 and n >= PGSIZE and
+	    OFFSETPAGE((uintptr_t)addr) == 0 and
+	    uvm_accept_page(mm, (uintptr_t)addr, page) == 0) {
+		*mapped = 1;
+		goto next;   // the reference on page moved to the reader
+	}
+
+	len = MIN(len, n);
+	memcpy(stage, page + pi->gift_off, len);
+	if ((pi->gift_off += len) < PGSIZE)
+		return len;
+	pages_free(page);
+next:
+	pi->gift_off = 0;
+	pi->gift_head = (pi->gift_head + 1) % PIPE_NGIFT;
+	pi->nr_gift--;
+	return len;
+}
+
+/**
+ * @brief User copies may fault and sleep, so they never run under pi->lk: the
+ * bytes go through a kernel `stage` of PIPE_STAGE bytes, copied from or to the
+ * user with the lock dropped.
+ */
 int64_t pipewrite(struct pipe_t *pi, void *addr, size_t n)
 {
 	int64_t i = 0;
+	int32_t run, staged = 0, off = 0;
+	char *dst, *stage;
+	void *page;
 	struct proc_t *p = myproc();
 
+	if ((stage = kmalloc(PIPE_STAGE)) == NULL)
+		return -ENOMEM;
 	acquire(&pi->lk);
 	while (i < n) {
 		if (pi->readopen == 0 or killed(p)) {
-			release(&pi->lk);
-			return 0;
+			i = 0;
+			break;
 		}
-		if (queue_full(&pi->pipe)) {
-			// pipewrite-full
-			proc_unblock_all(&pi->read_wait);
-			proc_block(&pi->write_wait, &pi->lk);
-		} else {
-			char ch;
-			assert(copyin(p->mm->pagetable, &ch, addr + i, 1) !=
-			       -1);
-			queue_push_chartype(&pi->pipe, ch);
-			i++;
+		if (staged == 0 and
+		    pipe_giftable(pi, (uintptr_t)addr + i, n - i)) {
+			if (pi->nr_gift == PIPE_NGIFT)
+				goto full;
+			page = uvm_gift_page(p->mm,
+					     (uintptr_t)addr + i);
+			if (page != NULL) {
+				pi->gifts[(pi->gift_head + pi->nr_gift) %
+					  PIPE_NGIFT] = page;
+				pi->nr_gift++;
+				i += PGSIZE;
+				continue;
+			}
+		}
+		if (staged == 0) {
+			staged = MIN((size_t)PIPE_STAGE, n - i);
+			off = 0;
+			release(&pi->lk);
+			assert(copyin(p->mm->pagetable, stage, addr + i,
+				      staged) != -1);
+			acquire(&pi->lk);
+			continue;   // the pipe may have changed meanwhile
 		}
+		// copy up to the ring's wrap point in one go
+		dst = queue_back_run_chartype(&pi->pipe, &run);
+		if (run == 0)
+			goto full;
+		run = MIN(run, staged - off);
+		memcpy(dst, stage + off, run);
+		queue_push_n(&pi->pipe, run);
+		i += run;
+		if ((off += run) == staged)
+			staged = 0;
+		continue;
+full:
+		// pipewrite-full
+		proc_unblock_all(&pi->read_wait);
+		proc_block(&pi->write_wait, &pi->lk);
 	}
 	proc_unblock_all(&pi->read_wait);
 	release(&pi->lk);
+	kfree(stage);
 
 	return i;
 }
 
 int64_t piperead(struct pipe_t *pi, void *addr, size_t n)
 {
-	int64_t i;
+	int64_t i = 0, m;
+	int32_t run, mapped;
+	char *src, *stage;
 	struct proc_t *p = myproc();
 
+	if ((stage = kmalloc(PIPE_STAGE)) == NULL)
+		return -ENOMEM;
 	acquire(&pi->lk);
-	while (queue_empty(&pi->pipe) and pi->writeopen) {
+	while (queue_empty(&pi->pipe) and pi->nr_gift == 0 and pi->writeopen) {
 		// pipe-empty
 		if (killed(p)) {
 			release(&pi->lk);
+			kfree(stage);
 			return 0;
 		}
 		proc_block(&pi->read_wait, &pi->lk);   // piperead-block
 	}
-	for (i = 0; i < n; i++) {
-		if (queue_empty(&pi->pipe))
+	while (i < n) {
+		m = 0;
+		// gifted pages were queued before anything in the ring
+		if (pi->nr_gift) {
+			m = pipe_take_gift(pi, p->mm, addr + i,
+					   MIN((size_t)PIPE_STAGE, n - i),
+					   stage, &mapped);
+			if (mapped) {
+				i += m;
+				continue;
+			}
+		}
+		while (!pi->nr_gift and m < MIN((size_t)PIPE_STAGE, n - i)) {
+			src = queue_front_run_chartype(&pi->pipe, &run);
+			if (run == 0)
+				break;
+			run = MIN(run, MIN((size_t)PIPE_STAGE, n - i) - m);
+			memcpy(stage + m, src, run);
+			queue_front_pop_n(&pi->pipe, run);
+			m += run;
+		}
+		if (m == 0)
 			break;
-		char ch = *(char *)queue_front_chartype(&pi->pipe);
-		queue_front_pop(&pi->pipe);
-		assert(copyout(p->mm->pagetable, addr + i, &ch, 1) != -1);
+		proc_unblock_all(&pi->write_wait);
+		release(&pi->lk);
+		assert(copyout(p->mm->pagetable, addr + i, stage, m) != -1);
+		acquire(&pi->lk);
+		i += m;
 	}
 	proc_unblock_all(&pi->write_wait);   // piperead-unblock
 	release(&pi->lk);
+	kfree(stage);
 
 	return i;
 }
@@ -17,6 +17,16 @@ struct pipe_t {
 
 	uint8_t readopen;    // read fd is still open
 	uint8_t writeopen;   // write fd is still open
+
+	/**
+	 * @brief Whole pages gifted by the writer, queued ahead of the bytes
+	 * in `pipe`: a page is only gifted while `pipe` is empty. gift_off is
+	 * how much of the front page the reader has consumed.
+	 */
+	void **gifts;
+	uint8_t gift_head, nr_gift;
+	uint16_t gift_off;
+
 	struct list_node_t read_wait;
 	struct list_node_t write_wait;
 };
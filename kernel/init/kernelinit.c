@@ -14,8 +14,11 @@
 #include <device/device.h>
 #include <device/virtio_disk.h>
 #include <file/file.h>
+#include <fs/dcache.h>
 #include <fs/ext2fs.h>
+#include <mm/filemap.h>
 #include <mm/memlay.h>
+#include <mm/phys.h>
 #include <platform/plic.h>
 #include <platform/sbi.h>
 #include <process/proc.h>
@@ -24,6 +27,7 @@
 #include <uniks/defs.h>
 #include <uniks/kstdio.h>
 #include <uniks/kstring.h>
+#include <uniks/log.h>
 
 
 volatile static int32_t started = 0, master_booting = 1;
@@ -48,6 +52,49 @@ __always_inline void hart_booted_message()
 {
 	kprintf("%shart %d start\n", UNIKS_MSG, cpuid());
 }
+
+#if defined(USE_LOG_INFO)
+	#define BENCH_ROUNDS (256)
+	#define bench(t, op) \
+		({ \
+			uint64_t __begin = read_csr(time); \
+			for (int32_t __i = 0; __i < BENCH_ROUNDS; __i++) \
+				op; \
+			(t) = (read_csr(time) - __begin) / BENCH_ROUNDS; \
+		})
+/**
+ * @brief Page copy and page zero microbenchmark of the bytewise, the word and
+ * (if the harts have V) the RVV kernels, in timer cycles per page.
+ */
+static void kstring_bench()
+{
+	char *src = pages_alloc(1), *dst = pages_alloc(1);
+	uint64_t cpy[3] = {0}, set[3] = {0};
+
+	assert(src != NULL and dst != NULL);
+	bench(cpy[0], ({
+		      for (int32_t j = 0; j < PGSIZE; j++)
+			      dst[j] = src[j];
+	      }));
+	bench(set[0], ({
+		      for (int32_t j = 0; j < PGSIZE; j++)
+			      dst[j] = 0;
+	      }));
+	bench(cpy[1], memcpy_word(dst, src, PGSIZE));
+	bench(set[1], memset_word(dst, 0, PGSIZE));
+	if (kstring_rvv) {
+		bench(cpy[2], memcpy_rvv(dst, src, PGSIZE));
+		bench(set[2], memset_rvv(dst, 0, PGSIZE));
+	}
+	infof("page copy: byte %l, word %l, rvv %l cycles", cpy[0], cpy[1],
+	      cpy[2]);
+	infof("page zero: byte %l, word %l, rvv %l cycles", set[0], set[1],
+	      set[2]);
+
+	pages_free(src);
+	pages_free(dst);
+}
+#endif
 void kernel_start(int32_t hartid)
 {
 	if (master_booting) {
@@ -68,9 +115,13 @@ void kernel_start(int32_t hartid)
 
 	if (cpuid() == boothartid) {
 		kprintfinit();
+		kstring_init(vector_enable());
 		device_init();
 		phymem_init();
 		kvminit();
+#if defined(USE_LOG_INFO)
+		kstring_bench();
+#endif
 
 		proc_init();
 		trap_init();
@@ -78,10 +129,13 @@ void kernel_start(int32_t hartid)
 
 		blk_init();
 		inode_table_init();
+		filemap_init();
+		dcache_init();
 		sys_ftable_init();
 		virtio_disk_init();
 
 		user_init(1);
+		blk_writeback_init();
 		display_banner();
 		hart_booted_message();
 		started = 1;
@@ -90,6 +144,9 @@ void kernel_start(int32_t hartid)
 		while (!started)
 			;
 		__sync_synchronize();
+		// all harts must have V for the kernels to use it
+		if (!vector_enable())
+			kstring_init(0);
 		hart_booted_message();
 	}
 	kvmenablehart();
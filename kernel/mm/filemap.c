@@ -0,0 +1,212 @@
+#include "filemap.h"
+#include "mmu.h"
+#include "phys.h"
+#include <fs/ext2fs.h>
+#include <sync/spinlock.h>
+#include <uniks/defs.h>
+#include <uniks/kassert.h>
+#include <uniks/kstdio.h>
+#include <uniks/kstdlib.h>
+#include <uniks/kstring.h>
+#include <uniks/list.h>
+#include <uniks/param.h>
+
+
+/**
+ * @brief The page cache of read-only file mappings. A cached page holds one
+ * page of a file and one reference of its own in physical_page_record, every
+ * pte mapping it holds another, so the page outlives the cache entry for as
+ * long as somebody maps it.
+ */
+struct filemap_page_t {
+	struct m_inode_t *ip;
+	uint32_t index;	  // page number within the file
+	void *page;
+	struct list_node_t hash_node;	// in filemap.hash_table
+	struct list_node_t inode_node;	// in ip->i_pages
+};
+
+// `lock` guards the hash table and the i_pages list of every inode
+struct filemap_t {
+	struct spinlock_t lock;
+	struct list_node_t hash_table[HASH_TABLE_PRIME];
+	struct kmem_cache_t *cachep;
+	uint64_t hits, misses;
+} filemap;
+
+#define _fhashfn(ip, index) \
+	(((uint32_t)((uintptr_t)(ip) >> 4) ^ (index)) % HASH_TABLE_PRIME)
+#define fhash(ip, index) (filemap.hash_table[_fhashfn((ip), (index))])
+
+
+void filemap_init()
+{
+	initlock(&filemap.lock, "filemap");
+	for (int32_t i = 0; i < HASH_TABLE_PRIME; i++)
+		INIT_LIST_HEAD(&filemap.hash_table[i]);
+	filemap.cachep = kmem_cache_create("filemap_page",
+					   sizeof(struct filemap_page_t),
+					   _Alignof(struct filemap_page_t), NULL);
+	filemap.hits = filemap.misses = 0;
+}
+
+// Caller must hold `filemap.lock`.
+static struct filemap_page_t *find_page_inhash(struct m_inode_t *ip,
+					       uint32_t index)
+{
+	struct list_node_t *chain = &fhash(ip, index);
+	for (struct list_node_t *l = list_next(chain); l != chain;
+	     l = list_next(l)) {
+		struct filemap_page_t *fp =
+			element_entry(l, struct filemap_page_t, hash_node);
+		if (fp->ip == ip and fp->index == index)
+			return fp;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Return page `index` of the file, read into the cache first if it is
+ * not there, with a reference for the caller. Caller must hold `ip->i_mtx`,
+ * which keeps two misses on the same inode from both filling a page.
+ * @param ip
+ * @param index
+ * @return void*: NULL if out of memory or the page could not be read whole
+ */
+void *filemap_get_page(struct m_inode_t *ip, uint32_t index)
+{
+	struct filemap_page_t *fp;
+	uint64_t off = (uint64_t)index << PGSHIFT, want = 0;
+	void *page;
+	int64_t n;
+
+	assert(mutex_holding(&ip->i_mtx));
+	acquire(&filemap.lock);
+	if ((fp = find_page_inhash(ip, index)) != NULL) {
+		filemap.hits++;
+		page = pages_dup(fp->page);
+		release(&filemap.lock);
+		return page;
+	}
+	filemap.misses++;
+	release(&filemap.lock);
+
+	if ((page = pages_try_alloc(1)) == NULL)
+		return NULL;
+	if (off < ip->d_inode_ctnt.i_size)
+		want = MIN((uint64_t)PGSIZE, ip->d_inode_ctnt.i_size - off);
+	/**
+	 * @brief readi() gives less on an I/O error. Such a page must not be
+	 * cached, every later mapper would see zeros.
+	 */
+	if ((n = readi_wait(ip, page, off, PGSIZE)) != want) {
+		pages_free(page);
+		return NULL;
+	}
+	memset(page + n, 0, PGSIZE - n);
+
+	// without an entry the page is just the caller's private copy
+	if ((fp = kmem_cache_alloc(filemap.cachep)) == NULL)
+		return page;
+	fp->ip = ip;
+	fp->index = index;
+	fp->page = pages_dup(page);
+	acquire(&filemap.lock);
+	list_add_front(&fp->hash_node, &fhash(ip, index));
+	list_add_front(&fp->inode_node, &ip->i_pages);
+	release(&filemap.lock);
+
+	return page;
+}
+
+/**
+ * @brief Forget the cached pages of `ip`, when its content changes or its
+ * in-memory inode is about to hold another file. Pages still mapped stay
+ * with their mappings until those go away.
+ * @param ip
+ */
+void filemap_drop(struct m_inode_t *ip)
+{
+	struct filemap_page_t *fp;
+
+	if (list_empty(&ip->i_pages))
+		return;
+	acquire(&filemap.lock);
+	while (!list_empty(&ip->i_pages)) {
+		fp = element_entry(list_next_then_del(&ip->i_pages),
+				   struct filemap_page_t, inode_node);
+		list_del(&fp->hash_node);
+		pages_free(fp->page);
+		kmem_cache_free(filemap.cachep, fp);
+	}
+	release(&filemap.lock);
+}
+
+/**
+ * @brief Forget page `index` of `ip` alone, when a store through a shared
+ * mapping is about to change it behind the cache's back.
+ * @param ip
+ * @param index
+ */
+void filemap_drop_page(struct m_inode_t *ip, uint32_t index)
+{
+	struct filemap_page_t *fp;
+
+	if (list_empty(&ip->i_pages))
+		return;
+	acquire(&filemap.lock);
+	if ((fp = find_page_inhash(ip, index)) != NULL) {
+		list_del(&fp->hash_node);
+		list_del(&fp->inode_node);
+	}
+	release(&filemap.lock);
+	if (fp != NULL) {
+		pages_free(fp->page);
+		kmem_cache_free(filemap.cachep, fp);
+	}
+}
+
+/**
+ * @brief Give back the cached pages that nobody maps, for an allocation that
+ * found no free page. A page still mapped would free nothing, so it stays.
+ * Caller must hold no kmem cache lock.
+ * @return int32_t: how many pages were freed
+ */
+int32_t filemap_shrink()
+{
+	struct filemap_page_t *fp;
+	struct list_node_t *l, *next;
+	int32_t n = 0;
+	LIST_HEAD(victims);
+
+	acquire(&filemap.lock);
+	for (int32_t i = 0; i < HASH_TABLE_PRIME; i++) {
+		for (l = list_next(&filemap.hash_table[i]);
+		     l != &filemap.hash_table[i]; l = next) {
+			next = list_next(l);
+			fp = element_entry(l, struct filemap_page_t, hash_node);
+			// only taken up by filemap_get_page(), under our lock
+			if (page_count(fp->page) != 1)
+				continue;
+			list_del(&fp->hash_node);
+			list_del(&fp->inode_node);
+			list_add_front(&fp->hash_node, &victims);
+		}
+	}
+	release(&filemap.lock);
+
+	while (!list_empty(&victims)) {
+		fp = element_entry(list_next_then_del(&victims),
+				   struct filemap_page_t, hash_node);
+		pages_free(fp->page);
+		kmem_cache_free(filemap.cachep, fp);
+		n++;
+	}
+	return n;
+}
+
+void filemap_stat()
+{
+	kprintf("%sfile page cache: %l hits, %l misses\n", UNIKS_MSG,
+		filemap.hits, filemap.misses);
+}
@@ -0,0 +1,18 @@
+#ifndef __KERNEL_MM_FILEMAP_H__
+#define __KERNEL_MM_FILEMAP_H__
+
+
+#include <uniks/defs.h>
+
+
+struct m_inode_t;
+
+void filemap_init();
+void *filemap_get_page(struct m_inode_t *ip, uint32_t index);
+void filemap_drop(struct m_inode_t *ip);
+void filemap_drop_page(struct m_inode_t *ip, uint32_t index);
+int32_t filemap_shrink();
+void filemap_stat();
+
+
+#endif /* !__KERNEL_MM_FILEMAP_H__ */
@@ -0,0 +1,23 @@
+#ifndef __KERNEL_MM_KMMAN_H__
+#define __KERNEL_MM_KMMAN_H__
+
+
+#include <uniks/defs.h>
+
+// values are the same as Linux's
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_HUGETLB   0x40000
+
+#define MS_ASYNC      1
+#define MS_INVALIDATE 2
+#define MS_SYNC	      4
+
+
+#endif /* !__KERNEL_MM_KMMAN_H__ */
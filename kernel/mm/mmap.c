@@ -0,0 +1,320 @@
+#include "kmman.h"
+#include "memlay.h"
+#include "mmu.h"
+#include "tlb.h"
+#include "vm.h"
+#include <device/blkbuf.h>
+#include <device/virtio_disk.h>
+#include <file/file.h>
+#include <file/kfcntl.h>
+#include <fs/ext2fs.h>
+#include <process/proc.h>
+#include <sys/ksyscall.h>
+#include <uniks/defs.h>
+#include <uniks/errno.h>
+#include <uniks/kassert.h>
+#include <uniks/kstdlib.h>
+#include <uniks/list.h>
+#include <uniks/param.h>
+
+
+// make `vma` start at `vaddr`, moving its file window along
+static void vma_advance(struct vm_area_struct *vma, uintptr_t vaddr)
+{
+	uint64_t delta = vaddr - vma->vm_start;
+	vma->vm_pgoff += delta;
+	vma->_filesz = MAX(vma->_filesz, delta) - delta;
+	vma->vm_start = vaddr;
+}
+
+// make `vma` end at `vaddr`
+static void vma_truncate(struct vm_area_struct *vma, uintptr_t vaddr)
+{
+	vma->_filesz = MIN(vma->_filesz, vaddr - vma->vm_start);
+	vma->vm_end = vaddr;
+}
+
+/**
+ * @brief Take [start, end) out of the address space of mm and unmap its pages.
+ * A VMA sticking out of the range is trimmed, or split in two when the range
+ * lies inside it.
+ * @param mm
+ * @param start
+ * @param end
+ * @return int32_t: 0, or -ENOMEM if there is no memory for the VMA a split
+ * would need, in which case nothing is unmapped
+ */
+static int32_t do_munmap(struct mm_struct *mm, uintptr_t start, uintptr_t end)
+{
+	struct vm_area_struct *vma, *tail;
+	struct list_node_t *node, *next, dead;
+
+	// the tail of a split VMA, allocated up front since mmap_lk is a spinlock
+	if ((tail = new_vmarea_struct(0, 0, 0, 0, NULL, 0)) == NULL)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&dead);
+	acquire(&mm->mmap_lk);
+	// the list goes on from the first VMA the range reaches into
+	vma = find_vma(mm, start);
+	for (node = vma ? &vma->vm_area_list : &mm->vm_area_list_head;
+	     node != &mm->vm_area_list_head; node = next) {
+		next = list_next(node);
+		vma = element_entry(node, struct vm_area_struct, vm_area_list);
+		if (vma->vm_start >= end)
+			break;
+
+		if (vma->vm_start < start and vma->vm_end > end) {
+			tail->vm_start = vma->vm_start;
+			tail->vm_end = vma->vm_end;
+			tail->vm_flags = vma->vm_flags;
+			tail->vm_pgoff = vma->vm_pgoff;
+			tail->vm_inode = idup(vma->vm_inode);
+			tail->_filesz = vma->_filesz;
+			tail->vm_mm = mm;
+			vma_advance(tail, end);
+			vma_truncate(vma, start);
+			vma_link(mm, tail);
+			tail = NULL;
+			break;
+		} else if (vma->vm_start < start)
+			vma_truncate(vma, start);
+		else if (vma->vm_end > end)
+			vma_advance(vma, end);
+		else {
+			vma_unlink(mm, vma);
+			list_add_tail(node, &dead);
+		}
+	}
+	release(&mm->mmap_lk);
+
+	uvm_unmap(mm, start, end);
+
+	// iput() may sleep, so it waits until mmap_lk is dropped
+	while (!list_empty(&dead)) {
+		vma = element_entry(list_next_then_del(&dead),
+				    struct vm_area_struct, vm_area_list);
+		free_vmarea_struct(vma);
+	}
+	if (tail != NULL)   // no VMA was split
+		free_vmarea_struct(tail);
+	return 0;
+}
+
+/**
+ * @brief Find `len` bytes of address space nobody maps, as high as possible
+ * below mm->mmap_base.
+ * @param mm
+ * @param len a multiple of align
+ * @param align a power of 2 the area starts at a multiple of
+ * @return uintptr_t: start of the area, 0 if there is no room
+ */
+static uintptr_t get_unmapped_area(struct mm_struct *mm, size_t len,
+				   size_t align)
+{
+	uintptr_t end = get_var_bit(mm->mmap_base, ~(align - 1));
+	struct vm_area_struct *vma;
+
+	acquire(&mm->mmap_lk);
+	for (struct list_node_t *node = list_prev(&mm->vm_area_list_head);
+	     node != &mm->vm_area_list_head; node = list_prev(node)) {
+		vma = element_entry(node, struct vm_area_struct, vm_area_list);
+		if (vma->vm_start >= end)
+			continue;
+		if (vma->vm_end <= end and end - vma->vm_end >= len)
+			break;
+		end = get_var_bit(vma->vm_start, ~(align - 1));
+	}
+	release(&mm->mmap_lk);
+
+	return end >= len + PGSIZE ? end - len : 0;
+}
+
+/**
+ * @brief Whether unmapping [start, end) would cut a MAP_HUGETLB area anywhere
+ * but at a megapage boundary, which its megapages cannot follow.
+ */
+static int32_t splits_megapage(struct mm_struct *mm, uintptr_t start,
+			       uintptr_t end)
+{
+	struct vm_area_struct *vma;
+	int32_t ret = 0;
+
+	acquire(&mm->mmap_lk);
+	vma = find_vma(mm, start);
+	for (struct list_node_t *node =
+		     vma ? &vma->vm_area_list : &mm->vm_area_list_head;
+	     node != &mm->vm_area_list_head; node = list_next(node)) {
+		vma = element_entry(node, struct vm_area_struct, vm_area_list);
+		if (vma->vm_start >= end)
+			break;
+		if (!get_var_bit(vma->vm_flags, VM_HUGE))
+			continue;
+		if ((start > vma->vm_start and OFFSETMEGAPAGE(start) != 0) or
+		    (end < vma->vm_end and OFFSETMEGAPAGE(end) != 0)) {
+			ret = 1;
+			break;
+		}
+	}
+	release(&mm->mmap_lk);
+
+	return ret;
+}
+
+// `void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);`
+int64_t sys_mmap()
+{
+	struct proc_t *p = myproc();
+	struct mm_struct *mm = p->mm;
+	uintptr_t addr = argufetch(p, 0);
+	size_t len = PGROUNDUP(argufetch(p, 1));
+	int32_t prot = argufetch(p, 2), flags = argufetch(p, 3),
+		fd = argufetch(p, 4);
+	uint64_t off = argufetch(p, 5), filesz = 0, isize;
+	uint32_t vm_flags = PTE_U;
+	size_t align = PGSIZE;
+	struct m_inode_t *ip = NULL;
+
+	if (len == 0 or OFFSETPAGE(off) != 0)
+		return -EINVAL;
+	// megapages only for private anonymous memory, all of it aligned
+	if (get_var_bit(flags, MAP_HUGETLB)) {
+		if (!get_var_bit(flags, MAP_ANONYMOUS) or
+		    get_var_bit(flags, MAP_SHARED))
+			return -EINVAL;
+		len = MEGAPGROUNDUP(len);
+		align = MEGAPGSIZE;
+		set_var_bit(vm_flags, VM_HUGE);
+	}
+	if (get_var_bit(flags, MAP_SHARED | MAP_PRIVATE) == 0 or
+	    get_var_bit(flags, MAP_SHARED | MAP_PRIVATE) ==
+		    (MAP_SHARED | MAP_PRIVATE))
+		return -EINVAL;
+	if (get_var_bit(prot, PROT_READ))
+		set_var_bit(vm_flags, PTE_R);
+	if (get_var_bit(prot, PROT_WRITE))   // there is no write-only page
+		set_var_bit(vm_flags, PTE_R | PTE_W);
+	if (get_var_bit(prot, PROT_EXEC))
+		set_var_bit(vm_flags, PTE_X);
+	if (get_var_bit(flags, MAP_SHARED))
+		set_var_bit(vm_flags, VM_SHARED);
+
+	if (!get_var_bit(flags, MAP_ANONYMOUS)) {
+		if (fd < 0 or fd >= NFD or p->fdtable[fd] == -1)
+			return -EBADF;
+		struct file_t *f = &fcbtable.files[p->fdtable[fd]];
+		ip = f->f_inode;
+		if (!S_ISREG(ip->d_inode_ctnt.i_mode))
+			return -ENODEV;
+		if (!READABLE(f->f_flags) or
+		    (get_var_bit(flags, MAP_SHARED) and
+		     get_var_bit(prot, PROT_WRITE) and !WRITEABLE(f->f_flags)))
+			return -EACCES;
+		// a shared page is the very page of a cached block
+		if (get_var_bit(flags, MAP_SHARED) and BLKSIZE != PGSIZE)
+			return -ENODEV;
+		ilock(ip);
+		isize = ip->d_inode_ctnt.i_size;
+		iunlock(ip);
+		filesz = MIN(len, MAX(isize, off) - off);
+	}
+
+	if (get_var_bit(flags, MAP_FIXED)) {
+		if (addr == 0 or get_var_bit(addr, align - 1) != 0 or
+		    addr + len < addr or addr + len > USER_STACK_TOP or
+		    splits_megapage(mm, addr, addr + len))
+			return -EINVAL;
+		if (do_munmap(mm, addr, addr + len) < 0)
+			return -ENOMEM;
+	} else if ((addr = get_unmapped_area(mm, len, align)) == 0)
+		return -ENOMEM;
+
+	add_vm_area(mm, addr, addr + len, vm_flags, off, ip, filesz);
+	return addr;
+}
+
+// `int munmap(void *addr, size_t length);`
+int64_t sys_munmap()
+{
+	struct proc_t *p = myproc();
+	uintptr_t addr = argufetch(p, 0);
+	size_t len = PGROUNDUP(argufetch(p, 1));
+
+	if (len == 0 or OFFSETPAGE(addr) != 0 or addr + len < addr or
+	    addr + len > USER_STACK_TOP or
+	    splits_megapage(p->mm, addr, addr + len))
+		return -EINVAL;
+	return do_munmap(p->mm, addr, addr + len);
+}
+
+/**
+ * @brief Write back the file blocks that shared mappings in [start, end) may
+ * have stored to. Each page is write-protected first, so that a later store
+ * faults and dirties its block again. A writable page counts as dirty even if
+ * its block looks clean: sync() may have written the block back while stores
+ * kept landing through the mapping.
+ * @param mm
+ * @param start
+ * @param end
+ */
+static void msync_range(struct mm_struct *mm, uintptr_t start, uintptr_t end)
+{
+	struct blkbuf_t *bb, *batch[VIRTIO_MAX_INFLIGHT];
+	int32_t n = 0;
+	struct tlb_batch_t tlb;
+
+	tlb_batch_init(&tlb, mm);
+	for (uintptr_t va = start; va < end; va += PGSIZE) {
+		struct pgtable_entry_t *pte = walk(mm->pagetable, va, 0);
+		if (pte == NULL or !pte->valid or !pte->shared or !pte->write)
+			continue;
+		if ((bb = blk_of_page((void *)PNO2PA(pte->paddr))) == NULL)
+			continue;
+		pte->write = 0;
+		tlb_batch_add(&tlb, va, PGSIZE);
+
+		// never sleep on a buffer lock while holding others
+		if (!mutex_tryacquire(&bb->b_mtx)) {
+			tlb_batch_flush(&tlb);
+			if (n > 0)
+				blk_write_batch(batch, n);
+			n = 0;
+			mutex_acquire(&bb->b_mtx);
+		}
+		blk_mark_dirty(bb);
+		batch[n++] = bb;
+		if (n == VIRTIO_MAX_INFLIGHT) {
+			// no hart may store to a block while it is written
+			tlb_batch_flush(&tlb);
+			blk_write_batch(batch, n);
+			n = 0;
+		}
+	}
+	tlb_batch_flush(&tlb);
+	if (n > 0)
+		blk_write_batch(batch, n);
+}
+
+/**
+ * @brief `int msync(void *addr, size_t length, int flags);` MS_ASYNC has
+ * nothing to do: a shared page is a block-cache page already, and its block is
+ * queued for the writeback thread once it is stored to.
+ */
+int64_t sys_msync()
+{
+	struct proc_t *p = myproc();
+	uintptr_t addr = argufetch(p, 0);
+	size_t len = PGROUNDUP(argufetch(p, 1));
+	int32_t flags = argufetch(p, 2);
+	uint32_t vm_flags;
+
+	if (OFFSETPAGE(addr) != 0 or
+	    (get_var_bit(flags, MS_SYNC) and get_var_bit(flags, MS_ASYNC)))
+		return -EINVAL;
+	if (len == 0)
+		return 0;
+	if (search_vmareas(p->mm, addr, len, &vm_flags) == NULL)
+		return -ENOMEM;
+	if (get_var_bit(flags, MS_SYNC))
+		msync_range(p->mm, addr, addr + len);
+	return 0;
+}
@@ -9,5 +9,15 @@
 #define PGROUNDUP(addr)	  get_var_bit((addr + PGSIZE - 1), ~(PGSIZE - 1))
 #define PGROUNDDOWN(addr) get_var_bit((addr), ~(PGSIZE - 1))
 
+// Sv39 megapage, mapped by a leaf in a level-1 page table
+#define MEGAPGSHIFT (21)
+#define MEGAPGSIZE  ((1) << MEGAPGSHIFT)
+#define MEGAPGORDER (MEGAPGSHIFT - PGSHIFT)   // buddy order of a megapage
+
+#define OFFSETMEGAPAGE(addr)  get_var_bit(addr, MEGAPGSIZE - 1)
+#define MEGAPGROUNDUP(addr) \
+	get_var_bit((addr + MEGAPGSIZE - 1), ~(MEGAPGSIZE - 1))
+#define MEGAPGROUNDDOWN(addr) get_var_bit((addr), ~(MEGAPGSIZE - 1))
+
 
 #endif /* !__KERNEL_MM_MMU_H__ */
\ No newline at end of file
@@ -1,11 +1,16 @@
 #include "phys.h"
+#include "filemap.h"
 #include "memlay.h"
 #include "mmu.h"
+#include <platform/riscv.h>
+#include <sync/spinlock.h>
 #include <uniks/defs.h>
 #include <uniks/kassert.h>
 #include <uniks/kstdlib.h>
 #include <uniks/kstring.h>
+#include <uniks/kstdio.h>
 #include <uniks/list.h>
+#include <uniks/param.h>
 
 
 void phymem_init()
@@ -38,6 +43,38 @@ enum order {
 	ORD_9,
 	ORD_10,
 };
+/**
+ * @brief Order recorded for a single page that is allocated through, or cached
+ * by, the per-hart page caches. It never matches when the buddy system looks
+ * for a free buddy, so such a page is only merged back once it is drained.
+ */
+#define ORD_PCP (-1)
+
+/**
+ * @brief Free single pages of one hart, in front of the buddy system. Only the
+ * hart itself allocates from or frees into its cache; `lock` is left alone by
+ * other harts except when the buddy system runs dry and they drain every
+ * cache. Lock order is a cache lock, then buddy_lock, and never two caches.
+ */
+struct page_cache_t {
+	struct spinlock_t lock;
+	struct list_node_t list;   // hottest first
+	int32_t count;
+	uint64_t hits, refills, drains;
+} page_caches[MAXNUM_HARTID];
+
+/**
+ * @brief Pages zeroed ahead of time by idle harts, so that pages_zalloc(1)
+ * does not have to clear a page on the caller's critical path. The pages stay
+ * allocated to the pool; the list node in their first bytes is wiped when one
+ * is handed out.
+ */
+struct zero_pool_t {
+	struct spinlock_t lock;
+	struct list_node_t list;
+	volatile int32_t count;	  // peeked at without the lock
+	uint64_t hits, misses;
+} zero_pool;
 
 // mount all available blocks of order power to the orderarray
 static void mount_orderlist(uintptr_t current, int32_t order)
@@ -45,6 +82,7 @@ static void mount_orderlist(uintptr_t current, int32_t order)
 	while (current + (1 << order) * PGSIZE <= mem_end) {
 		list_add_front((struct list_node_t *)current,
 			       &orderarray[order]);
+		physical_page_record[ADDR2ARRAYINDEX(current)].order = order;
 		current += (1 << order) * PGSIZE;
 	}
 	if (order != ORD_0 and current != mem_end)
@@ -87,6 +125,7 @@ static void do_record(void *ptr, int16_t order)
 	assert(physical_page_record[index].count == 0);
 	physical_page_record[index].count++;
 	physical_page_record[index].order = order;
+	physical_page_record[index].private = 0;
 	initlock(&physical_page_record[index].lk, "perpg_lock");
 }
 
@@ -96,23 +135,27 @@ void buddy_system_init(uintptr_t start, uintptr_t end)
 	initlock(&buddy_lock, "buddylock");
 	for (int32_t i = 0; i < 11; i++)
 		INIT_LIST_HEAD(&orderarray[i]);
-	mount_orderlist(mem_start, ORD_10);
 	memset(physical_page_record, 0, sizeof(physical_page_record));
+	mount_orderlist(mem_start, ORD_10);
+	for (int32_t i = 0; i < MAXNUM_HARTID; i++) {
+		initlock(&page_caches[i].lock, "pagecache");
+		INIT_LIST_HEAD(&page_caches[i].list);
+		page_caches[i].count = 0;
+		page_caches[i].hits = page_caches[i].refills =
+			page_caches[i].drains = 0;
+	}
+	initlock(&zero_pool.lock, "zeropool");
+	INIT_LIST_HEAD(&zero_pool.list);
+	zero_pool.count = 0;
+	zero_pool.hits = zero_pool.misses = 0;
 }
 
-void *pages_alloc(size_t npages)
+// take a free block of `order` off the buddy lists, caller holds buddy_lock
+static void *buddy_take(int16_t order)
 {
-	assert(npages > 0 and npages <= (1 << ORD_10));
-	void *ptr = NULL;
-	int16_t order = get_power2(npages);
-
-	acquire(&buddy_lock);
 	// find in order correspond list
-	if (!list_empty(&orderarray[order])) {
-		ptr = (void *)list_next_then_del(&orderarray[order]);
-		do_record(ptr, order);
-		goto out;
-	}
+	if (!list_empty(&orderarray[order]))
+		return list_next_then_del(&orderarray[order]);
 	/**
 	 * @brief order correspond list hasn't any free pages, so find a lager
 	 * and split it
@@ -123,25 +166,192 @@ void *pages_alloc(size_t npages)
 			break;
 	if (i == 11) {
 		// no more free pages, then will return NULL
-		goto out;
+		return NULL;
 	}
 	assert(i > order and i < 11);
-	ptr = (void *)split_pages(list_next_then_del(&orderarray[i]), i, order);
-	do_record(ptr, order);
+	return split_pages(list_next_then_del(&orderarray[i]), i, order);
+}
+
+static void buddy_give(void *ptr, int16_t order);
+
+// allocate a single page from this hart's cache, refilling it when empty
+static void *pcp_alloc()
+{
+	void *ptr = NULL;
+
+	push_off();
+	struct page_cache_t *pc = &page_caches[cpuid()];
+	acquire(&pc->lock);
+	if (pc->count > 0)
+		pc->hits++;
+	else {
+		pc->refills++;
+		acquire(&buddy_lock);
+		while (pc->count < PCP_BATCH and
+		       (ptr = buddy_take(ORD_0)) != NULL) {
+			physical_page_record[ADDR2ARRAYINDEX(ptr)].order =
+				ORD_PCP;
+			list_add_tail(ptr, &pc->list);
+			pc->count++;
+		}
+		release(&buddy_lock);
+		ptr = NULL;
+	}
+	if (pc->count > 0) {
+		ptr = list_next_then_del(&pc->list);
+		pc->count--;
+	}
+	release(&pc->lock);
+	pop_off();
+
+	return ptr;
+}
+
+// free a single page into this hart's cache, draining the coldest when full
+static void pcp_free(void *ptr)
+{
+	push_off();
+	struct page_cache_t *pc = &page_caches[cpuid()];
+	acquire(&pc->lock);
+	list_add_front(ptr, &pc->list);
+	if (++pc->count > PCP_HIGH) {
+		pc->drains++;
+		acquire(&buddy_lock);
+		for (int32_t i = 0; i < PCP_BATCH; i++) {
+			buddy_give(list_prev_then_del(&pc->list), ORD_0);
+			pc->count--;
+		}
+		release(&buddy_lock);
+	}
+	release(&pc->lock);
+	pop_off();
+}
+
+// give every hart's cached pages back to the buddy system, return how many
+static int32_t pcp_drain_all()
+{
+	int32_t drained = 0;
+
+	for (int32_t i = 0; i < MAXNUM_HARTID; i++) {
+		struct page_cache_t *pc = &page_caches[i];
+		acquire(&pc->lock);
+		if (pc->count > 0) {
+			pc->drains++;
+			acquire(&buddy_lock);
+			while (pc->count > 0) {
+				buddy_give(list_next_then_del(&pc->list),
+					   ORD_0);
+				pc->count--;
+				drained++;
+			}
+			release(&buddy_lock);
+		}
+		release(&pc->lock);
+	}
+
+	return drained;
+}
+
+// take a page off the zero pool, NULL when it is dry
+static void *zero_pool_take()
+{
+	void *ptr = NULL;
+
+	acquire(&zero_pool.lock);
+	if (zero_pool.count > 0) {
+		ptr = list_next_then_del(&zero_pool.list);
+		zero_pool.count--;
+		zero_pool.hits++;
+	} else
+		zero_pool.misses++;
+	release(&zero_pool.lock);
+	if (ptr != NULL)
+		memset(ptr, 0, sizeof(struct list_node_t));
+
+	return ptr;
+}
+
+/**
+ * @brief Zero one more page into the zero pool unless it is full. Called by a
+ * hart that finds nothing to run, one page at a time so that the hart gets
+ * back to its run queue quickly.
+ */
+void zero_pool_refill()
+{
+	if (zero_pool.count >= ZERO_POOL_HIGH)
+		return;
+	void *ptr = pcp_alloc();
+	if (ptr == NULL)
+		return;
+	do_record(ptr, ORD_PCP);
+	memset(ptr, 0, PGSIZE);
+
+	acquire(&zero_pool.lock);
+	if (zero_pool.count < ZERO_POOL_HIGH) {
+		list_add_front(ptr, &zero_pool.list);
+		zero_pool.count++;
+		ptr = NULL;
+	}
+	release(&zero_pool.lock);
+	if (ptr != NULL)
+		pages_free(ptr);
+}
+
+/**
+ * @brief Like pages_alloc(), but NULL rather than a panic when no block is
+ * free, for callers that can do with smaller pages instead.
+ * @param npages
+ * @return void*
+ */
+void *pages_try_alloc(size_t npages)
+{
+	assert(npages > 0 and npages <= (1 << ORD_10));
+	void *ptr = NULL;
+	int16_t order = get_power2(npages);
+	int32_t retried = 0;
+
+retry:
+	if (order == ORD_0) {
+		if ((ptr = pcp_alloc()) != NULL)
+			do_record(ptr, ORD_PCP);
+		else   // zeroed pages are free memory as well
+			ptr = zero_pool_take();
+		goto out;
+	}
+
+	acquire(&buddy_lock);
+	if ((ptr = buddy_take(order)) != NULL)
+		do_record(ptr, order);
+	release(&buddy_lock);
 out:
+	// the buddy system ran dry, but other harts may still cache free pages
+	if (ptr == NULL and !retried++ and pcp_drain_all() > 0)
+		goto retry;
 	// assert that prt is aligned to a page
 	assert(OFFSETPAGE((uintptr_t)ptr) == 0);
-	release(&buddy_lock);
 	// tracef("buddy system: allocate %d page(s) start @%p,", npages, ptr);
+	return ptr;
+}
+
+void *pages_alloc(size_t npages)
+{
+	void *ptr = pages_try_alloc(npages);
+	// cached file pages that nobody maps are the last to fall back on
+	if (ptr == NULL and filemap_shrink() > 0)
+		ptr = pages_try_alloc(npages);
 	assert(ptr != NULL);
 	return ptr;
 }
 
 void *pages_zalloc(size_t npages)
 {
-	void *ptr = pages_alloc(npages);
+	void *ptr;
+
+	if (npages == 1 and (ptr = zero_pool_take()) != NULL)
+		return ptr;
+	ptr = pages_alloc(npages);
 	if (ptr != NULL)
-		memset(ptr, 0, PGSIZE);
+		memset(ptr, 0, npages * PGSIZE);
 	return ptr;
 }
 
@@ -195,6 +405,28 @@ static void *whois_buddy(void *ptr, int16_t order)
 		BUG();
 }
 
+// put a free block on the buddy lists, merged with its buddies if possible
+static void buddy_give(void *ptr, int16_t order)
+{
+	while (order < ORD_10) {
+		void *buddyptr = whois_buddy(ptr, order);
+		int32_t buddyindex = ADDR2ARRAYINDEX(buddyptr);
+		if (physical_page_record[buddyindex].count == 0 and
+		    physical_page_record[buddyindex].order == order) {
+			/**
+			 * @brief means that the buddy npages is in free, so we
+			 * could do merge operation
+			 */
+			list_del(buddyptr);
+			ptr = MIN(ptr, buddyptr);
+			order++;
+		} else
+			break;
+	}
+	physical_page_record[ADDR2ARRAYINDEX(ptr)].order = order;
+	list_add_front(ptr, &orderarray[order]);
+}
+
 // free npages and merge it if possible
 void pages_free(void *ptr)
 {
@@ -202,88 +434,305 @@ void pages_free(void *ptr)
 	// assert that prt is aligned to a page
 	assert(OFFSETPAGE((uintptr_t)ptr) == 0);
 
-	acquire(&buddy_lock);
-	int32_t index = ADDR2ARRAYINDEX(ptr);
-	assert(physical_page_record[index].count > 0);
-	if (--physical_page_record[index].count == 0) {
-		// do free operation and merge operation
-		int16_t order = physical_page_record[index].order;
-		/* merge_pages() { */
-		while (1) {
-			void *buddyptr = whois_buddy(ptr, order);
-			int32_t buddyindex = ADDR2ARRAYINDEX(buddyptr);
-			if (physical_page_record[buddyindex].count == 0 and
-			    physical_page_record[buddyindex].order == order) {
-				/**
-				 * @brief means that the buddy npages is in
-				 * free, so we could do merge operation
-				 */
-				list_del(buddyptr);
-				ptr = MIN(ptr, buddyptr);
-				order++;
-			} else {
-				list_add_front(ptr, &orderarray[order]);
-				break;
-			}
-		}
-		/*}*/
+	int32_t index = ADDR2ARRAYINDEX(ptr), last;
+	struct phys_page_record_t *record = &physical_page_record[index];
+
+	if (record->order == ORD_PCP) {
+		acquire(&record->lk);
+		assert(record->count > 0);
+		last = --record->count == 0;
+		release(&record->lk);
+		if (last)
+			pcp_free(ptr);
+		return;
 	}
+
+	acquire(&buddy_lock);
+	assert(record->count > 0);
+	if (--record->count == 0)
+		buddy_give(ptr, record->order);
 	release(&buddy_lock);
 }
 
+// Print how well the per-hart page caches spare the buddy system.
+void pages_stat()
+{
+	for (int32_t i = 0; i < MAXNUM_HARTID; i++)
+		kprintf("%spage cache of hart %d: %l hits, %l refills, "
+			"%l drains, %d cached\n",
+			UNIKS_MSG, i, page_caches[i].hits,
+			page_caches[i].refills, page_caches[i].drains,
+			page_caches[i].count);
+	kprintf("%szero page pool: %l hits, %l misses, %d pooled\n",
+		UNIKS_MSG, zero_pool.hits, zero_pool.misses, zero_pool.count);
+}
+
+void page_set_private(void *ptr, uint32_t private)
+{
+	physical_page_record[ADDR2ARRAYINDEX(ptr)].private = private;
+}
+
+uint32_t page_private(void *ptr)
+{
+	return physical_page_record[ADDR2ARRAYINDEX(ptr)].private;
+}
+
+// How many references `ptr` has, read without its lock.
+int32_t page_count(void *ptr)
+{
+	return physical_page_record[ADDR2ARRAYINDEX(ptr)].count;
+}
+
 
 // === kmalloc implemented by slub allocator ===
 
 int16_t slub_size[] = {
 	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536,
 };
+static char *slub_name[] = {
+	"kmalloc-16",  "kmalloc-32",   "kmalloc-48",   "kmalloc-64",
+	"kmalloc-96",  "kmalloc-128",  "kmalloc-192",  "kmalloc-256",
+	"kmalloc-384", "kmalloc-512",  "kmalloc-768",  "kmalloc-1024",
+	"kmalloc-1536",
+};
 #define SLUB_NODE_START(addr) (PGROUNDDOWN((uintptr_t)(addr)))
 #define SLUBNUM		      (sizeof(slub_size) / sizeof(typeof(slub_size[0])))
 
+// objects a hart keeps at hand, so that it does not take the cache's lock
+struct kmem_magazine_t {
+	int32_t count;
+	void *objs[KMEM_MAG_SIZE];
+};
+
 struct kmem_cache_t {
-	int32_t obj_size;
-	struct spinlock_t kmem_cache_lock;
+	char *name;
+	int32_t obj_size;     // stride of the objects in a slab page
+	int32_t obj_offset;   // of the first object in a slab page
+	int32_t link_offset;  // of the freelist link in a free object
+	void (*ctor)(void *obj);
+	struct spinlock_t kmem_cache_lock;   // the slab lists
 	struct list_node_t fulllist;
 	struct list_node_t partiallist;
-} kmem_cache_array[SLUBNUM];
+	struct list_node_t emptylist;
+	int32_t nr_empty;
+	// only touched by its own hart with interrupts off
+	struct kmem_magazine_t mag[MAXNUM_HARTID];
+};
 
 struct slub_pages_node_t {
 	struct kmem_cache_t *kmem_cache_linked;	  // used for finding back
 	struct list_node_t slub_node_list;
 	struct list_node_t obj_freelist;
+	int32_t inuse;	 // objects handed out, to magazines as well
 };
 
+static struct kmem_cache_t kmem_cache_array[KMEM_NCACHE];
+static int32_t nr_kmem_cache;
+static struct spinlock_t kmem_cache_array_lock;
+static struct kmem_cache_t *kmalloc_caches[SLUBNUM];
+
 void kmem_cache_init()
 {
-	for (int32_t i = 0; i < SLUBNUM; i++) {
-		kmem_cache_array[i].obj_size = slub_size[i];
-		initlock(&kmem_cache_array[i].kmem_cache_lock, "slublock");
-		INIT_LIST_HEAD(&kmem_cache_array[i].fulllist);
-		INIT_LIST_HEAD(&kmem_cache_array[i].partiallist);
-	}
+	initlock(&kmem_cache_array_lock, "kmem_caches");
+	for (int32_t i = 0; i < SLUBNUM; i++)
+		kmalloc_caches[i] =
+			kmem_cache_create(slub_name[i], slub_size[i], 16, NULL);
+}
+
+/**
+ * @brief Create a cache of objects of `size` bytes aligned to `align`. `ctor`,
+ * if any, runs once on each object when its slab page is carved up, so that
+ * objects come back from kmem_cache_alloc() in the state kmem_cache_free() got
+ * them in. The freelist link of a free object then lives in a list node past
+ * its end, instead of in its first bytes.
+ * @param name
+ * @param size
+ * @param align a power of 2, at least the alignment of a pointer is used
+ * @param ctor
+ * @return struct kmem_cache_t*
+ */
+struct kmem_cache_t *kmem_cache_create(char *name, size_t size, size_t align,
+				       void (*ctor)(void *obj))
+{
+	int32_t link_offset = 0;
+
+	align = MAX(align, sizeof(void *));
+	assert((align & (align - 1)) == 0);
+	if (ctor != NULL) {   // leave the constructed state alone
+		link_offset = div_round_up(size, sizeof(void *)) *
+			      sizeof(void *);
+		size = link_offset + sizeof(struct list_node_t);
+	} else	 // a free object holds a list node
+		size = MAX(size, sizeof(struct list_node_t));
+	size = div_round_up(size, align) * align;
+
+	acquire(&kmem_cache_array_lock);
+	assert(nr_kmem_cache < KMEM_NCACHE);
+	struct kmem_cache_t *cache = &kmem_cache_array[nr_kmem_cache++];
+	release(&kmem_cache_array_lock);
+
+	cache->name = name;
+	cache->obj_size = size;
+	cache->obj_offset = div_round_up(sizeof(struct slub_pages_node_t),
+					 align) * align;
+	assert(cache->obj_offset + cache->obj_size <= PGSIZE);
+	cache->link_offset = link_offset;
+	cache->ctor = ctor;
+	initlock(&cache->kmem_cache_lock, "slublock");
+	INIT_LIST_HEAD(&cache->fulllist);
+	INIT_LIST_HEAD(&cache->partiallist);
+	INIT_LIST_HEAD(&cache->emptylist);
+	cache->nr_empty = 0;
+	for (int32_t i = 0; i < MAXNUM_HARTID; i++)
+		cache->mag[i].count = 0;
+	return cache;
 }
 
-static struct slub_pages_node_t *new_slub_pages_node(int32_t idx)
+static struct slub_pages_node_t *new_slub_pages_node(struct kmem_cache_t *cache)
 {
-	struct slub_pages_node_t *slub_pages_node = pages_alloc(1);
+	// pages_alloc() could shrink the filemap, whose cache lock we may hold
+	struct slub_pages_node_t *slub_pages_node = pages_try_alloc(1);
 	if (slub_pages_node == NULL)
 		goto ret;
 	INIT_LIST_HEAD(&slub_pages_node->slub_node_list);
 	INIT_LIST_HEAD(&slub_pages_node->obj_freelist);
-	slub_pages_node->kmem_cache_linked = &kmem_cache_array[idx];
+	slub_pages_node->kmem_cache_linked = cache;
+	slub_pages_node->inuse = 0;
 	// mount free object in this new page
-	char *node = (char *)(slub_pages_node + 1);
-	while (node + kmem_cache_array[idx].obj_size - (char *)slub_pages_node <
-	       PGSIZE) {
-		list_add_front((struct list_node_t *)node,
+	char *node = (char *)slub_pages_node + cache->obj_offset;
+	while (node + cache->obj_size - (char *)slub_pages_node <= PGSIZE) {
+		if (cache->ctor != NULL)
+			cache->ctor(node);
+		list_add_front((struct list_node_t *)(node +
+						      cache->link_offset),
 			       &slub_pages_node->obj_freelist);
-		node += kmem_cache_array[idx].obj_size;
+		node += cache->obj_size;
 	}
 
 ret:
 	return slub_pages_node;
 }
 
+// Take an object off the slabs, caller holds the cache's lock.
+static void *slub_alloc(struct kmem_cache_t *cache)
+{
+	struct slub_pages_node_t *slub_pages_node;
+
+	if (list_empty(&cache->partiallist)) {
+		if (!list_empty(&cache->emptylist)) {
+			slub_pages_node = element_entry(
+				list_next_then_del(&cache->emptylist),
+				struct slub_pages_node_t, slub_node_list);
+			cache->nr_empty--;
+		} else if ((slub_pages_node = new_slub_pages_node(cache)) ==
+			   NULL)   // todo: add wait-list
+			return NULL;
+		list_add_front(&slub_pages_node->slub_node_list,
+			       &cache->partiallist);
+	}
+	slub_pages_node = element_entry(list_next(&cache->partiallist),
+					struct slub_pages_node_t,
+					slub_node_list);
+	assert(!list_empty(&slub_pages_node->obj_freelist));
+	void *ptr = (char *)list_next_then_del(&slub_pages_node->obj_freelist) -
+		    cache->link_offset;
+	slub_pages_node->inuse++;
+	if (list_empty(&slub_pages_node->obj_freelist)) {
+		// remove from partial list and add to full list
+		list_del(&slub_pages_node->slub_node_list);
+		list_add_front(&slub_pages_node->slub_node_list,
+			       &cache->fulllist);
+	}
+	return ptr;
+}
+
+// Give an object back to its slab, caller holds the cache's lock.
+static void slub_free(struct kmem_cache_t *cache, void *ptr)
+{
+	struct slub_pages_node_t *slub_pages_node =
+		(struct slub_pages_node_t *)SLUB_NODE_START(ptr);
+	assert(slub_pages_node->kmem_cache_linked == cache);
+	if (list_empty(&slub_pages_node->obj_freelist)) {
+		// remove from full list and add to partial list
+		list_del(&slub_pages_node->slub_node_list);
+		list_add_front(&slub_pages_node->slub_node_list,
+			       &cache->partiallist);
+	}
+	list_add_front((struct list_node_t *)((char *)ptr + cache->link_offset),
+		       &slub_pages_node->obj_freelist);
+	if (--slub_pages_node->inuse > 0)
+		return;
+
+	/**
+	 * @brief Keep a few empty slabs around so that a cache going up and
+	 * down around a page boundary does not bounce pages through the buddy
+	 * system, and give the rest back.
+	 */
+	list_del(&slub_pages_node->slub_node_list);
+	if (cache->nr_empty < KMEM_EMPTY_KEEP) {
+		list_add_front(&slub_pages_node->slub_node_list,
+			       &cache->emptylist);
+		cache->nr_empty++;
+	} else
+		pages_free(slub_pages_node);
+}
+
+/**
+ * @brief Allocate an object from `cache`. The hart's magazine serves it without
+ * any lock, only an empty magazine goes to the slabs, for half a magazine.
+ * @param cache
+ * @return void*: NULL if out of memory
+ */
+void *kmem_cache_alloc(struct kmem_cache_t *cache)
+{
+	void *ptr = NULL;
+
+	push_off();
+	struct kmem_magazine_t *mag = &cache->mag[cpuid()];
+	if (mag->count == 0) {
+		acquire(&cache->kmem_cache_lock);
+		while (mag->count < KMEM_MAG_SIZE / 2 and
+		       (ptr = slub_alloc(cache)) != NULL)
+			mag->objs[mag->count++] = ptr;
+		release(&cache->kmem_cache_lock);
+		ptr = NULL;
+	}
+	if (mag->count > 0)
+		ptr = mag->objs[--mag->count];
+	pop_off();
+
+	/**
+	 * @brief No slab could grow, get pages back as pages_alloc() would.
+	 * Unlike there, running out for good is left to the caller.
+	 */
+	if (ptr == NULL and filemap_shrink() > 0)
+		return kmem_cache_alloc(cache);
+	return ptr;
+}
+
+/**
+ * @brief Free an object of `cache` into the hart's magazine. A full magazine
+ * first gives half of its objects back to the slabs.
+ * @param cache
+ * @param ptr
+ */
+void kmem_cache_free(struct kmem_cache_t *cache, void *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	push_off();
+	struct kmem_magazine_t *mag = &cache->mag[cpuid()];
+	if (mag->count == KMEM_MAG_SIZE) {
+		acquire(&cache->kmem_cache_lock);
+		while (mag->count > KMEM_MAG_SIZE / 2)
+			slub_free(cache, mag->objs[--mag->count]);
+		release(&cache->kmem_cache_lock);
+	}
+	mag->objs[mag->count++] = ptr;
+	pop_off();
+}
+
 // 'ge' means greater than and equal
 static int32_t binary_search_ge(const int16_t array[], int32_t array_size,
 				size_t target)
@@ -301,39 +750,20 @@ static int32_t binary_search_ge(const int16_t array[], int32_t array_size,
 	return l;
 }
 
-// this couldn't allocate more than a page size memory area
+/**
+ * @brief Small sizes come from the size-class caches, larger ones are whole
+ * pages from the buddy system. The latter are page aligned, which no slab
+ * object ever is, as every slab page starts with its header.
+ * @param size
+ * @return void*
+ */
 void *kmalloc(size_t size)
 {
-	assert(size > 0 and size <= slub_size[SLUBNUM - 1]);
+	assert(size > 0);
+	if (size > slub_size[SLUBNUM - 1])
+		return pages_alloc(div_round_up(size, PGSIZE));
 	int32_t idx = binary_search_ge(slub_size, SLUBNUM, size);
-
-	void *ptr = NULL;
-	acquire(&kmem_cache_array[idx].kmem_cache_lock);
-	if (list_empty(&kmem_cache_array[idx].partiallist)) {
-		struct slub_pages_node_t *slub_pages_node =
-			new_slub_pages_node(idx);
-		if (slub_pages_node == NULL)   // todo: add wait-list
-			goto ret;
-		list_add_front(
-			&slub_pages_node->slub_node_list,
-			&slub_pages_node->kmem_cache_linked->partiallist);
-	}
-	assert(!list_empty(&kmem_cache_array[idx].partiallist));
-	struct slub_pages_node_t *slub_pages_node =
-		element_entry(list_next(&kmem_cache_array[idx].partiallist),
-			      struct slub_pages_node_t, slub_node_list);
-	assert(!list_empty(&slub_pages_node->obj_freelist));
-	ptr = list_next_then_del(&slub_pages_node->obj_freelist);
-	if (list_empty(&slub_pages_node->obj_freelist)) {
-		// remove from partial list and add to full list
-		list_del(&slub_pages_node->slub_node_list);
-		list_add_front(&slub_pages_node->slub_node_list,
-			       &slub_pages_node->kmem_cache_linked->fulllist);
-	}
-
-ret:
-	release(&kmem_cache_array[idx].kmem_cache_lock);
-	return ptr;
+	return kmem_cache_alloc(kmalloc_caches[idx]);
 }
 
 void *kzalloc(size_t size)
@@ -343,20 +773,16 @@ void *kzalloc(size_t size)
 	return ptr;
 }
 
+// free an object from kmalloc() or from any kmem cache
 void kfree(void *ptr)
 {
 	if (ptr == NULL)
 		return;
+	if (OFFSETPAGE((uintptr_t)ptr) == 0) {
+		pages_free(ptr);
+		return;
+	}
 	struct slub_pages_node_t *slub_pages_node =
 		(struct slub_pages_node_t *)SLUB_NODE_START(ptr);
-	acquire(&slub_pages_node->kmem_cache_linked->kmem_cache_lock);
-	if (list_empty(&slub_pages_node->obj_freelist)) {
-		// remove from full list and add to partial list
-		list_del(&slub_pages_node->slub_node_list);
-		list_add_front(
-			&slub_pages_node->slub_node_list,
-			&slub_pages_node->kmem_cache_linked->partiallist);
-	}
-	list_add_front(ptr, &slub_pages_node->obj_freelist);
-	release(&slub_pages_node->kmem_cache_linked->kmem_cache_lock);
-}
\ No newline at end of file
+	kmem_cache_free(slub_pages_node->kmem_cache_linked, ptr);
+}
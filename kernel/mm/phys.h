@@ -18,19 +18,31 @@ void phymem_init();
 struct phys_page_record_t {
 	int16_t order;
 	uint16_t count;
+	uint32_t private;   // up to the owner, 0 when allocated
 	struct spinlock_t lk;
 };
 void buddy_system_init(uintptr_t start, uintptr_t end);
+void *pages_try_alloc(size_t npages);
 void *pages_alloc(size_t npages);
 void *pages_zalloc(size_t npages);
+void zero_pool_refill();
 void *pages_dup(void *ptr);
 int32_t pages_undup(void *ptr);
 void release_pglock(void *ptr);
 void pages_free(void *pa);
+void page_set_private(void *ptr, uint32_t private);
+uint32_t page_private(void *ptr);
+int32_t page_count(void *ptr);
+void pages_stat();
 
 
 // === kmalloc implemented by slub allocator ===
+struct kmem_cache_t;
 void kmem_cache_init();
+struct kmem_cache_t *kmem_cache_create(char *name, size_t size, size_t align,
+				       void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache_t *cache);
+void kmem_cache_free(struct kmem_cache_t *cache, void *ptr);
 void *kmalloc(size_t size);
 void *kzalloc(size_t size);
 void kfree(void *ptr);
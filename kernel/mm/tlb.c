@@ -0,0 +1,78 @@
+#include "tlb.h"
+#include "mmu.h"
+#include "vm.h"
+#include <platform/riscv.h>
+#include <platform/sbi.h>
+#include <uniks/defs.h>
+#include <uniks/kassert.h>
+#include <uniks/kstdlib.h>
+#include <uniks/param.h>
+
+
+/**
+ * @brief A hart flushes its whole TLB in uservec and userret (trampoline.S),
+ * so while it runs in the kernel it holds no user translation, and it holds
+ * none of an old page table once it is back in user space. Only the harts in
+ * U-mode on the mm right now, which mm->active_harts tells, may hold stale
+ * entries; they are shot down through SBI, with one ASID-wide flush when the
+ * gathered span is larger than TLB_FLUSH_CEILING pages.
+ */
+
+void tlb_batch_init(struct tlb_batch_t *tlb, struct mm_struct *mm)
+{
+	tlb->mm = mm;
+	tlb->start = UINT64_MAX;
+	tlb->end = 0;
+	tlb->nr_pages = 0;
+}
+
+// gather the pages of [va, va + size)
+void tlb_batch_add(struct tlb_batch_t *tlb, uintptr_t va, size_t size)
+{
+	tlb->start = MIN(tlb->start, PGROUNDDOWN(va));
+	tlb->end = MAX(tlb->end, PGROUNDUP(va + size));
+	tlb->nr_pages += div_round_up(size, PGSIZE);
+}
+
+void tlb_batch_flush(struct tlb_batch_t *tlb)
+{
+	if (tlb->start >= tlb->end)
+		return;
+
+	__sync_synchronize();	// the PTE stores before the peek below
+	push_off();
+	uint64_t harts = tlb->mm->active_harts;
+	clear_var_bit(harts, 1ull << cpuid());
+	pop_off();
+
+	if (harts != 0) {
+		if (tlb->nr_pages > TLB_FLUSH_CEILING)
+			sbi_remote_sfence_vma_asid(harts, 0, (size_t)-1,
+						   tlb->mm->asid);
+		else
+			sbi_remote_sfence_vma_asid(harts, tlb->start,
+						   tlb->end - tlb->start,
+						   tlb->mm->asid);
+	}
+	tlb_batch_init(tlb, tlb->mm);
+}
+
+void tlb_flush_page(struct mm_struct *mm, uintptr_t va)
+{
+	struct tlb_batch_t tlb;
+	tlb_batch_init(&tlb, mm);
+	tlb_batch_add(&tlb, va, PGSIZE);
+	tlb_batch_flush(&tlb);
+}
+
+// this hart is about to run mm in U-mode
+void tlb_mm_enter(struct mm_struct *mm)
+{
+	__sync_fetch_and_or(&mm->active_harts, 1ull << cpuid());
+}
+
+// this hart has trapped out of U-mode of mm
+void tlb_mm_leave(struct mm_struct *mm)
+{
+	__sync_fetch_and_and(&mm->active_harts, ~(1ull << cpuid()));
+}
@@ -0,0 +1,28 @@
+#ifndef __KERNEL_MM_TLB_H__
+#define __KERNEL_MM_TLB_H__
+
+
+#include <uniks/defs.h>
+
+
+struct mm_struct;
+
+/**
+ * @brief Page-table updates on one mm are gathered here and flushed from the
+ * TLBs once, by tlb_batch_flush(), instead of page by page.
+ */
+struct tlb_batch_t {
+	struct mm_struct *mm;
+	uintptr_t start, end;	// the span of pages gathered
+	uint32_t nr_pages;
+};
+
+void tlb_batch_init(struct tlb_batch_t *tlb, struct mm_struct *mm);
+void tlb_batch_add(struct tlb_batch_t *tlb, uintptr_t va, size_t size);
+void tlb_batch_flush(struct tlb_batch_t *tlb);
+void tlb_flush_page(struct mm_struct *mm, uintptr_t va);
+void tlb_mm_enter(struct mm_struct *mm);
+void tlb_mm_leave(struct mm_struct *mm);
+
+
+#endif /* !__KERNEL_MM_TLB_H__ */
@@ -1,6 +1,9 @@
 #include "vm.h"
+#include "filemap.h"
 #include "memlay.h"
 #include "mmu.h"
+#include "tlb.h"
+#include <device/blkbuf.h>
 #include <fs/ext2fs.h>
 #include <mm/phys.h>
 #include <platform/platform.h>
@@ -16,6 +19,7 @@
 
 
 pagetable_t kernel_pagetable;
+static struct kmem_cache_t *mm_cachep, *vma_cachep;
 
 
 void kvmenablehart()
@@ -27,6 +31,44 @@ void kvmenablehart()
 	sfence_vma();
 }
 
+/**
+ * @brief fork shares the leaf page tables of the parent instead of copying
+ * them: the level-1 PTEs on both sides turn invalid but keep pointing to the
+ * table, whose page reference count tells how many mm share it. The first walk
+ * through such a PTE takes a private copy of the table, or the table itself
+ * back if nobody else shares it any longer. So fork then execve() copies only
+ * the few tables the child touches before execve().
+ */
+#define PTE_LAZY(pte) (!(pte)->valid and (pte)->paddr != 0)
+
+static int64_t copy_pgtable(pagetable_t new_pagetable,
+			    pagetable_t old_pagetable, int32_t layer,
+			    uint32_t perm, uintptr_t va,
+			    struct tlb_batch_t *tlb);
+
+// make the lazy pte point to a leaf table of its own
+static int32_t unshare_pgtable(struct pgtable_entry_t *pte)
+{
+	pagetable_t shared = (pagetable_t)PNO2PA(pte->paddr), own;
+	struct tlb_batch_t tlb;
+
+	// ahead of the page lock, which keeps the count from changing
+	if ((own = pages_zalloc(1)) == NULL)
+		return -1;
+	if (pages_undup(shared) == 1) {
+		release_pglock(shared);
+		pages_free(own);
+		pte->valid = 1;
+		return 0;
+	}
+	// no hart walks the shared table, so nothing to flush from TLB
+	tlb_batch_init(&tlb, NULL);
+	copy_pgtable(own, shared, 2, PTE_W, 0, &tlb);
+	release_pglock(shared);
+	*(pte_t *)pte = PA2PTE(own) | PTE_V;
+	return 0;
+}
+
 /**
  * @brief Return the address of the PTE in pagetable that corresponds to virtual
  * address va.
@@ -37,19 +79,40 @@ void kvmenablehart()
  * @return pgtable_entry_t *: the 3rd level pte
  */
 struct pgtable_entry_t *walk(pagetable_t pagetable, uint64_t va, int32_t alloc)
+{
+	int32_t level;
+	return walk_level(pagetable, va, alloc, &level);
+}
+
+/**
+ * @brief walk() that also tells the level of the returned pte. The walk stops
+ * early at a leaf, i.e. a megapage (level 1) covering va, and the caller has
+ * to treat the whole megapage as one.
+ * @param pagetable
+ * @param va
+ * @param alloc wether allow to allocate memory
+ * @param level
+ * @return struct pgtable_entry_t*
+ */
+struct pgtable_entry_t *walk_level(pagetable_t pagetable, uint64_t va,
+				   int32_t alloc, int32_t *level)
 {
 	assert(va < MAXVA);
 
-	for (int32_t level = 2; level > 0; level--) {
+	for (*level = 2; *level > 0; (*level)--) {
 		struct pgtable_entry_t *pte =
-			(struct pgtable_entry_t *)&pagetable[PX(level, va)];
+			(struct pgtable_entry_t *)&pagetable[PX(*level, va)];
+		if (PTE_LAZY(pte) and unshare_pgtable(pte) < 0)
+			return NULL;
 		if (pte->valid) {
+			if (PTE_LEAF(pte))
+				return pte;
 			pagetable = (pagetable_t)PNO2PA(pte->paddr);
 		} else {
 			// this page is not valid
 			if (!alloc or (pagetable = pages_zalloc(1)) == NULL)
 				return NULL;
-			*(pte_t *)pte = PA2PTE(pagetable) | (level ? PTE_V : 0);
+			*(pte_t *)pte = PA2PTE(pagetable) | PTE_V;
 		}
 	}
 	return (struct pgtable_entry_t *)&pagetable[PX(0, va)];
@@ -64,13 +127,16 @@ struct pgtable_entry_t *walk(pagetable_t pagetable, uint64_t va, int32_t alloc)
  */
 static uintptr_t walkaddr(pagetable_t pagetable, uintptr_t va)
 {
-	struct pgtable_entry_t *pte = walk(pagetable, va, 0);
+	int32_t level;
+	struct pgtable_entry_t *pte = walk_level(pagetable, va, 0, &level);
 	if (pte == NULL)
 		return 0;
 	if (!pte->valid)
 		return 0;
 	if (!pte->user)
 		return 0;
+	if (level == 1)	  // the page of va inside the megapage
+		return PNO2PA(pte->paddr) + PGROUNDDOWN(OFFSETMEGAPAGE(va));
 	return PNO2PA(pte->paddr);
 }
 
@@ -108,6 +174,60 @@ int32_t mappages(pagetable_t pagetable, uintptr_t va, size_t size, uintptr_t pa,
 	return 0;
 }
 
+/**
+ * @brief Map the megapage at pa to va, which must both be aligned to
+ * MEGAPGSIZE.
+ * @return int32_t: -1 if out of memory, or if va is mapped by smaller pages
+ * already
+ */
+static int32_t map_megapage(pagetable_t pagetable, uintptr_t va, uintptr_t pa,
+			    int32_t perm)
+{
+	assert(OFFSETMEGAPAGE(va) == 0 and OFFSETMEGAPAGE(pa) == 0);
+
+	struct pgtable_entry_t *pte =
+		(struct pgtable_entry_t *)&pagetable[PX(2, va)];
+	if (!pte->valid) {
+		pagetable_t child = pages_zalloc(1);
+		if (child == NULL)
+			return -1;
+		*(pte_t *)pte = PA2PTE(child) | PTE_V;
+	}
+	assert(!PTE_LEAF(pte));
+	pagetable = (pagetable_t)PNO2PA(pte->paddr);
+	pte = (struct pgtable_entry_t *)&pagetable[PX(1, va)];
+	if (pte->valid)
+		return -1;
+	*(pte_t *)pte = PA2PTE(pa) | perm | PTE_V;
+	return 0;
+}
+
+// map a kernel range with megapages wherever both sides are aligned
+static int32_t kvmmap(pagetable_t kpgtbl, uintptr_t va, size_t size,
+		      uintptr_t pa, int32_t perm)
+{
+	uintptr_t end = PGROUNDUP(va + size);
+	size_t n;
+
+	while (va < end) {
+		if (OFFSETMEGAPAGE(va) == 0 and OFFSETMEGAPAGE(pa) == 0 and
+		    end - va >= MEGAPGSIZE) {
+			n = MEGAPGSIZE;
+			if (map_megapage(kpgtbl, va, pa, perm) < 0)
+				return -1;
+		} else {
+			// small pages up to the next megapage boundary
+			n = MIN((size_t)(MEGAPGROUNDDOWN(va) + MEGAPGSIZE - va),
+				(size_t)(end - va));
+			if (mappages(kpgtbl, va, n, pa, perm) < 0)
+				return -1;
+		}
+		va += n;
+		pa += n;
+	}
+	return 0;
+}
+
 static pagetable_t kvmmake()
 {
 	pagetable_t kpgtbl;
@@ -118,14 +238,17 @@ static pagetable_t kvmmake()
 	// virtio mmio disk interface
 	assert(mappages(kpgtbl, VIRTIO0, PGSIZE, VIRTIO0, PTE_R | PTE_W) != -1);
 	// PLIC
-	assert(mappages(kpgtbl, PLIC, 0x400000, PLIC, PTE_R | PTE_W) != -1);
+	assert(kvmmap(kpgtbl, PLIC, 0x400000, PLIC, PTE_R | PTE_W) != -1);
 
 #define KERNELBASE (uintptr_t) KERNEL_BASE_ADDR
 	// map kernel text segment
 	assert(mappages(kpgtbl, KERNELBASE, (uint64_t)(etext - KERNELBASE),
 			KERNELBASE, PTE_R | PTE_X) != -1);
-	// map kernel data segment(include stack) and the remainder physical RAM
-	assert(mappages(kpgtbl, (uint64_t)etext, PHYSTOP - (uint64_t)etext,
+	/**
+	 * @brief map kernel data segment(include stack) and the remainder
+	 * physical RAM, the latter with megapages to spare the TLB
+	 */
+	assert(kvmmap(kpgtbl, (uint64_t)etext, PHYSTOP - (uint64_t)etext,
 			(uint64_t)etext, PTE_R | PTE_W) != -1);
 	// map the trampoline to the highest virtual address in the kernel
 	assert(mappages(kpgtbl, TRAMPOLINE, PGSIZE, (uint64_t)trampoline,
@@ -138,6 +261,11 @@ static pagetable_t kvmmake()
 void kvminit()
 {
 	kernel_pagetable = kvmmake();
+	mm_cachep = kmem_cache_create("mm_struct", sizeof(struct mm_struct),
+				      _Alignof(struct mm_struct), NULL);
+	vma_cachep = kmem_cache_create("vm_area_struct",
+				       sizeof(struct vm_area_struct),
+				       _Alignof(struct vm_area_struct), NULL);
 }
 
 /**
@@ -159,6 +287,78 @@ void release_phypg(void *phypg)
 		release_pglock(phypg);
 }
 
+/**
+ * @brief A page of a MAP_SHARED mapping is either an anonymous page shared
+ * through its reference count, or the data page of a block buffer, pinned by a
+ * reference on the buffer for as long as it is mapped.
+ */
+static void shared_page_dup(void *page)
+{
+	struct blkbuf_t *bb = blk_of_page(page);
+	if (bb != NULL) {
+		blk_map_pin(1);
+		blk_hold(bb);
+	} else
+		pages_dup(page);
+}
+
+/**
+ * @brief Drop the reference a shared pte holds. A writable one may carry stores
+ * made after the block was last written back, so the block is dirtied again.
+ * Must not sleep, it also runs from freeproc().
+ */
+static void shared_page_release(void *page, int32_t writable)
+{
+	struct blkbuf_t *bb = blk_of_page(page);
+	if (bb == NULL) {
+		release_phypg(page);
+		return;
+	}
+	if (writable)
+		blk_mark_dirty(bb);
+	blk_put(bb);
+	blk_map_unpin();
+}
+
+/**
+ * @brief Unmap the user pages in [start, end) and drop their references,
+ * leaving the page-table pages in place.
+ * @param mm
+ * @param start
+ * @param end
+ */
+void uvm_unmap(struct mm_struct *mm, uintptr_t start, uintptr_t end)
+{
+	int32_t level;
+	struct tlb_batch_t tlb;
+
+	tlb_batch_init(&tlb, mm);
+	for (uintptr_t va = start; va < end; va += PGSIZE) {
+		struct pgtable_entry_t *pte =
+			walk_level(mm->pagetable, va, 0, &level);
+		if (pte == NULL or !pte->valid)
+			continue;
+		void *page = (void *)PNO2PA(pte->paddr);
+		if (level == 1) {
+			// a megapage goes only as a whole, see MAP_HUGETLB
+			assert(OFFSETMEGAPAGE(va) == 0 and
+			       va + MEGAPGSIZE <= end);
+			release_phypg(page);
+			*(pte_t *)pte = 0;
+			tlb_batch_add(&tlb, va, MEGAPGSIZE);
+			va += MEGAPGSIZE - PGSIZE;
+			continue;
+		}
+		if (pte->shared)
+			shared_page_release(page, pte->write);
+		else
+			release_phypg(page);
+		*(pte_t *)pte = 0;
+		tlb_batch_add(&tlb, va, PGSIZE);
+	}
+	tlb_batch_flush(&tlb);
+}
+
 /**
  * @brief Compeletely free user memory pages, then free page-table pages. Except
  * trapframe page.
@@ -172,21 +372,41 @@ void free_pgtable(pagetable_t pagetable, int32_t layer)
 			(struct pgtable_entry_t *)&pagetable[i];
 		void *child = (void *)PNO2PA(pte->paddr);
 		if (layer < 2) {
-			if (pte->valid)	  // this pte has child layer
+			if (pte->valid and PTE_LEAF(pte))   // a megapage
+				release_phypg(child);
+			else if (pte->valid)   // this pte has child layer
+				free_pgtable(child, layer + 1);
+			else if (PTE_LAZY(pte) and pages_undup(child) > 1)
+				release_pglock(child);
+			else if (PTE_LAZY(pte)) {   // the last one sharing it
+				release_pglock(child);
 				free_pgtable(child, layer + 1);
+				pages_free(child);
+			}
 		} else if (layer == 2) {
 			if (pte->unrelease)
 				continue;
-			if (pte->valid)	  // this pte has child layer
+			if (!pte->valid)
+				continue;
+			if (pte->shared)
+				shared_page_release(child, pte->write);
+			else
 				release_phypg(child);
 		} else
 			BUG();
 	}
 }
 
+/**
+ * @brief Share the leaves under old_pagetable, which maps from va on, with
+ * new_pagetable, taking perm off them on both sides. The leaf tables that the
+ * new side has none of yet are shared as a whole instead. The old leaves that
+ * lose a permission go into tlb.
+ */
 static int64_t copy_pgtable(pagetable_t new_pagetable,
 			    pagetable_t old_pagetable, int32_t layer,
-			    uint32_t perm)
+			    uint32_t perm, uintptr_t va,
+			    struct tlb_batch_t *tlb)
 {
 	assert(layer <= 2);
 
@@ -196,7 +416,22 @@ static int64_t copy_pgtable(pagetable_t new_pagetable,
 		if (old_pte->unrelease)
 			continue;
 		void *old_child = (void *)PNO2PA(old_pte->paddr);
-		if (old_pte->valid and layer < 2) {
+		uintptr_t child_va = va | ((uintptr_t)i << PXSHIFT(2 - layer));
+		if (old_pte->valid and layer < 2 and PTE_LEAF(old_pte)) {
+			// a megapage is copied on write as a whole
+			if (get_var_bit(old_pte->perm, perm))
+				tlb_batch_add(tlb, child_va, MEGAPGSIZE);
+			clear_var_bit(old_pte->perm, perm);
+			new_pagetable[i] = old_pagetable[i];
+			pages_dup(old_child);
+		} else if (old_pte->valid and layer == 1 and
+			   !((struct pgtable_entry_t *)&new_pagetable[i])->valid) {
+			// share the leaf table, see PTE_LAZY
+			tlb_batch_add(tlb, child_va, MEGAPGSIZE);
+			old_pte->valid = 0;
+			new_pagetable[i] = old_pagetable[i];
+			pages_dup(old_child);
+		} else if (old_pte->valid and layer < 2) {
 			// this old_pte has child layer
 			void *new_child;
 			struct pgtable_entry_t *new_pte =
@@ -209,11 +444,21 @@ static int64_t copy_pgtable(pagetable_t new_pagetable,
 				new_pagetable[i] =
 					PA2PTE(new_child) | PTE_FLAGS(old_pte);
 			}
-			if (copy_pgtable(new_child, old_child, layer + 1,
-					 perm) < 0)
+			if (copy_pgtable(new_child, old_child, layer + 1, perm,
+					 child_va, tlb) < 0)
 				return -1;
+		} else if (PTE_LAZY(old_pte) and layer == 1) {
+			// still shared with those forked before
+			new_pagetable[i] = old_pagetable[i];
+			pages_dup(old_child);
+		} else if (old_pte->valid and layer == 2 and old_pte->shared) {
+			// both sides keep writing to the same page
+			new_pagetable[i] = old_pagetable[i];
+			shared_page_dup(old_child);
 		} else if (old_pte->valid and layer == 2) {
 			// this old_pte maps to a physical page
+			if (get_var_bit(old_pte->perm, perm))
+				tlb_batch_add(tlb, child_va, PGSIZE);
 			clear_var_bit(old_pte->perm, perm);
 			new_pagetable[i] = old_pagetable[i];
 			pages_dup(old_child);
@@ -233,9 +478,8 @@ static int64_t copy_pgtable(pagetable_t new_pagetable,
  */
 int64_t uvm_space_copy(struct mm_struct *new_mm, struct mm_struct *old_mm)
 {
-	// copy mm_struct
+	// copy mm_struct, vma_link() below counts the VMAs
 	acquire(&old_mm->mmap_lk);
-	new_mm->map_count = old_mm->map_count;
 	new_mm->stack_maxsize = old_mm->stack_maxsize;
 	new_mm->start_ustack = old_mm->start_ustack;
 	new_mm->mmap_base = old_mm->mmap_base;
@@ -244,8 +488,7 @@ int64_t uvm_space_copy(struct mm_struct *new_mm, struct mm_struct *old_mm)
 
 	// copy vm_area_struct
 	struct vm_area_struct *old_vma, *new_vma;
-	struct list_node_t *old_node = list_next(&old_mm->vm_area_list_head),
-			   *new_node = &new_mm->vm_area_list_head;
+	struct list_node_t *old_node = list_next(&old_mm->vm_area_list_head);
 	while (old_node != &old_mm->vm_area_list_head) {
 		old_vma = element_entry(old_node, struct vm_area_struct,
 					vm_area_list);
@@ -254,33 +497,49 @@ int64_t uvm_space_copy(struct mm_struct *new_mm, struct mm_struct *old_mm)
 			old_vma->vm_pgoff, old_vma->vm_inode, old_vma->_filesz);
 
 		new_vma->vm_mm = new_mm;
-		list_add_front(&new_vma->vm_area_list, new_node);
+		vma_link(new_mm, new_vma);
 		old_node = list_next(old_node);
-		new_node = list_next(new_node);
-
-		for (uintptr_t va = old_vma->vm_start; va < old_vma->vm_end;
-		     va += PGSIZE)
-			invalidate(va);
 	}
 
-	copy_pgtable(new_mm->pagetable, old_mm->pagetable, 0, PTE_W);
+	/**
+	 * @brief Only the leaf tables now shared and the pages that were
+	 * writable and now are not need a TLB flush, and a large fork ends up
+	 * in one flush of the whole ASID.
+	 */
+	struct tlb_batch_t tlb;
+	tlb_batch_init(&tlb, old_mm);
+	copy_pgtable(new_mm->pagetable, old_mm->pagetable, 0, PTE_W, 0, &tlb);
+	tlb_batch_flush(&tlb);
 
 	release(&old_mm->mmap_lk);
 
 	return 0;
 }
 
+// ASIDs are handed out in turn, two mm may share one after 16 bits wrap
+static uint32_t next_asid = 0;
+
 struct mm_struct *new_mm_struct()
 {
-	struct mm_struct *mm = kmalloc(sizeof(struct mm_struct));
+	struct mm_struct *mm = kmem_cache_alloc(mm_cachep);
 
-	if ((mm->pagetable = uvmcreate()) == NULL)
+	if (mm == NULL)
+		return NULL;
+	if ((mm->pagetable = uvmcreate()) == NULL) {
+		kmem_cache_free(mm_cachep, mm);
 		return NULL;
+	}
 	initlock(&mm->mmap_lk, "mmlock");
 	INIT_LIST_HEAD(&mm->vm_area_list_head);
+	mm->vm_rb_root = (struct rb_root_t)RB_ROOT_GEN;
+	mm->mmap_cache = NULL;
 	mm->map_count = 0;
 	mm->mm_count = 1;
+	mm->asid = __sync_add_and_fetch(&next_asid, 1) & 0xffff;
+	mm->active_harts = 0;
 	mm->stack_maxsize = MAXSTACK;
+	// mmap() hands out addresses downwards from right below the stack
+	mm->mmap_base = USER_STACK_TOP - PGSIZE * (MAXSTACK + 1);
 
 	return mm;
 }
@@ -298,13 +557,12 @@ void free_mm_struct(struct mm_struct *mm)
 	while (vm_area_node != &mm->vm_area_list_head) {
 		vma = element_entry(vm_area_node, struct vm_area_struct,
 				    vm_area_list);
-		iput(vma->vm_inode);
-		kfree(vma);
 		vm_area_node = list_next(vm_area_node);
+		free_vmarea_struct(vma);
 	}
 	release(&mm->mmap_lk);
 
-	kfree(mm);
+	kmem_cache_free(mm_cachep, mm);
 }
 
 struct vm_area_struct *new_vmarea_struct(uintptr_t _va_start, uintptr_t _va_end,
@@ -312,8 +570,10 @@ struct vm_area_struct *new_vmarea_struct(uintptr_t _va_start, uintptr_t _va_end,
 					 struct m_inode_t *inode,
 					 uint64_t _filesz)
 {
-	struct vm_area_struct *vma = kmalloc(sizeof(struct vm_area_struct));
+	struct vm_area_struct *vma = kmem_cache_alloc(vma_cachep);
 
+	if (vma == NULL)
+		return NULL;
 	INIT_LIST_HEAD(&vma->vm_area_list);
 	vma->vm_start = _va_start;
 	vma->vm_end = _va_end;
@@ -325,6 +585,97 @@ struct vm_area_struct *new_vmarea_struct(uintptr_t _va_start, uintptr_t _va_end,
 	return vma;
 }
 
+// drop the inode reference of a vm_area_struct and free it
+void free_vmarea_struct(struct vm_area_struct *vma)
+{
+	iput(vma->vm_inode);
+	kmem_cache_free(vma_cachep, vma);
+}
+
+/**
+ * @brief VMAs never overlap, so ordered by (vm_start, vm_end) their ends are
+ * ordered as well. The pair keeps an empty VMA, such as the heap before the
+ * first brk(), in front of a VMA starting where it does.
+ */
+static int32_t vma_less(struct vm_area_struct *a, struct vm_area_struct *b)
+{
+	return a->vm_start < b->vm_start or
+	       (a->vm_start == b->vm_start and a->vm_end < b->vm_end);
+}
+
+/**
+ * @brief Find the first VMA ending above addr, which is the one addr lies in
+ * if any. Caller holds mmap_lk.
+ * @param mm
+ * @param addr
+ * @return struct vm_area_struct*: NULL if no VMA ends above addr
+ */
+struct vm_area_struct *find_vma(struct mm_struct *mm, uintptr_t addr)
+{
+	struct vm_area_struct *vma = mm->mmap_cache, *res = NULL;
+	assert(holding(&mm->mmap_lk));
+
+	if (vma != NULL and vma->vm_start <= addr and addr < vma->vm_end)
+		return vma;
+
+	struct rb_node_t *node = mm->vm_rb_root.node;
+	while (node != NULL) {
+		vma = element_entry(node, struct vm_area_struct, vm_rb);
+		if (vma->vm_end > addr) {
+			res = vma;
+			if (vma->vm_start <= addr)
+				break;
+			node = node->left;
+		} else
+			node = node->right;
+	}
+	if (res != NULL and res->vm_start <= addr)
+		mm->mmap_cache = res;
+	return res;
+}
+
+/**
+ * @brief Put vma into both the tree and the sorted list of mm. Caller holds
+ * mmap_lk.
+ * @param mm
+ * @param vma
+ */
+void vma_link(struct mm_struct *mm, struct vm_area_struct *vma)
+{
+	struct rb_node_t **link = &mm->vm_rb_root.node, *parent = NULL;
+	struct vm_area_struct *next = NULL, *cur;
+
+	while (*link != NULL) {
+		parent = *link;
+		cur = element_entry(parent, struct vm_area_struct, vm_rb);
+		if (vma_less(vma, cur)) {
+			assert(vma->vm_end <= cur->vm_start);
+			next = cur;
+			link = &parent->left;
+		} else {
+			assert(vma->vm_start >= cur->vm_end);
+			link = &parent->right;
+		}
+	}
+	rb_link_node(&vma->vm_rb, parent, link);
+	rb_insert_color(&vma->vm_rb, &mm->vm_rb_root);
+
+	// in front of its successor in the tree
+	list_add_tail(&vma->vm_area_list,
+		      next ? &next->vm_area_list : &mm->vm_area_list_head);
+	mm->map_count++;
+}
+
+// Take vma out of mm, caller holds mmap_lk.
+void vma_unlink(struct mm_struct *mm, struct vm_area_struct *vma)
+{
+	rb_erase(&vma->vm_rb, &mm->vm_rb_root);
+	list_del(&vma->vm_area_list);
+	if (mm->mmap_cache == vma)
+		mm->mmap_cache = NULL;
+	mm->map_count--;
+}
+
 int32_t add_vm_area(struct mm_struct *mm, uintptr_t _va_start,
 		    uintptr_t _va_end, uint64_t flags, uint64_t pgoff,
 		    struct m_inode_t *inode, uint64_t _filesz)
@@ -332,26 +683,14 @@ int32_t add_vm_area(struct mm_struct *mm, uintptr_t _va_start,
 	assert(OFFSETPAGE(_va_start) == 0);   // align to page
 	assert(OFFSETPAGE(_va_end) == 0);     // align to page
 
-	struct vm_area_struct *vma;
-
-	acquire(&mm->mmap_lk);
-	// "insert sorting"
-	struct list_node_t *vm_area_node = list_next(&mm->vm_area_list_head);
-	while (vm_area_node != &mm->vm_area_list_head) {
-		vma = element_entry(vm_area_node, struct vm_area_struct,
-				    vm_area_list);
-		assert(_va_end <= vma->vm_start or _va_start >= vma->vm_end);
-		if (vma->vm_start >= _va_end)
-			break;
-		vm_area_node = list_next(vm_area_node);
-	}
-
-	vma = new_vmarea_struct(_va_start, _va_end, flags, pgoff, inode,
-				_filesz);
+	struct vm_area_struct *vma = new_vmarea_struct(_va_start, _va_end, flags,
+						       pgoff, inode, _filesz);
+	if (vma == NULL)
+		return -1;
 	vma->vm_mm = mm;
-	mm->map_count++;
-	list_add_tail(&vma->vm_area_list, vm_area_node);
 
+	acquire(&mm->mmap_lk);
+	vma_link(mm, vma);
 	release(&mm->mmap_lk);
 	return 0;
 }
@@ -363,20 +702,12 @@ struct vm_area_struct *search_vmareas(struct mm_struct *mm,
 	uint32_t perm = 0;
 	uintptr_t end_vaddr = target_vaddr + size;
 
-	struct vm_area_struct *vma;
 	acquire(&mm->mmap_lk);
-	struct list_node_t *vm_area_node = list_next(&mm->vm_area_list_head);
-	while (vm_area_node != &mm->vm_area_list_head) {
-		vma = element_entry(vm_area_node, struct vm_area_struct,
-				    vm_area_list);
-		if (target_vaddr >= vma->vm_start and
-		    end_vaddr <= vma->vm_end) {
-			set_var_bit(perm, vma->vm_flags);
-			break;
-		}
-		vm_area_node = list_next(vm_area_node);
-	}
-	if (vm_area_node == &mm->vm_area_list_head)
+	struct vm_area_struct *vma = find_vma(mm, target_vaddr);
+	if (vma != NULL and target_vaddr >= vma->vm_start and
+	    end_vaddr <= vma->vm_end)
+		set_var_bit(perm, vma->vm_flags);
+	else
 		vma = NULL;
 	release(&mm->mmap_lk);
 
@@ -384,8 +715,12 @@ struct vm_area_struct *search_vmareas(struct mm_struct *mm,
 	return vma;
 }
 
-static void true_load_segment(struct vm_area_struct *vma, uintptr_t vaddr,
-			      char *page_start)
+/**
+ * @brief Fill the page of vaddr from the file, the caller holds its ilock().
+ * @return int64_t: -1 if the file part could not be read whole
+ */
+static int64_t load_segment_page(struct vm_area_struct *vma, uintptr_t vaddr,
+				 char *page_start)
 {
 	assert(OFFSETPAGE(vaddr) == 0);
 	uint32_t segoff = vaddr - vma->vm_start;
@@ -393,38 +728,246 @@ static void true_load_segment(struct vm_area_struct *vma, uintptr_t vaddr,
 	if (pgoff > PGSIZE)
 		pgoff = PGSIZE;
 
-	if (segoff < vma->_filesz) {
-		ilock(vma->vm_inode);
-		readi(vma->vm_inode, 0, page_start, vma->vm_pgoff + segoff,
-		      pgoff);
-		iunlock(vma->vm_inode);
-	}
+	if (segoff < vma->_filesz and
+	    readi_wait(vma->vm_inode, page_start, vma->vm_pgoff + segoff,
+		       pgoff) != pgoff)
+		return -1;
 	if (vma->_filesz != (vma->vm_end - vma->vm_start)) {
 		// means that .bss section
 		memset(page_start + pgoff, 0, PGSIZE - pgoff);
 	}
+	return 0;
+}
+
+/**
+ * @brief Get the page of a private file mapping at vaddr, the caller holds the
+ * file's ilock(). A page that can never be written and holds nothing but file
+ * content is the file's page in the filemap, shared by every process mapping
+ * it; any other one is a private copy.
+ * @param vma
+ * @param vaddr
+ * @return char*: NULL if out of memory or the file could not be read
+ */
+static char *file_page(struct vm_area_struct *vma, uintptr_t vaddr)
+{
+	uint64_t segoff = vaddr - vma->vm_start;
+	char *page_start;
+
+	if (!get_var_bit(vma->vm_flags, PTE_W) and
+	    OFFSETPAGE(vma->vm_pgoff) == 0 and segoff + PGSIZE <= vma->_filesz)
+		return filemap_get_page(vma->vm_inode,
+					(vma->vm_pgoff + segoff) >> PGSHIFT);
+
+	if ((page_start = pages_try_alloc(1)) != NULL and
+	    load_segment_page(vma, vaddr, page_start) < 0) {
+		pages_free(page_start);
+		page_start = NULL;
+	}
+	return page_start;
+}
+
+/**
+ * @brief Map the block buffer caching the page of a MAP_SHARED file mapping at
+ * vaddr, so that loads and stores go straight to the block cache. The buffer
+ * keeps the reference taken here until the page is unmapped, so the fault
+ * fails once too many buffers are mapped, see blk_map_pin().
+ */
+static int64_t do_shared_file_page(struct mm_struct *mm,
+				   struct vm_area_struct *vma, uintptr_t vaddr,
+				   uint32_t targetperm)
+{
+	struct m_inode_t *ip = vma->vm_inode;
+	uint64_t off = vma->vm_pgoff + (vaddr - vma->vm_start), blkno;
+	struct blkbuf_t *bb = NULL;
+
+	if (blk_map_pin(0) < 0)
+		return -1;
+	ilock(ip);
+	if (off < ip->d_inode_ctnt.i_size and
+	    (blkno = bmap(ip, off / BLKSIZE)) != 0) {
+		iupdate(ip, 0);	  // bmap() may have filled a hole
+		bb = blk_read(ip->i_dev, blkno);
+	}
+	iunlock(ip);
+	if (bb == NULL) {
+		blk_map_unpin();
+		return -1;
+	}
+
+	if (get_var_bit(targetperm, PTE_W)) {
+		blk_mark_dirty(bb);
+		blk_queue_dirty(bb);
+		// the store goes past the cached copy of this page
+		filemap_drop_page(ip, off >> PGSHIFT);
+	}
+	mutex_release(&bb->b_mtx);
+	if (mappages(mm->pagetable, vaddr, PGSIZE, (uintptr_t)bb->b_data,
+		     targetperm | PTE_SHARED) < 0) {
+		blk_put(bb);
+		blk_map_unpin();
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Back the megapage around vaddr of a MAP_HUGETLB area with a zeroed
+ * order-9 block.
+ * @return int64_t: -1 if the megapage does not fit in the VMA, no block is
+ * free, or small pages are mapped there already; the caller falls back to a
+ * small page then
+ */
+static int64_t do_huge_page(struct mm_struct *mm, struct vm_area_struct *vma,
+			    uintptr_t vaddr, uint32_t targetperm)
+{
+	uintptr_t va = MEGAPGROUNDDOWN(vaddr);
+	int32_t level;
+	if (va < vma->vm_start or va + MEGAPGSIZE > vma->vm_end)
+		return -1;
+	// do not zero 2MiB just to find small pages there
+	if (walk_level(mm->pagetable, va, 0, &level) != NULL)
+		return -1;
+
+	char *page_start = pages_try_alloc(1 << MEGAPGORDER);
+	if (page_start == NULL)
+		return -1;
+	memset(page_start, 0, MEGAPGSIZE);
+	if (map_megapage(mm->pagetable, va, (uintptr_t)page_start,
+			 targetperm) < 0) {
+		pages_free(page_start);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Map the not yet mapped file pages of a private file mapping in the
+ * FAULT_AROUND_PAGES aligned window around vaddr, so that walking through an
+ * executable does not trap on every page. They come from file_page() under
+ * one ilock() and are mapped without PTE_W; a store to a private copy goes
+ * through do_wp_page(), which finds it unshared and just allows it.
+ * @param mm
+ * @param vma
+ * @param vaddr the page that faulted, mapped by the caller
+ */
+static void do_fault_around(struct mm_struct *mm, struct vm_area_struct *vma,
+			    uintptr_t vaddr)
+{
+	uintptr_t window = FAULT_AROUND_PAGES * PGSIZE;
+	uintptr_t start = MAX(get_var_bit(vaddr, ~(window - 1)), vma->vm_start);
+	uintptr_t end = MIN(get_var_bit(vaddr, ~(window - 1)) + window,
+			    PGROUNDUP(vma->vm_start + vma->_filesz));
+	uint32_t perm = get_var_bit(vma->vm_flags, PTE_R | PTE_X | PTE_U);
+	struct pgtable_entry_t *pte;
+	char *page_start;
+
+	ilock(vma->vm_inode);
+	for (uintptr_t va = start; va < end; va += PGSIZE) {
+		if (va == vaddr)
+			continue;
+		if ((pte = walk(mm->pagetable, va, 0)) != NULL and pte->valid)
+			continue;
+		// only worth it while memory is at hand
+		if ((page_start = file_page(vma, va)) == NULL)
+			break;
+		if (mappages(mm->pagetable, va, PGSIZE, (uintptr_t)page_start,
+			     perm) < 0) {
+			pages_free(page_start);
+			break;
+		}
+	}
+	iunlock(vma->vm_inode);
 }
 
 // this function's name comes from Linux v1.0
 int64_t do_no_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		   uintptr_t vaddr, uint32_t targetperm)
 {
-	char *page_start = pages_alloc(1);
+	if (vma->vm_inode != NULL and get_var_bit(vma->vm_flags, VM_SHARED))
+		return do_shared_file_page(mm, vma, vaddr, targetperm);
+	if (get_var_bit(vma->vm_flags, VM_HUGE) and
+	    do_huge_page(mm, vma, vaddr, targetperm) == 0)
+		return 0;
+
+	// anonymous and all-.bss pages come zeroed, from the zero pool mostly
+	int32_t zero = vma->vm_inode == NULL or
+		       vaddr - vma->vm_start >= vma->_filesz;
+	char *page_start;
+	if (zero)
+		page_start = pages_zalloc(1);
+	else {
+		ilock(vma->vm_inode);
+		page_start = file_page(vma, vaddr);
+		iunlock(vma->vm_inode);
+	}
 	if (page_start == NULL)
 		return -1;
-	mappages(mm->pagetable, vaddr, PGSIZE, (uintptr_t)page_start,
-		 targetperm);
-	if (vma->vm_inode != NULL)
-		true_load_segment(vma, vaddr, page_start);
+	if (get_var_bit(vma->vm_flags, VM_SHARED))
+		set_var_bit(targetperm, PTE_SHARED);
+	if (mappages(mm->pagetable, vaddr, PGSIZE, (uintptr_t)page_start,
+		     targetperm) < 0) {
+		pages_free(page_start);
+		return -1;
+	}
+	if (!zero and FAULT_AROUND_PAGES > 1)
+		do_fault_around(mm, vma, PGROUNDDOWN(vaddr));
+	return 0;
+}
+
+// do_wp_page() for a megapage, whose copy is a whole order-9 block
+static int64_t do_wp_megapage(struct pgtable_entry_t *pte, uintptr_t vaddr,
+			      uint32_t targetperm)
+{
+	char *physpg_paddr = (char *)PNO2PA(pte->paddr);
+	vaddr = MEGAPGROUNDDOWN(vaddr);
+
+	if (pages_undup(physpg_paddr) == 1) {
+		set_var_bit(pte->perm, targetperm);
+		release_pglock(physpg_paddr);
+		goto ret;
+	}
+
+	char *new_page = pages_try_alloc(1 << MEGAPGORDER);
+	if (new_page == NULL) {
+		release_pglock(physpg_paddr);
+		return -1;
+	}
+	memcpy(new_page, physpg_paddr, MEGAPGSIZE);
+	release_pglock(physpg_paddr);
+	set_var_bit(targetperm, pte->perm);
+	*(pte_t *)pte = PA2PTE(new_page) | targetperm;
+
+ret:
 	return 0;
 }
 
 // this function's name comes from Linux v1.0
-int64_t do_wp_page(struct pgtable_entry_t *pte, uintptr_t vaddr,
-		   uint32_t targetperm)
+int64_t do_wp_page(struct vm_area_struct *vma, struct pgtable_entry_t *pte,
+		   uintptr_t vaddr, uint32_t targetperm)
 {
 	char *physpg_paddr = (char *)PNO2PA(pte->paddr);
 
+	/**
+	 * @brief A MAP_SHARED page is never copied. If it caches a file block,
+	 * the block turns dirty first, under the buffer lock so that this store
+	 * cannot slip in while msync() is writing the block back, and the file's
+	 * cached copy of the page goes stale.
+	 */
+	if (pte->shared) {
+		struct blkbuf_t *bb = blk_of_page(physpg_paddr);
+		if (bb != NULL and vma->vm_inode != NULL) {
+			mutex_acquire(&bb->b_mtx);
+			blk_mark_dirty(bb);
+			blk_queue_dirty(bb);
+			mutex_release(&bb->b_mtx);
+			filemap_drop_page(vma->vm_inode,
+					  (vma->vm_pgoff + PGROUNDDOWN(vaddr) -
+					   vma->vm_start) >> PGSHIFT);
+		}
+		set_var_bit(pte->perm, targetperm);
+		goto ret;
+	}
+
 	/**
 	 * @brief Only being referenced once indicates that it has not been
 	 * shared, so just change the read and write properties.
@@ -450,8 +993,7 @@ int64_t do_wp_page(struct pgtable_entry_t *pte, uintptr_t vaddr,
 	*(pte_t *)pte = PA2PTE(new_page) | targetperm;
 
 ret:
-	invalidate(vaddr);   // Don't forget to flush TLB
-	return 0;
+	return 0;   // the caller flushes TLB
 }
 
 /**
@@ -477,20 +1019,33 @@ int32_t verify_area(struct mm_struct *mm, uintptr_t vaddr, size_t size,
 		return -1;
 	} else {
 		uintptr_t end_vaddr = vaddr + size;
+		int32_t level;
+		struct tlb_batch_t tlb;
+		tlb_batch_init(&tlb, mm);
 		for (uintptr_t start_vaddr = PGROUNDDOWN(vaddr);
 		     start_vaddr < end_vaddr; start_vaddr += PGSIZE) {
 			res = 0;
-			struct pgtable_entry_t *pte =
-				walk(mm->pagetable, start_vaddr, 1);
-			if (pte == NULL)
-				return -2;
-			if (get_var_bit(pte->perm, targetperm) == targetperm)
+			/**
+			 * @brief No page tables are made here, do_no_page()
+			 * makes them, and it may rather map a megapage.
+			 */
+			struct pgtable_entry_t *pte = walk_level(
+				mm->pagetable, start_vaddr, 0, &level);
+			if (pte != NULL and
+			    get_var_bit(pte->perm, targetperm) == targetperm)
 				continue;
 
 			// handling of COW mechanism
-			if (pte->valid)
-				res = do_wp_page(pte, start_vaddr, targetperm);
-			else {
+			if (pte != NULL and pte->valid and level == 1) {
+				res = do_wp_megapage(pte, start_vaddr,
+						     targetperm);
+				tlb_batch_add(&tlb, MEGAPGROUNDDOWN(start_vaddr),
+					      MEGAPGSIZE);
+			} else if (pte != NULL and pte->valid) {
+				res = do_wp_page(vma, pte, start_vaddr,
+						 targetperm);
+				tlb_batch_add(&tlb, start_vaddr, PGSIZE);
+			} else {
 				/**
 				 * @brief Pages that have not been loaded into
 				 * memory must not have been referenced multiple
@@ -499,9 +1054,12 @@ int32_t verify_area(struct mm_struct *mm, uintptr_t vaddr, size_t size,
 				res = do_no_page(mm, vma, start_vaddr,
 						 targetperm);
 			}
-			if (res < 0)
+			if (res < 0) {
+				tlb_batch_flush(&tlb);
 				return -2;
+			}
 		}
+		tlb_batch_flush(&tlb);
 	}
 
 	return 0;
@@ -575,24 +1133,28 @@ int64_t sys_brk()
 	if (vaddr <= mm->start_brk)
 		goto ret;
 
-	// .text, .data(include .bss), .heap, .stack
-	assert(mm->map_count >= 4);
-
-	// search the heap vm_area_struct
-	struct vm_area_struct *vma;
-	int32_t idx = 0;
+	/**
+	 * @brief The heap is the VMA starting at start_brk. While it is still
+	 * empty, it sorts right in front of the first VMA ending above
+	 * start_brk. It may not grow into the VMA after it.
+	 */
 	acquire(&mm->mmap_lk);
-	struct list_node_t *vm_area_node = list_next(&mm->vm_area_list_head);
-	while (1) {
-		if (idx == 2) {
-			vma = element_entry(vm_area_node, struct vm_area_struct,
-					    vm_area_list);
-			break;
-		}
-		vm_area_node = list_next(vm_area_node);
-		idx++;
+	struct vm_area_struct *vma = find_vma(mm, mm->start_brk);
+	struct list_node_t *node =
+		vma ? &vma->vm_area_list : &mm->vm_area_list_head;
+	if (vma == NULL or vma->vm_start != mm->start_brk) {
+		if ((node = list_prev(node)) == &mm->vm_area_list_head)
+			goto unlock;
+		vma = element_entry(node, struct vm_area_struct, vm_area_list);
+		if (vma->vm_start != mm->start_brk)
+			goto unlock;
 	}
+	if ((node = list_next(node)) != &mm->vm_area_list_head and
+	    vaddr > element_entry(node, struct vm_area_struct, vm_area_list)
+			    ->vm_start)
+		goto unlock;
 	mm->brk = vma->vm_end = vaddr;
+unlock:
 	release(&mm->mmap_lk);
 
 ret:
@@ -743,4 +1305,57 @@ int32_t either_copyout(int32_t user_dst, void *dst, void *src, uint64_t len)
 		memcpy(dst, src, len);
 		return 0;
 	}
-}
\ No newline at end of file
+}
+/* === move whole pages between user spaces without copying === */
+
+/**
+ * @brief Take a reference on the user page mapped at va and write-protect
+ * it, so its owner gets a private copy from do_wp_page() on the next store
+ * while the page sits in a pipe.
+ * @param mm
+ * @param va must be page aligned
+ * @return void*: the physical page, or NULL if va is not mapped, belongs
+ * to a MAP_SHARED mapping or lies in a megapage
+ */
+void *uvm_gift_page(struct mm_struct *mm, uintptr_t va)
+{
+	int32_t level;
+	struct pgtable_entry_t *pte = walk_level(mm->pagetable, va, 0, &level);
+	if (pte == NULL or !pte->valid or !pte->user or pte->shared or
+	    level != 0)
+		return NULL;
+
+	void *page = pages_dup((void *)PNO2PA(pte->paddr));
+	if (pte->write) {
+		pte->write = 0;
+		tlb_flush_page(mm, va);
+	}
+	return page;
+}
+
+/**
+ * @brief Map a gifted page at va in place of the page mapped there. It is
+ * mapped read-only, so a store goes through do_wp_page() which copies it
+ * only if the giver still shares it. The caller's reference on page moves
+ * into the page table.
+ * @param mm
+ * @param va must be page aligned
+ * @param page
+ * @return int32_t: 0 on success, -1 if va is not mapped, belongs to a
+ * MAP_SHARED mapping or lies in a megapage
+ */
+int32_t uvm_accept_page(struct mm_struct *mm, uintptr_t va, void *page)
+{
+	int32_t level;
+	struct pgtable_entry_t *pte = walk_level(mm->pagetable, va, 0, &level);
+	if (pte == NULL or !pte->valid or !pte->user or pte->shared or
+	    level != 0)
+		return -1;
+
+	void *old = (void *)PNO2PA(pte->paddr);
+	pte->paddr = (uintptr_t)page >> PGSHIFT;
+	pte->write = 0;
+	tlb_flush_page(mm, va);
+	pages_free(old);
+	return 0;
+}
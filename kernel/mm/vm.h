@@ -7,6 +7,7 @@
 #include <sync/spinlock.h>
 #include <uniks/defs.h>
 #include <uniks/list.h>
+#include <uniks/rbtree.h>
 
 
 struct vm_area_struct {
@@ -19,8 +20,9 @@ struct vm_area_struct {
 	struct mm_struct *vm_mm; /* The address space we belong to */
 
 	struct list_node_t vm_area_list;
+	struct rb_node_t vm_rb;	  // in mm->vm_rb_root, by address
 
-	// bit function: [D|A|G|U|X|W|R|V]
+	// bit function: [D|A|G|U|X|W|R|V], and VM_* above them
 	uint32_t vm_flags;
 	uint64_t _filesz;   // to cope with .bss and .data
 
@@ -28,13 +30,20 @@ struct vm_area_struct {
 	struct m_inode_t *vm_inode;   // if this segment map a file
 };
 
+#define VM_SHARED (1 << 8)    // MAP_SHARED, stores are seen by every mapping
+#define VM_HUGE	  (1 << 10)   // MAP_HUGETLB, backed by megapages if possible
+
 struct mm_struct {
 	struct spinlock_t mmap_lk;   // mmap's lock
 
 	struct list_node_t vm_area_list_head;	// list of VMA
+	struct rb_root_t vm_rb_root;		// the same VMAs, as a tree
+	struct vm_area_struct *mmap_cache;	// the last VMA looked up
 
 	pagetable_t pagetable;	 // user page table
 	uintptr_t kstack;	 // always point to own kernel stack bottom
+	uint32_t asid;		 // address space ID in satp
+	volatile uint64_t active_harts;	  // bitmap of harts in its U-mode
 
 	/**
 	 * @brief: The number of references to &struct mm_struct.
@@ -55,6 +64,9 @@ struct mm_struct {
 extern char trampoline[];
 
 
+struct pgtable_entry_t *walk(pagetable_t pagetable, uint64_t va, int32_t alloc);
+struct pgtable_entry_t *walk_level(pagetable_t pagetable, uint64_t va,
+				   int32_t alloc, int32_t *level);
 uintptr_t vaddr2paddr(pagetable_t pagetable, uintptr_t va);
 
 /* === kernel vitual addr space related === */
@@ -68,6 +80,7 @@ void kvminit();
 
 pagetable_t uvmcreate();
 void free_pgtable(pagetable_t pagetable, int32_t layer);
+void uvm_unmap(struct mm_struct *mm, uintptr_t start, uintptr_t end);
 int64_t uvm_space_copy(struct mm_struct *new_mm, struct mm_struct *old_mm);
 struct mm_struct *new_mm_struct();
 void free_mm_struct(struct mm_struct *mm);
@@ -75,6 +88,10 @@ struct vm_area_struct *new_vmarea_struct(uintptr_t _va_start, uintptr_t _va_end,
 					 uint64_t flags, uint64_t pgoff,
 					 struct m_inode_t *inode,
 					 uint64_t _filesz);
+void free_vmarea_struct(struct vm_area_struct *vma);
+struct vm_area_struct *find_vma(struct mm_struct *mm, uintptr_t addr);
+void vma_link(struct mm_struct *mm, struct vm_area_struct *vma);
+void vma_unlink(struct mm_struct *mm, struct vm_area_struct *vma);
 int32_t add_vm_area(struct mm_struct *mm, uintptr_t va_start, uintptr_t va_end,
 		    uint64_t flags, uint64_t pgoff, struct m_inode_t *vm_inode,
 		    uint64_t _filesz);
@@ -99,6 +116,8 @@ int32_t copyin_string(pagetable_t pagetable, char *dst, uintptr_t srcva,
 int32_t copyout(pagetable_t pagetable, void *dstva, void *src, uint64_t len);
 int32_t either_copyin(int32_t user_src, void *dst, void *src, uint64_t len);
 int32_t either_copyout(int32_t user_dst, void *dst, void *src, uint64_t len);
+void *uvm_gift_page(struct mm_struct *mm, uintptr_t va);
+int32_t uvm_accept_page(struct mm_struct *mm, uintptr_t va, void *page);
 
 int64_t sys_brk();
 
@@ -28,6 +28,7 @@ struct proc_t idlepcb = {
 	.ticks = 0,
 	.jiffies = 0,
 	.block_list = {},
+	.ready_node = {},
 	.wait_list = {},
 	.cwd = NULL,
 	.icwd = NULL,
@@ -36,6 +37,7 @@ struct proc_t idlepcb = {
 	.ctxt = {},
 	.tf = NULL,
 	.name = "idleproc",
+	.kthread_fn = NULL,
 	.magic = UNIKS_MAGIC,
 };
 struct spinlock_t pcblock[NPROC];
@@ -49,6 +51,7 @@ struct cpu_t cpus[MAXNUM_HARTID];
 
 struct pids_queue_t pids_queue;
 struct sleep_queue_t sleep_queue;   // call sys_sleep waiting process
+static struct kmem_cache_t *cwd_cachep;	  // PATH_MAX sized cwd strings
 
 extern char trampoline[];
 extern int64_t do_execve(struct proc_t *p, char *pathname, char *argv[],
@@ -132,7 +135,7 @@ static void freeproc(struct proc_t *p)
 	}
 
 	iput(p->icwd);
-	kfree(p->cwd);
+	kmem_cache_free(cwd_cachep, p->cwd);
 
 	if (p->mm->pagetable)
 		free_pgtable(p->mm->pagetable, 0);
@@ -159,13 +162,25 @@ void forkret()
 		first = 0;
 		ext2fs_init(VIRTIO_IRQ);
 		p->icwd = namei(ROOTPATH, 0);
-		assert((p->cwd = kmalloc(PATH_MAX)) != NULL);
+		assert((p->cwd = kmem_cache_alloc(cwd_cachep)) != NULL);
 		strcpy(p->cwd, ROOTPATH);
 	}
 
 	usertrapret();
 }
 
+// a kernel thread's 1st scheduling by scheduler() will swtch to kthreadret
+static void kthreadret()
+{
+	struct proc_t *p = myproc();
+
+	// Still holding p->lock from scheduler.
+	release(&pcblock[p->pid]);
+
+	p->kthread_fn();
+	BUG();
+}
+
 /**
  * @brief allocate a new process and fill the tiny context and return with
  * holding the lock of the new process if allocate a process successfully
@@ -204,6 +219,7 @@ struct proc_t *allocproc()
 	}
 
 	p->state = TASK_INITING;
+	p->host = NULL;
 	p->killed = p->w4child = 0;
 	p->mm->kstack = (uintptr_t)tf + PGSIZE;
 
@@ -215,9 +231,11 @@ struct proc_t *allocproc()
 	memset(&p->ctxt, 0, sizeof(p->ctxt));
 	p->ctxt.ra = (uint64_t)forkret;
 	p->ctxt.sp = p->mm->kstack;
+	p->kthread_fn = NULL;
 	p->magic = UNIKS_MAGIC;
 
 	INIT_LIST_HEAD(&p->block_list);
+	INIT_LIST_HEAD(&p->ready_node);
 	INIT_LIST_HEAD(&p->wait_list);
 	INIT_LIST_HEAD(&p->child_list);
 	INIT_LIST_HEAD(&p->parentp);
@@ -234,6 +252,7 @@ err:
 void proc_init()
 {
 	initlock(&pids_queue.pid_lock, "nextpid");
+	cwd_cachep = kmem_cache_create("cwd", PATH_MAX, 1, NULL);
 	queue_init(&pids_queue.qm, NPROC, pids_queue.pids_queue_array);
 	for (int32_t i = 1; i < NPROC; i++)
 		queue_push_int32type(&pids_queue.qm, i);
@@ -244,44 +263,115 @@ void proc_init()
 
 	FIRST_PROC = &idlepcb;
 
+	for (struct cpu_t *c = cpus; c < &cpus[MAXNUM_HARTID]; c++) {
+		initlock(&c->rq.rq_lock, "runqueue");
+		INIT_LIST_HEAD(&c->rq.ready_list);
+		c->rq.nr_ready = 0;
+	}
+
 	initlock(&sleep_queue.sleep_lock, "sleeplock");
 	initlock(&wait_lock, "waitlock");
 	priority_queue_init(&sleep_queue.pqm, NPROC,
 			    &sleep_queue.sleep_queue_array);
 }
 
+/**
+ * @brief Mark `p` as TASK_READY and queue it on the run queue of the hart it
+ * last ran on (or of the current hart for a process that never ran). Waking an
+ * already ready process is a no-op, so callers need not track whether someone
+ * else woke it first. pcblock[p->pid] must be held.
+ * @param p
+ */
+void proc_ready(struct proc_t *p)
+{
+	assert(holding(&pcblock[p->pid]));
+	if (p->state == TASK_READY)
+		return;
+	p->state = TASK_READY;
+
+	struct runqueue_t *rq = (p->host != NULL) ? &p->host->rq : &mycpu()->rq;
+	acquire(&rq->rq_lock);
+	list_add_tail(&p->ready_node, &rq->ready_list);
+	rq->nr_ready++;
+	release(&rq->rq_lock);
+}
+
+/**
+ * @brief Take a process off `rq`: the oldest one for the owner hart, the newest
+ * (most likely cache cold on its owner anyway) for a stealing hart. Returns
+ * NULL if `rq` is empty.
+ * @param rq
+ * @param steal
+ * @return struct proc_t*
+ */
+static struct proc_t *rq_dequeue(struct runqueue_t *rq, int32_t steal)
+{
+	struct proc_t *p = NULL;
+	struct list_node_t *node;
+
+	if (rq->nr_ready == 0)
+		return NULL;
+
+	acquire(&rq->rq_lock);
+	if (!list_empty(&rq->ready_list)) {
+		node = steal ? list_prev_then_del(&rq->ready_list)
+			     : list_next_then_del(&rq->ready_list);
+		INIT_LIST_HEAD(node);
+		p = element_entry(node, struct proc_t, ready_node);
+		rq->nr_ready--;
+	}
+	release(&rq->rq_lock);
+
+	return p;
+}
+
+// An idle hart steals from the peer with the longest run queue.
+static struct proc_t *rq_steal(struct cpu_t *c)
+{
+	struct cpu_t *victim = NULL;
+	uint32_t most = 0;
+
+	for (struct cpu_t *peer = cpus; peer < &cpus[MAXNUM_HARTID]; peer++) {
+		if (peer != c and peer->rq.nr_ready > most) {
+			most = peer->rq.nr_ready;
+			victim = peer;
+		}
+	}
+
+	return (victim != NULL) ? rq_dequeue(&victim->rq, 1) : NULL;
+}
+
 // each hart will hold its local scheduler context
 __noreturn void scheduler(struct cpu_t *c)
 {
 	while (1) {
-		int32_t i = 1;
-		for (struct proc_t *p; i < NPROC; i++) {
-			acquire(&pcblock[i]);
-			if ((p = pcbtable[i]) == NULL) {
-				release(&pcblock[i]);
-				continue;
-			}
-			// tracef("idle process running");
-			if (p->state == TASK_READY) {
-				tracef("switch to: %d\n", p->pid);
-				/**
-				 * @brief switch to chosen process. it is the
-				 * process's job to release its lock and then
-				 * reacquire it before jumping back to us (in
-				 * yield())
-				 */
-				c->proc = p;
-				p->state = TASK_RUNNING;
-				p->host = c;
-				switch_to(&c->ctxt, &p->ctxt);
-				/**
-				 * @brief process is done running for now since
-				 * timer interrupt
-				 */
-				c->proc = FIRST_PROC;
-			}
-			release(&pcblock[p->pid]);
+		struct proc_t *p = rq_dequeue(&c->rq, 0);
+		if (p == NULL and (p = rq_steal(c)) == NULL) {
+			// nothing to run, get pages zeroed for later instead
+			zero_pool_refill();
+			continue;
 		}
+
+		/**
+		 * @brief a dequeued process stays TASK_READY until we get its
+		 * lock: it is on no run queue, so nobody else can pick it, and
+		 * only blocked processes are woken up.
+		 */
+		acquire(&pcblock[p->pid]);
+		assert(p->state == TASK_READY);
+		tracef("switch to: %d\n", p->pid);
+		/**
+		 * @brief switch to chosen process. it is the process's job to
+		 * release its lock and then reacquire it before jumping back to
+		 * us (in yield())
+		 */
+		c->proc = p;
+		p->state = TASK_RUNNING;
+		p->host = c;
+		switch_to(&c->ctxt, &p->ctxt);
+		// process is done running for now since timer interrupt
+		c->proc = FIRST_PROC;
+		release(&pcblock[p->pid]);
 	}
 }
 
@@ -350,7 +440,7 @@ void yield()
 {
 	struct proc_t *p = myproc();
 	assert(holding(&pcblock[p->pid]));
-	p->state = TASK_READY;
+	proc_ready(p);
 	sched();
 	release(&pcblock[p->pid]);
 }
@@ -406,7 +496,7 @@ int32_t proc_unblock_all(struct list_node_t *wait_list)
 		acquire(&pcblock[p->pid]);
 		assert(p->state == TASK_BLOCK);
 		assert(p != myproc());
-		p->state = TASK_READY;
+		proc_ready(p);
 		release(&pcblock[p->pid]);
 		tot++;
 	}
@@ -426,7 +516,7 @@ void time_wakeup()
 		acquire(&pcblock[p->pid]);
 		assert(p->state == TASK_BLOCK);
 		assert(p != myproc());
-		p->state = TASK_READY;
+		proc_ready(p);
 		release(&pcblock[p->pid]);
 
 		priority_queue_pop(&sleep_queue.pqm);
@@ -473,7 +563,7 @@ void user_init(uint32_t priority)
 	assert(p != NULL);
 	assert(p->pid == 1);
 	p->parentpid = 0;
-	p->state = TASK_READY;
+	proc_ready(p);
 	p->ticks = p->priority = priority;
 	p->name = "initrc";
 
@@ -493,6 +583,36 @@ void user_init(uint32_t priority)
 	p->tf->epc = INITSTART;
 }
 
+/**
+ * @brief Create a kernel thread running `fn` in S mode on its own kstack. It
+ * never returns to user space, so it is never preempted and must give up the
+ * CPU by blocking; `fn` must not return.
+ * @param fn
+ * @param name
+ * @return struct proc_t*
+ */
+struct proc_t *kthread_create(void (*fn)(), char *name)
+{
+	struct proc_t *p = allocproc();
+	if (p == NULL)
+		return NULL;
+
+	p->parentpid = 0;
+	p->ctxt.ra = (uint64_t)kthreadret;
+	p->kthread_fn = fn;
+	p->ticks = p->priority = 1;
+	p->jiffies = 0;
+	p->name = name;
+	p->cwd = NULL;
+	p->icwd = NULL;
+	for (int32_t fd = 0; fd < NFD; fd++)
+		p->fdtable[fd] = -1;
+	proc_ready(p);
+	release(&pcblock[p->pid]);
+
+	return p;
+}
+
 
 /* === process relative syscall === */
 
@@ -514,7 +634,7 @@ int64_t do_fork()
 	for (int32_t i = 0; i < NFD; i++)
 		childproc->fdtable[i] = file_dup(parentproc->fdtable[i]);
 	childproc->icwd = idup(parentproc->icwd);
-	childproc->cwd = kmalloc(PATH_MAX);
+	childproc->cwd = kmem_cache_alloc(cwd_cachep);
 	strcpy(childproc->cwd, parentproc->cwd);
 
 	acquire(&wait_lock);
@@ -522,13 +642,13 @@ int64_t do_fork()
 	list_add_front(&childproc->parentp, &parentproc->child_list);
 	release(&wait_lock);
 
-	childproc->state = TASK_READY;
 	childproc->jiffies = parentproc->jiffies;
 	childproc->ticks = parentproc->ticks;
 	childproc->priority = parentproc->priority;
 
 	childproc->name = kmalloc(EXT2_NAME_LEN);
 	strcpy(childproc->name, parentproc->name);
+	proc_ready(childproc);
 
 	release(&pcblock[childproc->pid]);
 	assert(parentproc->magic == UNIKS_MAGIC);
@@ -551,10 +671,8 @@ void reparent(struct proc_t *p)
 		list_add_front(childn, &INIT_PROC->child_list);
 		childp->parentpid = INIT_PROC->pid;
 		release(&pcblock[childp->pid]);
-		if (INIT_PROC->w4child == 1) {
-			assert(INIT_PROC->state = TASK_BLOCK);
-			INIT_PROC->state = TASK_READY;
-		}
+		if (INIT_PROC->w4child == 1)
+			proc_ready(INIT_PROC);
 		release(&pcblock[INIT_PROC->pid]);
 	}
 }
@@ -602,10 +720,8 @@ void do_exit(int32_t status)
 		struct proc_t *parentp = pcbtable[p->parentpid];
 		acquire(&pcblock[parentp->pid]);
 		assert(p->parentpid == parentp->pid);
-		if (parentp->w4child == 1) {
-			assert(parentp->state = TASK_BLOCK);
-			parentp->state = TASK_READY;
-		}
+		if (parentp->w4child == 1)
+			proc_ready(parentp);
 		release(&pcblock[parentp->pid]);
 	}
 
@@ -95,6 +95,7 @@ struct proc_t {
 	uint32_t ticks;		 // remainder time slices
 	uint32_t jiffies;	 // global time slice when last execution
 	struct list_node_t block_list;	 // block list of this process
+	struct list_node_t ready_node;	 // linked in a hart's run queue
 	struct list_node_t wait_list;	 // who wait for this process to exit
 
 	// wait_lock must be held when using this:
@@ -137,16 +138,30 @@ struct proc_t {
 	 */
 	struct trapframe_t *tf;
 	char *name;   // elf file name corresponding to this process
+	void (*kthread_fn)();	// body of a kernel thread, NULL for user ones
 
 	uint32_t magic;	  // magic number as canary to determine stackoverflow
 };
 
+/**
+ * @brief Per-hart queue of TASK_READY processes. A process is linked here
+ * through its `ready_node` from the moment it becomes ready until a scheduler
+ * picks it, so choosing the next process never scans the pcbtable.
+ */
+struct runqueue_t {
+	struct spinlock_t rq_lock;
+	struct list_node_t ready_list;
+	// peeked without the lock to keep idle harts off busy run queues
+	volatile uint32_t nr_ready;
+};
+
 struct cpu_t {
 	uint32_t hartid;
 	struct proc_t *proc;   // which process is running on this cpu, or null
 	struct context_t ctxt;	 // swtch() here to enter scheduler()
 	uint32_t repeat;	 // reacquire lock times per-cpu
 	uint64_t preintstat;   // pre-interrupt enabled status before push_off()
+	struct runqueue_t rq;	// ready processes preferring this hart
 };
 
 struct pids_queue_t {
@@ -177,7 +192,9 @@ void sched();
 void switch_to(struct context_t *old, struct context_t *new);
 void proc_init();
 void user_init(uint32_t priority);
+struct proc_t *kthread_create(void (*fn)(), char *name);
 void yield();
+void proc_ready(struct proc_t *p);
 void time_wakeup();
 void setkilled(struct proc_t *p);
 int32_t killed(struct proc_t *);
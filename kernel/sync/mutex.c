@@ -32,6 +32,19 @@ void mutex_acquire(struct mutex_t *m)
 	release(&m->lk);
 }
 
+// Take the mutex only if nobody holds it. Returns 1 on success, otherwise 0.
+int32_t mutex_tryacquire(struct mutex_t *m)
+{
+	int32_t res = 0;
+	acquire(&m->lk);
+	if (!m->locked) {
+		m->locked = res = 1;
+		m->pid = myproc()->pid;
+	}
+	release(&m->lk);
+	return res;
+}
+
 void mutex_release(struct mutex_t *m)
 {
 	assert(mutex_holding(m));   // ensure that this mutex had been held
@@ -21,6 +21,7 @@ struct mutex_t {
 void mutex_init(struct mutex_t *m, char *name);
 int32_t mutex_holding(struct mutex_t *m);
 void mutex_acquire(struct mutex_t *m);
+int32_t mutex_tryacquire(struct mutex_t *m);
 void mutex_release(struct mutex_t *m);
 
 
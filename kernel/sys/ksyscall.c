@@ -89,6 +89,9 @@ extern int64_t sys_readlink();
 extern int64_t sys_chmod();
 extern int64_t sys_sync();
 extern int64_t sys_shutdown();
+extern int64_t sys_mmap();
+extern int64_t sys_munmap();
+extern int64_t sys_msync();
 
 static int64_t (*syscalls[])() = {
 	[SYS_fork] sys_fork,	 [SYS_execve] sys_execve,
@@ -106,6 +109,8 @@ static int64_t (*syscalls[])() = {
 	[SYS_creat] sys_creat,	 [SYS_truncate] sys_truncate,
 	[SYS_chmod] sys_chmod,	 [SYS_unlink] sys_unlink,
 	[SYS_link] sys_link,	 [SYS_rmdir] sys_rmdir,
+	[SYS_mmap] sys_mmap,	 [SYS_munmap] sys_munmap,
+	[SYS_msync] sys_msync,
 };
 
 #define NUM_SYSCALLS ((sizeof(syscalls)) / (sizeof(syscalls[0])))
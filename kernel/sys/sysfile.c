@@ -234,6 +234,7 @@ int64_t sys_open()
 	f->f_flags = flags;
 	f->f_count++;
 	f->f_inode = inode;
+	f->f_ra = (struct file_ra_t){0};
 	if (get_var_bit(flags, O_APPEND)) {   // append mode
 		ilock(inode);
 		f->f_pos = inode->d_inode_ctnt.i_size;
@@ -521,10 +522,20 @@ ret2:
 	return res;
 }
 
+// Hand the `n` bytes of dirents staged in `stage` out to user `buf`.
+static int32_t dirents_copyout(struct proc_t *p, uintptr_t buf, char *stage,
+			       int32_t n)
+{
+	if (verify_area(p->mm, buf, n, PTE_R | PTE_W | PTE_U) < 0)
+		return -1;
+	assert(copyout(p->mm->pagetable, (void *)buf, stage, n) != -1);
+	return 0;
+}
+
 // `long getdents(int fd, struct dirent *dirp, size_t count);`
 int64_t sys_getdents()
 {
-	int32_t res = 0, entrylen;
+	int32_t res = 0, entrylen, n = 0, err = 0;
 	struct proc_t *p = myproc();
 
 	int32_t fd = argufetch(p, 0);
@@ -541,24 +552,65 @@ int64_t sys_getdents()
 
 	uintptr_t buf = argufetch(p, 1);
 	size_t nbytes = argufetch(p, 2);
-	char tmp_de[EXT2_DIRENTRY_MAXSIZE + 1];
-	struct ext2_dir_entry_t *de = (struct ext2_dir_entry_t *)tmp_de;
-	while (res < nbytes) {
-		if (!readi(inode, 0, tmp_de, f->f_pos, EXT2_DIRENTRY_MAXSIZE))
-			break;
-		entrylen = sizeof(struct ext2_dir_entry_t) + de->name_len;
-		entrylen = alignaddr_up(entrylen + 1, 4);
-		if (verify_area(p->mm, buf, entrylen, PTE_R | PTE_W | PTE_U) <
-		    0)
-			break;
-		de->name[de->name_len] = '\0';
-		f->f_pos += de->rec_len;
-		de->rec_len = entrylen;
-		assert(copyout(p->mm->pagetable, (void *)buf, tmp_de,
-			       entrylen) != -1);
-		res += entrylen;
-		buf += entrylen;
+	/**
+	 * @brief The entries of one pinned block are packed into `stage` and
+	 * go out to the user in one copy; `pos` is where the walk resumes once
+	 * they are out. The copy may fault, sleep and lock other inodes, so the
+	 * walk is ended around it, lest it hold the block locked and keep a
+	 * sync() waiting meanwhile.
+	 */
+	char *stage = kmalloc(BLKSIZE);
+	if (stage == NULL) {
+		res = -ENOMEM;
+		goto ret;
 	}
+	uint64_t pos = f->f_pos;
+	uint32_t blk_no = 0;
+	struct ext2_dir_entry_t *de, *out;
+	struct dir_iter_t it;
+
+	dir_iter_init(&it, inode, f->f_pos);
+	while ((de = dir_iter_next(&it)) != NULL) {
+		entrylen = 0;
+		if (de->inode != 0)
+			entrylen = alignaddr_up(sizeof(*de) + de->name_len + 1,
+						4);
+		if (res + n + entrylen > nbytes)
+			break;
+		if (n > 0 and (it.blk_no != blk_no or n + entrylen > BLKSIZE)) {
+			dir_iter_end(&it);
+			err = dirents_copyout(p, buf, stage, n);
+			dir_iter_init(&it, inode, pos);
+			if (err < 0)
+				break;
+			f->f_pos = pos;
+			res += n;
+			buf += n;
+			n = 0;
+			continue;   // `de` went with its block, step to it again
+		}
+		pos = it.off + de->rec_len;
+		blk_no = it.blk_no;
+		if (entrylen == 0)
+			continue;
+		out = (struct ext2_dir_entry_t *)(stage + n);
+		memcpy(out, de, sizeof(*de) + de->name_len);
+		out->name[out->name_len] = '\0';
+		out->rec_len = entrylen;
+		n += entrylen;
+	}
+	dir_iter_end(&it);
+
+	if (err == 0 and n > 0)
+		err = dirents_copyout(p, buf, stage, n);
+	if (err == 0) {
+		f->f_pos = pos;
+		res += n;
+	}
+	if (res == 0 and de != NULL)
+		// the buffer is bad or too small for the next entry
+		res = err < 0 ? -EFAULT : -EINVAL;
+	kfree(stage);
 
 ret:
 	iunlock(inode);
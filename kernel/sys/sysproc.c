@@ -1,7 +1,9 @@
 #include <device/blkbuf.h>
 #include <device/clock.h>
 #include <file/file.h>
+#include <fs/dcache.h>
 #include <loader/elfloader.h>
+#include <mm/filemap.h>
 #include <mm/vm.h>
 #include <platform/sbi.h>
 #include <process/proc.h>
@@ -177,6 +179,10 @@ void sys_shutdown()
 {
 	sync_sb_and_gdt();
 	blk_sync_all(1);
+	blk_stat();
+	pages_stat();
+	filemap_stat();
+	dcache_stat();
 	sbi_shutdown();
 }
 
@@ -193,7 +199,7 @@ int64_t sys_kill()
 
 		p->killed = 1;
 		if (p->state == TASK_BLOCK)
-			p->state = TASK_READY;
+			proc_ready(p);
 		release(&pcblock[target_pid]);
 		return 0;
 	}
@@ -1,6 +1,7 @@
 #include "trap.h"
 #include <device/clock.h>
 #include <mm/memlay.h>
+#include <mm/tlb.h>
 #include <mm/vm.h>
 #include <platform/plic.h>
 #include <platform/riscv.h>
@@ -132,7 +133,8 @@ void usertrapret()
 	write_csr(sepc, p->tf->epc);
 
 	// tell trampoline.S the user page table to switch to.
-	uint64_t satp = MAKE_SATP(p->mm->pagetable, p->pid);
+	uint64_t satp = MAKE_SATP(p->mm->pagetable, p->mm->asid);
+	tlb_mm_enter(p->mm);
 
 	// jmp to userret in trampoline.S
 	((void (*)(uint64_t))trampoline_usertrapret)(satp);
@@ -154,6 +156,7 @@ void usertrap_handler()
 	write_csr(stvec, &kerneltrapvec);
 
 	struct proc_t *p = myproc();
+	tlb_mm_leave(p->mm);
 	p->tf->epc = read_csr(sepc);   // save user's pc
 
 	int64_t cause = read_csr(scause), stval = read_csr(stval);
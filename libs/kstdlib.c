@@ -23,3 +23,21 @@ uintptr_t alignaddr_down(uintptr_t addr, size_t alignment)
 	} else
 		return addr;
 }
+
+/**
+ * @brief Count the trailing zeros of a non-zero `x`. rv64g has no instruction
+ * for it and no libgcc is linked, so the lowest set bit is looked up through a
+ * de Bruijn sequence.
+ * @param x
+ * @return int32_t
+ */
+int32_t ctz64(uint64_t x)
+{
+	static const int8_t debruijn_idx[64] = {
+		0,  1,	48, 2,	57, 49, 28, 3,	61, 58, 50, 42, 38, 29, 17, 4,
+		62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5,
+		63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+		46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9,	13, 8,	7,  6,
+	};
+	return debruijn_idx[((x & -x) * 0x03f79d71b4cb0a89ull) >> 58];
+}
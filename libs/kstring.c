@@ -53,37 +53,113 @@ int32_t strncmp(const char *s1, const char *s2, size_t n)
 	return (n == 0) ? 0 : (int)((uint8_t)*s1 - (uint8_t)*s2);
 }
 
-void *memset(void *s, char c, size_t n)
+/**
+ * @brief The word-at-a-time kernels below move 8 bytes per access once `dst`
+ * (and `src`) are aligned, with bytewise head and tail. When the two pointers
+ * disagree on their alignment, they fall back to bytes, since misaligned word
+ * accesses trap into the SBI to be emulated. The RVV kernels in kstring_rvv.S
+ * take any alignment, and memset()/memcpy()/memcmp() hand them the calls long
+ * enough to pay for turning the vector unit on, when the harts have one.
+ */
+#define WSIZE	    (sizeof(word_t))
+#define WMASK	    (WSIZE - 1)
+#define RVV_THRESH  (64)
+
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+int32_t kstring_rvv = 0;   // use the RVV kernels?
+
+void kstring_init(int32_t rvv)
 {
-	char *p = s;
-	while (n-- > 0) {
+	kstring_rvv = rvv;
+}
+
+void *memset_word(void *s, char c, size_t n)
+{
+	uint8_t *p = s;
+	word_t w = (uint8_t)c * 0x0101010101010101ull;
+
+	for (; n > 0 and ((uintptr_t)p & WMASK); n--)
 		*p++ = c;
+	for (; n >= 4 * WSIZE; n -= 4 * WSIZE, p += 4 * WSIZE) {
+		((word_t *)p)[0] = w;
+		((word_t *)p)[1] = w;
+		((word_t *)p)[2] = w;
+		((word_t *)p)[3] = w;
 	}
+	for (; n >= WSIZE; n -= WSIZE, p += WSIZE)
+		*(word_t *)p = w;
+	for (; n > 0; n--)
+		*p++ = c;
 	return s;
 }
 
-void *memcpy(void *dst, const void *src, size_t n)
+void *memcpy_word(void *dst, const void *src, size_t n)
 {
-	const char *s = src;
-	char *d = dst;
-	while (n-- > 0) {
-		*d++ = *s++;
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+
+	if ((((uintptr_t)d ^ (uintptr_t)s) & WMASK) == 0) {
+		for (; n > 0 and ((uintptr_t)d & WMASK); n--)
+			*d++ = *s++;
+		for (; n >= 4 * WSIZE; n -= 4 * WSIZE) {
+			((word_t *)d)[0] = ((const word_t *)s)[0];
+			((word_t *)d)[1] = ((const word_t *)s)[1];
+			((word_t *)d)[2] = ((const word_t *)s)[2];
+			((word_t *)d)[3] = ((const word_t *)s)[3];
+			d += 4 * WSIZE, s += 4 * WSIZE;
+		}
+		for (; n >= WSIZE; n -= WSIZE, d += WSIZE, s += WSIZE)
+			*(word_t *)d = *(const word_t *)s;
 	}
+	for (; n > 0; n--)
+		*d++ = *s++;
 	return dst;
 }
 
-int32_t memcmp(const void *v1, const void *v2, size_t n)
+int32_t memcmp_word(const void *v1, const void *v2, size_t n)
 {
-	const char *s1 = (const char *)v1;
-	const char *s2 = (const char *)v2;
-	while (n-- > 0) {
+	const uint8_t *s1 = v1;
+	const uint8_t *s2 = v2;
+
+	if ((((uintptr_t)s1 ^ (uintptr_t)s2) & WMASK) == 0) {
+		for (; n > 0 and ((uintptr_t)s1 & WMASK); n--, s1++, s2++) {
+			if (*s1 != *s2)
+				return (int32_t)(*s1 - *s2);
+		}
+		// the bytewise loop below locates the first differing byte
+		for (; n >= WSIZE and *(const word_t *)s1 == *(const word_t *)s2;
+		     n -= WSIZE, s1 += WSIZE, s2 += WSIZE)
+			;
+	}
+	for (; n > 0; n--, s1++, s2++) {
 		if (*s1 != *s2)
-			return (int32_t)((uint8_t)*s1 - (uint8_t)*s2);
-		s1++, s2++;
+			return (int32_t)(*s1 - *s2);
 	}
 	return 0;
 }
 
+void *memset(void *s, char c, size_t n)
+{
+	if (kstring_rvv and n >= RVV_THRESH)
+		return memset_rvv(s, c, n);
+	return memset_word(s, c, n);
+}
+
+void *memcpy(void *dst, const void *src, size_t n)
+{
+	if (kstring_rvv and n >= RVV_THRESH)
+		return memcpy_rvv(dst, src, n);
+	return memcpy_word(dst, src, n);
+}
+
+int32_t memcmp(const void *v1, const void *v2, size_t n)
+{
+	if (kstring_rvv and n >= RVV_THRESH)
+		return memcmp_rvv(v1, v2, n);
+	return memcmp_word(v1, v2, n);
+}
+
 int32_t is_separator(char c, const char *tok)
 {
 	for (; *tok; tok++) {
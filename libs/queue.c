@@ -1,4 +1,5 @@
 #include <uniks/queue.h>
+#include <uniks/kstdlib.h>
 
 
 void queue_init(struct queue_meta_t *q, int32_t capacity, void *heap_addr)
@@ -65,4 +66,36 @@ void queue_back_pop(struct queue_meta_t *q)
 	if (q->queue_tail <= 0)
 		q->queue_tail += q->queue_capacity;
 	q->queue_size--;
-}
\ No newline at end of file
+}
+char *queue_back_run_chartype(struct queue_meta_t *q, int32_t *len)
+{
+	int32_t next = q->queue_tail + 1;
+	if (next >= q->queue_capacity)
+		next -= q->queue_capacity;
+	*len = MIN(q->queue_capacity - q->queue_size, q->queue_capacity - next);
+	return &q->queue_array_chartype[next];
+}
+
+void queue_push_n(struct queue_meta_t *q, int32_t n)
+{
+	assert(n <= q->queue_capacity - q->queue_size);
+	q->queue_tail += n;
+	if (q->queue_tail >= q->queue_capacity)
+		q->queue_tail -= q->queue_capacity;
+	q->queue_size += n;
+}
+
+char *queue_front_run_chartype(struct queue_meta_t *q, int32_t *len)
+{
+	*len = MIN(q->queue_size, q->queue_capacity - q->queue_head);
+	return &q->queue_array_chartype[q->queue_head];
+}
+
+void queue_front_pop_n(struct queue_meta_t *q, int32_t n)
+{
+	assert(n <= q->queue_size);
+	q->queue_head += n;
+	if (q->queue_head >= q->queue_capacity)
+		q->queue_head -= q->queue_capacity;
+	q->queue_size -= n;
+}
@@ -0,0 +1,194 @@
+#include <uniks/kstdlib.h>
+#include <uniks/rbtree.h>
+
+
+#define rb_is_black(node) ((node) == NULL or (node)->color == RB_BLACK)
+
+// make `new` take the place of `old` below old's parent
+__always_inline static void rb_replace_child(struct rb_node_t *old,
+					     struct rb_node_t *new,
+					     struct rb_node_t *parent,
+					     struct rb_root_t *root)
+{
+	if (parent == NULL)
+		root->node = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+}
+
+static void rb_rotate_left(struct rb_node_t *node, struct rb_root_t *root)
+{
+	struct rb_node_t *right = node->right;
+
+	if ((node->right = right->left) != NULL)
+		right->left->parent = node;
+	right->left = node;
+	right->parent = node->parent;
+	rb_replace_child(node, right, node->parent, root);
+	node->parent = right;
+}
+
+static void rb_rotate_right(struct rb_node_t *node, struct rb_root_t *root)
+{
+	struct rb_node_t *left = node->left;
+
+	if ((node->left = left->right) != NULL)
+		left->right->parent = node;
+	left->right = node;
+	left->parent = node->parent;
+	rb_replace_child(node, left, node->parent, root);
+	node->parent = left;
+}
+
+void rb_insert_color(struct rb_node_t *node, struct rb_root_t *root)
+{
+	struct rb_node_t *parent, *gparent, *uncle;
+
+	while ((parent = node->parent) != NULL and parent->color == RB_RED) {
+		// a red node is never the root, so there is a grandparent
+		gparent = parent->parent;
+		if (parent == gparent->left) {
+			uncle = gparent->right;
+			if (!rb_is_black(uncle)) {
+				uncle->color = parent->color = RB_BLACK;
+				gparent->color = RB_RED;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->right) {
+				rb_rotate_left(parent, root);
+				SWAP(parent, node);
+			}
+			parent->color = RB_BLACK;
+			gparent->color = RB_RED;
+			rb_rotate_right(gparent, root);
+		} else {
+			uncle = gparent->left;
+			if (!rb_is_black(uncle)) {
+				uncle->color = parent->color = RB_BLACK;
+				gparent->color = RB_RED;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->left) {
+				rb_rotate_right(parent, root);
+				SWAP(parent, node);
+			}
+			parent->color = RB_BLACK;
+			gparent->color = RB_RED;
+			rb_rotate_left(gparent, root);
+		}
+	}
+
+	root->node->color = RB_BLACK;
+}
+
+// restore the black heights after a black node left from below `parent`
+static void rb_erase_color(struct rb_node_t *node, struct rb_node_t *parent,
+			   struct rb_root_t *root)
+{
+	struct rb_node_t *other;
+
+	while (rb_is_black(node) and node != root->node) {
+		if (parent->left == node) {
+			other = parent->right;
+			if (other->color == RB_RED) {
+				other->color = RB_BLACK;
+				parent->color = RB_RED;
+				rb_rotate_left(parent, root);
+				other = parent->right;
+			}
+			if (rb_is_black(other->left) and
+			    rb_is_black(other->right)) {
+				other->color = RB_RED;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (rb_is_black(other->right)) {
+				other->left->color = RB_BLACK;
+				other->color = RB_RED;
+				rb_rotate_right(other, root);
+				other = parent->right;
+			}
+			other->color = parent->color;
+			parent->color = RB_BLACK;
+			other->right->color = RB_BLACK;
+			rb_rotate_left(parent, root);
+		} else {
+			other = parent->left;
+			if (other->color == RB_RED) {
+				other->color = RB_BLACK;
+				parent->color = RB_RED;
+				rb_rotate_right(parent, root);
+				other = parent->left;
+			}
+			if (rb_is_black(other->left) and
+			    rb_is_black(other->right)) {
+				other->color = RB_RED;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (rb_is_black(other->left)) {
+				other->right->color = RB_BLACK;
+				other->color = RB_RED;
+				rb_rotate_left(other, root);
+				other = parent->left;
+			}
+			other->color = parent->color;
+			parent->color = RB_BLACK;
+			other->left->color = RB_BLACK;
+			rb_rotate_right(parent, root);
+		}
+		node = root->node;
+		break;
+	}
+
+	if (node != NULL)
+		node->color = RB_BLACK;
+}
+
+void rb_erase(struct rb_node_t *node, struct rb_root_t *root)
+{
+	struct rb_node_t *child, *parent;
+	int32_t color;
+
+	if (node->left == NULL or node->right == NULL) {
+		child = node->left ? node->left : node->right;
+		parent = node->parent;
+		color = node->color;
+		if (child != NULL)
+			child->parent = parent;
+		rb_replace_child(node, child, parent, root);
+	} else {
+		// the successor of node, which has no left child, takes its place
+		struct rb_node_t *old = node;
+		node = node->right;
+		while (node->left != NULL)
+			node = node->left;
+		rb_replace_child(old, node, old->parent, root);
+
+		child = node->right;
+		parent = node->parent;
+		color = node->color;
+		if (parent == old)
+			parent = node;
+		else {
+			if (child != NULL)
+				child->parent = parent;
+			parent->left = child;
+			node->right = old->right;
+			old->right->parent = node;
+		}
+		node->parent = old->parent;
+		node->color = old->color;
+		node->left = old->left;
+		old->left->parent = node;
+	}
+
+	if (color == RB_BLACK)
+		rb_erase_color(child, parent, root);
+}
@@ -83,6 +83,8 @@
 #define SSTATUS_UPIE (0x00000010)
 #define SSTATUS_SPIE (0x00000020)
 #define SSTATUS_SPP  (0x00000100)
+#define SSTATUS_VS   (0x00000600)   // vector unit state
+#define SSTATUS_VS_INITIAL (0x00000200)
 
 
 struct pgtable_entry_t {
@@ -103,7 +105,7 @@ struct pgtable_entry_t {
 	union {
 		struct {
 			uint8_t unrelease : 1;
-			uint8_t RSW : 1;
+			uint8_t shared : 1;	// RSW: never copy on write
 			uintptr_t ppn0 : 9;
 			uintptr_t ppn1 : 9;
 			uintptr_t ppn2 : 26;
@@ -127,6 +129,7 @@ struct pgtable_entry_t {
 #define PTE_G	  (1 << 5)
 #define PTE_A	  (1 << 6)
 #define PTE_D	  (1 << 7)
+#define PTE_SHARED (1 << 9)   // the `shared` bit in RSW, see MAP_SHARED
 #define SATP_SV39 (8ll << 60)	// RISCV Sv39 page table scheme
 #define PTENUM	  (PGSIZE / sizeof(pte_t))
 #define MAKE_SATP(pagetable, ASID) \
@@ -138,6 +141,8 @@ struct pgtable_entry_t {
 #define PXSHIFT(level) (PGSHIFT + (9 * (level)))
 #define PX(level, va)  get_var_bit(((uint64_t)(va)) >> PXSHIFT(level), 0x1ff)
 #define PTE_FLAGS(pte) get_var_bit(*(uint64_t *)pte, 0x3ff)
+// a valid pte with any of R/W/X maps memory, otherwise it points to a table
+#define PTE_LEAF(pte)  get_var_bit((pte)->perm, PTE_R | PTE_W | PTE_X)
 
 
 #define cpuid() \
@@ -169,6 +174,16 @@ __always_inline uint64_t interrupt_get()
 	return read_csr(sstatus);
 }
 
+/**
+ * @brief Turn this hart's vector unit on. sstatus.VS stays read-only zero on a
+ * hart without the V extension, so reading it back tells whether there is one.
+ */
+__always_inline int32_t vector_enable()
+{
+	set_csr(sstatus, SSTATUS_VS_INITIAL);
+	return get_var_bit(read_csr(sstatus), SSTATUS_VS) != 0;
+}
+
 // set device interrupts enabled status to a specific value
 __always_inline void interrupt_set(uint64_t val)
 {
@@ -202,7 +217,7 @@ __always_inline void all_interrupt_enable()
 
 __always_inline void invalidate(uintptr_t va)
 {
-	asm volatile("sfence.vma %0, zero\n\tnop" : "=r"(va));
+	asm volatile("sfence.vma %0, zero\n\tnop" : : "r"(va));
 }
 
 
@@ -58,4 +58,27 @@ struct sbiretv_t sbi_hart_start(uint64_t hartid, uint64_t start_addr,
 	register uint64_t a1 asm("a1");
 	struct sbiretv_t sr = {a0, a1};
 	return sr;
+}
+
+/**
+ * @brief Have the harts in hart_mask flush their TLB entries of asid covering
+ * [start, start + size), all of them if size is (size_t)-1. sbi_call() has no
+ * room for the 5 arguments of this one.
+ * @return int64_t: SBI error code
+ */
+int64_t sbi_remote_sfence_vma_asid(uint64_t hart_mask, uintptr_t start,
+				   size_t size, uint64_t asid)
+{
+	register uint64_t a0 asm("a0") = hart_mask;
+	register uint64_t a1 asm("a1") = 0;   // hart_mask_base
+	register uint64_t a2 asm("a2") = start;
+	register uint64_t a3 asm("a3") = size;
+	register uint64_t a4 asm("a4") = asid;
+	register uint64_t a6 asm("a6") = REMOTE_SFENCE_VMA_ASID;
+	register uint64_t a7 asm("a7") = SBI_RFENCE;
+	asm volatile("ecall"
+		     : "+r"(a0), "+r"(a1)
+		     : "r"(a2), "r"(a3), "r"(a4), "r"(a6), "r"(a7)
+		     : "memory");
+	return a0;
 }
\ No newline at end of file
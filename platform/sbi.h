@@ -13,9 +13,12 @@
 #define SBI_SEND_IPI	    4
 #define SBI_SHUTDOWN	    8
 #define SBI_HSM		    0x48534D
+#define SBI_RFENCE	    0x52464E43
 
 // SBI FID number belong SBI_HSM
 #define HART_START 0
+// SBI FID number belong SBI_RFENCE
+#define REMOTE_SFENCE_VMA_ASID 2
 
 
 struct sbiretv_t {
@@ -30,6 +33,8 @@ int64_t sbi_console_getchar();
 void sbi_shutdown();
 struct sbiretv_t sbi_hart_start(uint64_t hartid, uint64_t start_addr,
 				uint64_t opaque);
+int64_t sbi_remote_sfence_vma_asid(uint64_t hart_mask, uintptr_t start,
+				   size_t size, uint64_t asid);
 
 
 #endif /* !__KERNEL_PLATFORM_SBI_H__ */
\ No newline at end of file
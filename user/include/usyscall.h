@@ -86,6 +86,10 @@ int stat(const char *pathname, struct stat *statbuf);
 int fstat(int fd, struct stat *statbuf);
 int lstat(const char *pathname, struct stat *statbuf);
 char *getcwd(char *buf, size_t size);
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+	   long offset);
+int munmap(void *addr, size_t length);
+int msync(void *addr, size_t length, int flags);
 
 #endif
 
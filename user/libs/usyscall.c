@@ -1,5 +1,6 @@
 #include <stdarg.h>
 #include <ufcntl.h>
+#include <umman.h>
 #include <usyscall.h>
 
 
@@ -175,3 +176,19 @@ char *getcwd(char *buf, size_t size)
 {
 	return (char *)syscall(SYS_getcwd, buf, size);
 }
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, long offset)
+{
+	long res = syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+	return res < 0 ? MAP_FAILED : (void *)res;
+}
+
+int munmap(void *addr, size_t length)
+{
+	return syscall(SYS_munmap, addr, length);
+}
+
+int msync(void *addr, size_t length, int flags)
+{
+	return syscall(SYS_msync, addr, length, flags);
+}